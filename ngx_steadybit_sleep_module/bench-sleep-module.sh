@@ -0,0 +1,305 @@
+#!/bin/bash
+#
+# Copyright 2025 steadybit GmbH. All rights reserved.
+#
+
+#
+# Benchmark script for ngx_steadybit_sleep_module.c
+# This script builds nginx with and without the sleep module and measures
+# throughput, CPU per request, memory per sleeper and wake-time accuracy
+# with wrk. Settings can be overridden through the environment; durations
+# are given in seconds, e.g. BENCH_DURATION=30s. Linux only.
+#
+
+set -e  # Exit on error
+
+# Configuration
+NGINX_VERSION="${NGINX_VERSION:-1.27.4}"
+BENCH_PORT="${BENCH_PORT:-8899}"  # Port of the benchmarked server
+BENCH_DIR="${BENCH_DIR:-/tmp/nginx-delay-bench}"
+BENCH_THREADS="${BENCH_THREADS:-2}"  # wrk threads per wrk process
+BENCH_CONNECTIONS="${BENCH_CONNECTIONS:-100}"  # Connections for the overhead runs
+BENCH_DURATION="${BENCH_DURATION:-10s}"  # Duration of the overhead runs
+BENCH_RATE="${BENCH_RATE:-}"  # Fixed request rate (wrk2 -R), empty for as fast as possible
+BENCH_SLEEPERS="${BENCH_SLEEPERS:-1000 10000 100000}"  # Concurrent sleepers per run
+BENCH_SLEEP_MS="${BENCH_SLEEP_MS:-1000}"  # Delay of every sleeping request
+BENCH_SLEEP_DURATION="${BENCH_SLEEP_DURATION:-15s}"  # Duration of the sleeper runs
+BENCH_SCHEDULERS="${BENCH_SCHEDULERS:-timer wheel precise}"  # sb_sleep_scheduler values to compare
+WRK="${WRK:-wrk}"
+
+# Connections per wrk process; each one targets its own loopback address,
+# so 100k sleepers do not run out of ephemeral ports
+CONNS_PER_CLIENT=25000
+
+echo "=== Benchmarking ngx_steadybit_sleep_module ==="
+echo "Using NGINX version: $NGINX_VERSION"
+echo "Using port: $BENCH_PORT"
+
+if ! command -v "$WRK" > /dev/null; then
+    echo "❌ $WRK not found. Install wrk (or wrk2 for BENCH_RATE) or set WRK."
+    exit 1
+fi
+
+if [ -n "$BENCH_RATE" ] && ! "$WRK" --help 2>&1 | grep -q -- '--rate'; then
+    echo "❌ BENCH_RATE needs wrk2, $WRK does not support --rate."
+    exit 1
+fi
+
+# Sleepers hold one descriptor each on both ends
+ulimit -n 1048576 2> /dev/null || ulimit -n "$(ulimit -Hn)"
+for n in $BENCH_SLEEPERS; do
+    if [ "$(ulimit -n)" != unlimited ] && [ "$(ulimit -n)" -lt $((n * 2 + 1024)) ]; then
+        echo "❌ Open file limit $(ulimit -n) is too low for $n sleepers."
+        exit 1
+    fi
+done
+
+ORIGINAL_DIR=$(pwd)
+mkdir -p $BENCH_DIR
+cd $BENCH_DIR
+
+# Download and extract Nginx
+if [ ! -f "nginx-$NGINX_VERSION.tar.gz" ]; then
+  echo "Downloading Nginx $NGINX_VERSION..."
+  curl -s -O "https://nginx.org/download/nginx-$NGINX_VERSION.tar.gz"
+fi
+
+if [ ! -d "nginx-$NGINX_VERSION" ]; then
+  echo "Extracting Nginx..."
+  tar -xzf "nginx-$NGINX_VERSION.tar.gz"
+fi
+
+# Copy the module source and config
+echo "Copying sleep module source..."
+mkdir -p $BENCH_DIR/sleep
+cp $ORIGINAL_DIR/ngx_steadybit_sleep_module.c $ORIGINAL_DIR/config $BENCH_DIR/sleep/
+
+# Build a baseline without the module and one with it, both without debug logging
+cd $BENCH_DIR/nginx-$NGINX_VERSION
+
+echo "Building baseline Nginx..."
+./configure --prefix=$BENCH_DIR/base --with-compat > /dev/null
+make -j"$(nproc)" > /dev/null
+make install > /dev/null
+
+echo "Building Nginx with sleep module..."
+./configure --prefix=$BENCH_DIR/module --with-compat --add-dynamic-module=../sleep > /dev/null
+make -j"$(nproc)" > /dev/null
+make install > /dev/null
+
+# Sleeping requests serve a static file, so they pass the access phase
+echo "Sleep benchmark page" > $BENCH_DIR/module/html/sleep.html
+
+cd $BENCH_DIR
+
+# wrk script printing the summary in a form that is easy to add up
+cat > $BENCH_DIR/report.lua << 'EOF'
+done = function(summary, latency, requests)
+    local e = summary.errors
+    io.write(string.format("requests %d\n", summary.requests))
+    io.write(string.format("errors %d\n", e.connect + e.read + e.write + e.timeout + e.status))
+    io.write(string.format("p50_us %d\n", latency:percentile(50)))
+    io.write(string.format("p99_us %d\n", latency:percentile(99)))
+    io.write(string.format("p999_us %d\n", latency:percentile(99.9)))
+end
+EOF
+
+# Write nginx.conf for a variant: base, module, zone (module with an empty
+# sb_sleep_zone) or sleep (module with a sleeping location). Every variant
+# serves /index.html without a delay.
+write_conf() {
+    local prefix=$1 variant=$2 scheduler=${3:-timer}
+    local load="" zone="" location=""
+
+    if [ "$variant" != base ]; then
+        load="load_module $prefix/modules/ngx_steadybit_sleep_module.so;"
+    fi
+
+    if [ "$variant" = zone ]; then
+        zone="sb_sleep_zone bench 1m;"
+    fi
+
+    if [ "$variant" = sleep ]; then
+        location="location = /sleep.html {
+            sb_sleep_scheduler $scheduler;
+            sb_sleep_ms $BENCH_SLEEP_MS;
+            access_log $prefix/logs/sleep.log sleep buffer=1m;
+        }"
+    fi
+
+    cat > $prefix/conf/nginx.conf << EOF
+$load
+
+worker_processes 1;
+worker_rlimit_nofile 1048576;
+error_log $prefix/logs/error.log warn;
+pid $prefix/logs/nginx.pid;
+
+events {
+    worker_connections 262144;
+    multi_accept on;
+}
+
+http {
+    access_log off;
+    keepalive_requests 1000000;
+    $zone
+
+    log_format sleep '\$sb_sleep_requested_ms \$sb_sleep_actual_ms';
+
+    server {
+        listen $BENCH_PORT backlog=65535;
+        root $prefix/html;
+
+        $location
+    }
+}
+EOF
+}
+
+# Start nginx from a prefix and remember the worker pid
+start_nginx() {
+    local prefix=$1
+
+    rm -f $prefix/logs/*.log
+    $prefix/sbin/nginx -p $prefix -c $prefix/conf/nginx.conf
+    sleep 1
+    WORKER_PID=$(pgrep -P "$(cat $prefix/logs/nginx.pid)" | head -n 1)
+}
+
+stop_nginx() {
+    local prefix=$1
+
+    $prefix/sbin/nginx -p $prefix -c $prefix/conf/nginx.conf -s quit
+    while [ -f $prefix/logs/nginx.pid ]; do
+        sleep 0.2
+    done
+}
+
+cpu_ticks() {
+    awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+rss_kb() {
+    awk '/^VmRSS/ { print $2 }' /proc/$1/status
+}
+
+# Run wrk with the given connections against a path, spread over as many
+# wrk processes and loopback addresses as needed, and add up the results
+run_wrk() {
+    local conns=$1 path=$2 duration=$3
+    local clients=$(( (conns + CONNS_PER_CLIENT - 1) / CONNS_PER_CLIENT ))
+    local i c rate=""
+
+    rm -f $BENCH_DIR/wrk.*.out
+
+    for i in $(seq 1 $clients); do
+        c=$(( conns / clients ))
+        [ $i -le $(( conns % clients )) ] && c=$(( c + 1 ))
+        [ -n "$BENCH_RATE" ] && rate="--rate $(( BENCH_RATE / clients ))"
+
+        "$WRK" -t"$BENCH_THREADS" -c"$c" -d"$duration" --timeout 60s $rate \
+            -s $BENCH_DIR/report.lua "http://127.0.0.$i:$BENCH_PORT$path" \
+            > $BENCH_DIR/wrk.$i.out 2>&1 &
+    done
+
+    wait
+
+    # Requests and errors add up; for latencies the worst client is reported
+    cat $BENCH_DIR/wrk.*.out | awk '
+        $1 == "requests" { req += $2 }
+        $1 == "errors" { err += $2 }
+        $1 ~ /^p[0-9]+_us$/ { if ($2 > lat[$1]) lat[$1] = $2 }
+        END { printf "%d %d %d %d %d\n", req, err, lat["p50_us"], lat["p99_us"], lat["p999_us"] }'
+}
+
+seconds() {
+    echo "${1%s}"
+}
+
+CLK_TCK=$(getconf CLK_TCK)
+RESULTS=$BENCH_DIR/results.txt
+: > $RESULTS
+
+# Overhead of the module on a location that does not sleep
+echo ""
+echo "=== Overhead on a non-sleeping location ==="
+printf "%-8s %12s %10s %10s %10s %10s %8s\n" \
+    variant "req/s" "cpu_us/req" "p50_us" "p99_us" "p999_us" errors | tee -a $RESULTS
+
+for variant in base module zone; do
+    prefix=$BENCH_DIR/module
+    [ $variant = base ] && prefix=$BENCH_DIR/base
+
+    write_conf $prefix $variant
+    start_nginx $prefix
+
+    run_wrk "$BENCH_CONNECTIONS" /index.html 2s > /dev/null  # Warm up
+
+    ticks=$(cpu_ticks $WORKER_PID)
+    read -r req err p50 p99 p999 < <(run_wrk "$BENCH_CONNECTIONS" /index.html "$BENCH_DURATION")
+    ticks=$(( $(cpu_ticks $WORKER_PID) - ticks ))
+
+    stop_nginx $prefix
+
+    awk -v v=$variant -v req=$req -v err=$err -v t=$ticks -v hz=$CLK_TCK \
+        -v d="$(seconds $BENCH_DURATION)" -v p50=$p50 -v p99=$p99 -v p999=$p999 'BEGIN {
+        printf "%-8s %12.0f %10.2f %10d %10d %10d %8d\n",
+               v, req / d, req ? t * 1000000 / hz / req : 0, p50, p99, p999, err }' \
+        | tee -a $RESULTS
+done
+
+# Many concurrent sleepers: memory, CPU and how late they wake up
+echo ""
+echo "=== Concurrent sleepers of ${BENCH_SLEEP_MS}ms ==="
+printf "%-6s %8s %10s %10s %12s %10s %10s %10s %8s\n" \
+    sched sleepers "req/s" "cpu_us/req" "rss_B/sleep" "late_p50" "late_p99" "late_p999" errors \
+    | tee -a $RESULTS
+
+for scheduler in $BENCH_SCHEDULERS; do
+    for n in $BENCH_SLEEPERS; do
+        prefix=$BENCH_DIR/module
+
+        write_conf $prefix sleep $scheduler
+        start_nginx $prefix
+
+        idle=$(rss_kb $WORKER_PID)
+        ticks=$(cpu_ticks $WORKER_PID)
+
+        run_wrk "$n" /sleep.html "$BENCH_SLEEP_DURATION" > $BENCH_DIR/sleep.out &
+        wrk_pid=$!
+
+        # Sample the peak RSS while the sleepers are parked
+        peak=$idle
+        while kill -0 $wrk_pid 2> /dev/null; do
+            rss=$(rss_kb $WORKER_PID)
+            [ "$rss" -gt "$peak" ] && peak=$rss
+            sleep 0.5
+        done
+
+        read -r req err p50 p99 p999 < $BENCH_DIR/sleep.out
+        ticks=$(( $(cpu_ticks $WORKER_PID) - ticks ))
+
+        stop_nginx $prefix  # Flushes the access log
+
+        # Wake-time accuracy: actual minus requested sleep of every request
+        read -r late50 late99 late999 < <(
+            awk '$1 != "-" && $2 != "-" { print $2 - $1 }' $prefix/logs/sleep.log \
+            | sort -n | awk '
+                function pct(p,  i) { i = int(NR * p); if (i < NR * p) i++; return v[i] }
+                { v[NR] = $1 }
+                END { if (NR == 0) print "0 0 0"; else print pct(0.5), pct(0.99), pct(0.999) }')
+
+        awk -v s=$scheduler -v n=$n -v req=$req -v err=$err -v t=$ticks -v hz=$CLK_TCK \
+            -v d="$(seconds $BENCH_SLEEP_DURATION)" -v idle=$idle -v peak=$peak \
+            -v l50=$late50 -v l99=$late99 -v l999=$late999 'BEGIN {
+            printf "%-6s %8d %10.0f %10.2f %12.0f %10s %10s %10s %8d\n",
+                   s, n, req / d, req ? t * 1000000 / hz / req : 0,
+                   (peak - idle) * 1024 / n, l50 "ms", l99 "ms", l999 "ms", err }' \
+            | tee -a $RESULTS
+    done
+done
+
+echo ""
+echo "=== Benchmark completed ==="
+echo "Results: $RESULTS"
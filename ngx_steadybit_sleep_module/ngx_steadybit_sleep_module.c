@@ -16,15 +16,421 @@
  #include <ngx_core.h>   // NGINX core definitions
  #include <ngx_http.h>   // NGINX HTTP module definitions
  #include <ngx_http_core_module.h> // NGINX HTTP core module definitions
+ #include <math.h>                 // log(), exp() for distribution tables
+ #if (NGX_LINUX)
+ #include <sys/timerfd.h>          // timerfd_create() for the precise scheduler
+ #endif
+ #if (NGX_STREAM)
+ #include <ngx_stream.h>           // NGINX stream module definitions
+ #endif
+
+ /* Logging modes for the sb_sleep_log directive */
+ #define NGX_HTTP_SLEEP_LOG_OFF      0  /* No per-request logging */
+ #define NGX_HTTP_SLEEP_LOG_DEBUG    1  /* Per-request logging at debug level only */
+ #define NGX_HTTP_SLEEP_LOG_NOTICE   2  /* Per-request logging at notice level */
+ #define NGX_HTTP_SLEEP_LOG_SAMPLED  3  /* Notice level for every Nth delayed request */
+
+ /* Annotation targets for the sb_sleep_annotate directive */
+ #define NGX_HTTP_SLEEP_ANNOTATE_OFF        0x0002
+ #define NGX_HTTP_SLEEP_ANNOTATE_RESPONSE   0x0004  /* X-Sb-Injected-Delay response header */
+ #define NGX_HTTP_SLEEP_ANNOTATE_UPSTREAM   0x0008  /* X-Sb-Injected-Delay request header */
+ #define NGX_HTTP_SLEEP_ANNOTATE_TRACESTATE 0x0010  /* sb entry in the W3C tracestate request header */
+
+ /* Schedulers for the sb_sleep_scheduler directive */
+ #define NGX_HTTP_SLEEP_SCHED_TIMER  0  /* One nginx timer per sleeping request */
+ #define NGX_HTTP_SLEEP_SCHED_WHEEL  1  /* Per-worker hierarchical timing wheel */
+ #define NGX_HTTP_SLEEP_SCHED_PRECISE  2  /* Per-worker timerfd driving a heap, in microseconds */
+
+ /* Initial number of sleepers the precise scheduler's heap holds */
+ #define NGX_HTTP_SLEEP_PRECISE_HEAP  64
+
+ /* Timing wheel geometry: 5 levels of 64 slots cover 2^30 ms (about 12 days) */
+ #define NGX_HTTP_SLEEP_WHEEL_BITS    6
+ #define NGX_HTTP_SLEEP_WHEEL_SLOTS   (1 << NGX_HTTP_SLEEP_WHEEL_BITS)
+ #define NGX_HTTP_SLEEP_WHEEL_MASK    (NGX_HTTP_SLEEP_WHEEL_SLOTS - 1)
+ #define NGX_HTTP_SLEEP_WHEEL_LEVELS  5
+ #define NGX_HTTP_SLEEP_WHEEL_MAX                                              \
+     (((ngx_msec_t) 1 << (NGX_HTTP_SLEEP_WHEEL_BITS * NGX_HTTP_SLEEP_WHEEL_LEVELS)) - 1)
+
+ /* Delay distributions for the sb_sleep_dist directive */
+ #define NGX_HTTP_SLEEP_DIST_UNIFORM    0
+ #define NGX_HTTP_SLEEP_DIST_NORMAL     1
+ #define NGX_HTTP_SLEEP_DIST_LOGNORMAL  2
+ #define NGX_HTTP_SLEEP_DIST_PARETO     3
+
+ /* Inverse-CDF lookup tables have 2^12 entries, indexed by the top PRNG bits */
+ #define NGX_HTTP_SLEEP_DIST_BITS   12
+ #define NGX_HTTP_SLEEP_DIST_SIZE   (1 << NGX_HTTP_SLEEP_DIST_BITS)
+
+ /**
+  * Delay Distribution Structure
+  *
+  * Parameters of a sb_sleep_dist directive and the inverse-CDF table built
+  * from them when the location configuration is merged. Sampling a delay
+  * is a single table lookup at a random index.
+  */
+ typedef struct {
+     ngx_uint_t  type;        /* One of NGX_HTTP_SLEEP_DIST_* */
+     double      p1;          /* min (uniform, pareto), mean (normal, lognormal) */
+     double      p2;          /* max (uniform), stddev (normal), p99 (lognormal), alpha (pareto) */
+     double      cap;         /* Upper bound for sampled delays, 0 for none */
+     uint32_t   *table;       /* Delays in milliseconds at evenly spaced quantiles */
+ } ngx_http_sleep_dist_t;
+
+ /* Ramp curves for the sb_sleep_ramp directive */
+ #define NGX_HTTP_SLEEP_RAMP_LINEAR  0
+ #define NGX_HTTP_SLEEP_RAMP_EXP     1
+
+ /**
+  * Delay Ramp Structure
+  *
+  * A delay that moves from one value to another over a period of time,
+  * as configured by sb_sleep_ramp or set with a runtime rule.
+  */
+ typedef struct {
+     ngx_msec_t  from;        /* Delay in milliseconds at the start */
+     ngx_msec_t  to;          /* Delay in milliseconds at the end and after */
+     ngx_msec_t  over;        /* Ramp duration in milliseconds, 0 for none */
+     ngx_uint_t  curve;       /* One of NGX_HTTP_SLEEP_RAMP_* */
+ } ngx_http_sleep_ramp_t;
+
+ /* Rule key types of the shared rule zone */
+ #define NGX_HTTP_SLEEP_KEY_LOCATION  1  /* Keyed by location name, e.g. "/api" */
+ #define NGX_HTTP_SLEEP_KEY_HOST      2  /* Keyed by the request's host name */
+ #define NGX_HTTP_SLEEP_KEY_STREAM    3  /* Keyed by a stream listen address, e.g. "0.0.0.0:5432" */
+
+ /* Rule slot states; deleted slots keep probe chains intact */
+ #define NGX_HTTP_SLEEP_RULE_EMPTY    0
+ #define NGX_HTTP_SLEEP_RULE_USED     1
+ #define NGX_HTTP_SLEEP_RULE_DELETED  2
+
+ #define NGX_HTTP_SLEEP_KEY_MAX       128  /* Maximum rule key length */
+ #define NGX_HTTP_SLEEP_READ_TRIES    4    /* Seqlock read attempts before giving up */
+
+ /* Whether a rule's TTL has run out; ngx_current_msec is monotonic and system-wide */
+ #define ngx_http_sleep_rule_expired(rule)                                     \
+     ((rule)->expires && (ngx_msec_int_t) ((rule)->expires - ngx_current_msec) <= 0)
+
+ /**
+  * Delay Rule Structure
+  *
+  * One slot of the open-addressing rule table in shared memory.
+  */
+ typedef struct {
+     uint32_t    hash;                      /* Hash of type and key */
+     u_char      state;                     /* One of NGX_HTTP_SLEEP_RULE_* */
+     u_char      type;                      /* One of NGX_HTTP_SLEEP_KEY_* */
+     u_char      len;                       /* Key length */
+     u_char      key[NGX_HTTP_SLEEP_KEY_MAX]; /* Location or host name */
+     ngx_msec_t  delay;                     /* Delay in milliseconds, 0 disables sleeping */
+     ngx_uint_t  percent;                   /* Share of delayed requests in hundredths of a percent */
+     ngx_msec_t  expires;                   /* Expiry on the monotonic clock, 0 for none */
+     ngx_http_sleep_ramp_t ramp;            /* Ramp towards delay, if ramp.over is set */
+     ngx_msec_t  started;                   /* Start of the ramp on the monotonic clock */
+ } ngx_http_sleep_rule_t;
+
+ /**
+  * Shared Rule Table Structure
+  *
+  * Lives in the shared zone. Writers serialize on the slab pool mutex and
+  * make seq odd while they modify the table. Readers never lock: they retry
+  * if seq was odd or changed while they read, so workers always see either
+  * the old or the new version of a rule.
+  */
+ typedef struct {
+     ngx_atomic_t           seq;      /* Seqlock counter, odd during updates */
+     ngx_atomic_t           nrules;   /* Number of used slots */
+     ngx_uint_t             nslots;   /* Table size, a power of two */
+     ngx_http_sleep_rule_t  rules[1]; /* The rule slots */
+ } ngx_http_sleep_shctx_t;
+
+ /**
+  * Shared Zone Context
+  *
+  * Per-process view of the shared rule zone.
+  */
+ typedef struct {
+     ngx_http_sleep_shctx_t  *sh;     /* Rule table in shared memory */
+     ngx_slab_pool_t         *shpool; /* Slab pool of the zone */
+ } ngx_http_sleep_zone_ctx_t;
+
+ /* Request attributes matched by sb_sleep_rule */
+ #define NGX_HTTP_SLEEP_MATCH_HEADER  0  /* A request header */
+ #define NGX_HTTP_SLEEP_MATCH_COOKIE  1  /* A cookie */
+
+ /**
+  * Request Matcher Structure
+  *
+  * All sb_sleep_rule values of one header or cookie, compiled into a hash
+  * of values to delays. Values are matched case-insensitively.
+  */
+ typedef struct {
+     ngx_uint_t    source;     /* One of NGX_HTTP_SLEEP_MATCH_* */
+     ngx_str_t     name;       /* Header name in lowercase, or cookie name */
+     ngx_uint_t    name_hash;  /* Hash of a lowercase header name, as in ngx_table_elt_t */
+     size_t        max_len;    /* Longest value, longer ones cannot match */
+     ngx_array_t  *keys;       /* Values as ngx_hash_key_t, used to build the hash */
+     ngx_hash_t    hash;       /* Values to delays (ngx_msec_t *) */
+ } ngx_http_sleep_matcher_t;
+
+ /* Points in request processing where the sleep is injected */
+ #define NGX_HTTP_SLEEP_AT_ACCESS      0  /* Before content is generated */
+ #define NGX_HTTP_SLEEP_AT_HEADER      1  /* Before the response header is sent */
+ #define NGX_HTTP_SLEEP_AT_BODY_CHUNK  2  /* Before every chain of response body */
+ #define NGX_HTTP_SLEEP_AT_LAST_BUF    3  /* Before the end of the response */
+
+ /* Filters installed when some location needs them, see ngx_http_sleep_init */
+ #define NGX_HTTP_SLEEP_FILTER_HEADER        0x0001  /* Filter sleep points and response annotation */
+ #define NGX_HTTP_SLEEP_FILTER_BODY          0x0002  /* Body sleep points and throttling */
+ #define NGX_HTTP_SLEEP_FILTER_REQUEST_BODY  0x0004  /* Request body pauses */
+
+ /* Scopes of access sleeps, see sb_sleep_scope */
+ #define NGX_HTTP_SLEEP_SCOPE_REQUEST     0  /* Every request decides and sleeps on its own */
+ #define NGX_HTTP_SLEEP_SCOPE_CONNECTION  1  /* One decision and one timer per client connection */
+
+ /* Requests that may sleep, see sb_sleep_once */
+ #define NGX_HTTP_SLEEP_ONCE_MAIN  0  /* The client request sleeps once, also across internal redirects */
+ #define NGX_HTTP_SLEEP_ONCE_EACH  1  /* Subrequests and every internal redirect may sleep as well */
+
+ /*
+  * Connection buffered flag set while the throttle holds back output. Of
+  * c->buffered, SSL uses 0x01, the image filter 0x08, the write filter 0x10
+  * and gzip 0x20; 0x40 is owned by no stock module and, like the latter two,
+  * lies within NGX_HTTP_LOWLEVEL_BUFFERED, as befits output queued for the wire.
+  */
+ #define NGX_HTTP_SLEEP_THROTTLE_BUFFERED  0x40
+
+ /**
+  * Throttle State Structure
+  *
+  * Token bucket of a throttled response. Output that exceeds the bucket is
+  * held back by reference; buffers are split with shadow buffers pointing
+  * into the original memory or file range, so nothing is copied.
+  */
+ typedef struct {
+     ngx_http_request_t  *request;  /* The throttled request */
+     ngx_chain_t         *pending;  /* Output held back, in order */
+     ngx_chain_t         *free;     /* Shadow buffers ready for reuse */
+     ngx_chain_t         *busy;     /* Buffers passed on but not yet sent */
+     off_t                offset;   /* Bytes of the first pending buffer already passed on */
+     off_t                tokens;   /* Bytes that may be passed on right now */
+     size_t               rate;     /* Refill rate in bytes per second */
+     size_t               burst;    /* Bucket size in bytes */
+     ngx_msec_t           last;     /* Time of the last refill */
+     ngx_event_t          event;    /* Timer waiting for the bucket to refill */
+ } ngx_http_sleep_throttle_t;
+
+ /**
+  * Request Body Pause Structure
+  *
+  * State of "sb_sleep_request_body". Body data read while paused is held
+  * back by reference; the reader then finds its single buffer busy and stops
+  * reading, so the rest of the body stays in the socket buffer.
+  */
+ typedef struct {
+     ngx_http_request_t  *request;  /* The request whose body is read */
+     ngx_chain_t         *held;     /* Body data held back, in order */
+     off_t                passed;   /* Body bytes seen so far */
+     off_t                next;     /* Byte count that starts the next pause */
+     ngx_msec_t           delay;    /* Length of each pause */
+     off_t                every;    /* Bytes between pauses, 0 to pause once */
+     ngx_event_t          event;    /* Timer ending the pause */
+ } ngx_http_sleep_rbody_t;
+
+ /**
+  * Upstream Delay Rule Structure
+  *
+  * One sb_upstream_sleep_ms directive of an upstream block.
+  */
+ typedef struct {
+     ngx_str_t   peer;   /* Peer address to match, empty for all peers */
+     ngx_msec_t  delay;  /* Delay before the request is sent to the peer */
+ } ngx_http_sleep_upstream_rule_t;
+
+ /**
+  * Upstream Configuration Structure
+  *
+  * Per upstream block; keeps the balancer callbacks that are wrapped.
+  */
+ typedef struct {
+     ngx_array_t                     *rules;  /* ngx_http_sleep_upstream_rule_t, NULL if not used */
+     ngx_http_upstream_init_pt        original_init_upstream;
+     ngx_http_upstream_init_peer_pt   original_init_peer;
+ } ngx_http_sleep_srv_conf_t;
+
+ /**
+  * Upstream Peer Data Structure
+  *
+  * Per request; wraps the balancer's peer data and the upstream's output
+  * filter, which holds the request back while the delay runs.
+  */
+ typedef struct {
+     ngx_http_sleep_srv_conf_t       *conf;
+     ngx_http_request_t              *request;
+     void                            *data;            /* The balancer's peer data */
+     ngx_event_get_peer_pt            original_get_peer;
+     ngx_event_free_peer_pt           original_free_peer;
+ #if (NGX_HTTP_SSL)
+     ngx_event_set_peer_session_pt    original_set_session;
+     ngx_event_save_peer_session_pt   original_save_session;
+ #endif
+     ngx_output_chain_filter_pt       original_output;  /* The upstream's output filter */
+     void                            *output_ctx;       /* Its context */
+     ngx_msec_t                       delay;   /* Delay of the current attempt, 0 once started */
+     ngx_chain_t                     *held;    /* Request output held back while sleeping */
+     ngx_event_t                      event;   /* Delay timer */
+ } ngx_http_sleep_upstream_peer_t;
+
+ /* Statistics slots; workers beyond this many share slots */
+ #define NGX_HTTP_SLEEP_STATS_SLOTS    64
+ #define NGX_HTTP_SLEEP_SKEW_BUCKETS   60  /* Finite wake skew buckets, up to 65535 ms */
+
+ /**
+  * Worker Statistics Structure
+  *
+  * One slot per worker in the statistics zone, padded to whole cache lines
+  * so workers never write to the same line. Counters are updated atomically
+  * because an old worker may still be sleeping requests in a slot after a
+  * reload has started a new worker with the same number.
+  */
+ typedef struct {
+     ngx_atomic_t  active;      /* Requests currently sleeping */
+     ngx_atomic_t  delayed;     /* Requests delayed in total */
+     ngx_atomic_t  aborted;     /* Requests terminated while sleeping */
+     ngx_atomic_t  faulted;     /* Requests failed or reset by sb_fault */
+     ngx_atomic_t  slept_ms;    /* Milliseconds slept in total */
+     ngx_atomic_t  skew_sum;    /* Sum of wake skews in milliseconds */
+     ngx_atomic_t  skew[NGX_HTTP_SLEEP_SKEW_BUCKETS + 1]; /* Wake skew histogram, last bucket unbounded */
+ } ngx_http_sleep_stats_t;
+
+ /* Shared concurrency counters, each on its own cache line */
+ #define NGX_HTTP_SLEEP_LIMIT_STRIDE  NGX_CPU_CACHE_LINE
+
+ /**
+  * Limit Key Structure
+  *
+  * Identity of a shared concurrency or budget counter: its server and a
+  * checksum of its location and directive. The server name is read once
+  * the http block is parsed, as server_name may follow the location.
+  */
+ typedef struct {
+     ngx_http_core_srv_conf_t  *cscf;  /* Server of the directive */
+     uint32_t                   crc;   /* Checksum of the location name and the directive */
+ } ngx_http_sleep_limit_key_t;
+
+ #define NGX_HTTP_SLEEP_STATS_STRIDE                                           \
+     ngx_align(sizeof(ngx_http_sleep_stats_t), NGX_CPU_CACHE_LINE)
+
+ /**
+  * Request Budget Structure
+  *
+  * State of a sb_sleep_budget directive. Workers claim requests from the
+  * shared counter in chunks and use them up from their own copy of the
+  * structure, so the shared cache line is touched once per chunk.
+  */
+ typedef struct {
+     ngx_atomic_uint_t  total;      /* Number of requests that may be delayed */
+     ngx_atomic_uint_t  chunk;      /* Largest number of requests claimed at once */
+     ngx_uint_t         slot;       /* Counter of claimed requests in the limits zone */
+     ngx_atomic_uint_t  cached;     /* Requests claimed by this worker and not yet used */
+     ngx_flag_t         exhausted;  /* Flag indicating the budget is used up */
+ } ngx_http_sleep_budget_t;
+
+ /**
+  * Fault Structure
+  *
+  * One sb_fault directive: the share of requests that fail with a status
+  * or have their connection reset.
+  */
+ typedef struct {
+     ngx_uint_t  status;      /* Response status, NGX_HTTP_CLOSE for a reset */
+     ngx_uint_t  percent;     /* Share of requests in hundredths of a percent */
+ } ngx_http_sleep_fault_t;
+
+ /* Default number of requests a worker claims from a budget at once */
+ #define NGX_HTTP_SLEEP_BUDGET_CHUNK  64
+
+ /* Hash buckets of the interned sb_sleep_ms and sb_sleep_us values */
+ #define NGX_HTTP_SLEEP_VALUE_BUCKETS  1024
+
+ /**
+  * Delay Value Structure
+  *
+  * A compiled sb_sleep_ms or sb_sleep_us value. Values are interned while
+  * the configuration is parsed: all locations with the same literal or
+  * expression point to one shared, read-only entry, so large generated
+  * configurations compile and store each distinct value once. Literals
+  * are parsed and validated at that point.
+  */
+ typedef struct ngx_http_sleep_value_s  ngx_http_sleep_value_t;
+
+ struct ngx_http_sleep_value_s {
+     ngx_http_complex_value_t   cv;     /* Compiled value */
+     ngx_int_t                  value;  /* Constant duration, NGX_CONF_UNSET if it has variables */
+     ngx_flag_t                 us;     /* Value is in microseconds, set by sb_sleep_us */
+     ngx_str_t                  source; /* Directive argument, the interning key */
+     ngx_http_sleep_value_t    *next;   /* Next entry in the same bucket */
+ };
+
+ /**
+  * Main Configuration Structure
+  *
+  * Stores settings that apply to the whole http block, shared by all
+  * locations of a worker process.
+  */
+ typedef struct {
+     ngx_int_t        ctx_pool_size;  /* Number of preallocated sleep contexts per worker */
+     ngx_shm_zone_t  *shm_zone;       /* Shared rule zone, NULL if not configured */
+     ngx_shm_zone_t  *stats_zone;     /* Statistics zone, NULL without sb_sleep_status */
+     ngx_shm_zone_t  *limits_zone;    /* Shared concurrency and budget counters, NULL if none */
+     ngx_uint_t       nlimits;        /* Number of shared concurrency and budget counters */
+     ngx_array_t      limit_keys;     /* Identity of each shared counter, an ngx_http_sleep_limit_key_t */
+     ngx_uint_t       phases;         /* Bit mask of the phases locations sleep in, set at merge */
+     ngx_uint_t       filters;        /* Bit mask of the NGX_HTTP_SLEEP_FILTER_* locations need, set at merge */
+     ngx_flag_t       precise;        /* Some location uses the precise scheduler, set at merge */
+     ngx_http_sleep_value_t **values; /* Buckets of interned delay values, NULL until the first */
+ } ngx_http_sleep_main_conf_t;
 
  /**
   * Location Configuration Structure
   *
   * Stores the sleep duration configuration for each location block.
-  * The sleep_ms field can contain complex values (variables, expressions).
+  * The sleep_ms field points to a shared compiled value, which can
+  * contain variables; plain literals are parsed once at configuration
+  * time so requests skip evaluation.
   */
  typedef struct {
-     ngx_http_complex_value_t  *sleep_ms;  /* Sleep duration in milliseconds (can be a variable/expression) */
+     ngx_http_sleep_value_t    *sleep_ms;  /* Sleep duration of sb_sleep_ms or sb_sleep_us, NULL if none */
+     ngx_http_sleep_dist_t     *dist;      /* Delay distribution, used instead of sleep_ms if set */
+     ngx_http_sleep_ramp_t     *ramp;      /* Delay ramp, used instead of sleep_ms if set */
+     ngx_msec_t                 ramp_start; /* Start of the ramp on the monotonic clock */
+     ngx_uint_t                 percent;   /* Share of delayed requests in hundredths of a percent */
+     uint32_t                   percent_threshold; /* Percent scaled to the 32-bit PRNG range */
+     ngx_str_t                  loc_name;  /* Location name, the key of location rules */
+     uint32_t                   loc_hash;  /* Precomputed rule hash of loc_name */
+     ngx_uint_t                 log_mode;  /* One of NGX_HTTP_SLEEP_LOG_* */
+     ngx_uint_t                 log_sample; /* Sampling interval for NGX_HTTP_SLEEP_LOG_SAMPLED */
+     ngx_uint_t                 scheduler; /* One of NGX_HTTP_SLEEP_SCHED_* */
+     ngx_uint_t                 at;        /* One of NGX_HTTP_SLEEP_AT_* */
+     ngx_uint_t                 phase;     /* Request phase of access sleeps, e.g. NGX_HTTP_ACCESS_PHASE */
+     ngx_uint_t                 scope;     /* One of NGX_HTTP_SLEEP_SCOPE_* */
+     ngx_uint_t                 once;      /* One of NGX_HTTP_SLEEP_ONCE_* */
+     ngx_uint_t                 batch_max; /* Maximum wake-ups resumed per event loop iteration, 0 for no limit */
+     ngx_msec_t                 batch_spread; /* Maximum random jitter added to each delay */
+     ngx_http_complex_value_t  *throttle_rate; /* Response body rate in bytes per second, NULL if not throttled */
+     size_t                     throttle_burst; /* Token bucket size, 0 for a tenth of the rate */
+     ngx_msec_t                 rbody_delay; /* Pause while reading the request body, 0 for none */
+     off_t                      rbody_every; /* Body bytes between pauses, 0 to pause once */
+     ngx_uint_t                 max_concurrent; /* Maximum concurrent sleeps, 0 for no limit */
+     ngx_atomic_t              *concurrent; /* Per-worker sleep counter, NULL for a shared one */
+     ngx_uint_t                 concurrent_slot; /* Counter index in the limits zone if shared */
+     ngx_uint_t                 concurrent_status; /* Rejection status at the limit, 0 to skip the delay */
+     ngx_array_t               *matchers;  /* ngx_http_sleep_matcher_t of sb_sleep_rule, NULL if none */
+     ngx_http_sleep_budget_t   *budget;    /* Budget of delayed requests, NULL for none */
+     ngx_array_t               *faults;    /* ngx_http_sleep_fault_t of sb_fault, NULL if none */
+     ngx_uint_t                 annotate;  /* Bit mask of NGX_HTTP_SLEEP_ANNOTATE_* */
+     time_t                     window_start; /* Start of the sb_sleep_window, in seconds since the epoch */
+     time_t                     window_end; /* End of the sb_sleep_window, 0 for no window */
  } ngx_http_sleep_loc_conf_t;
 
  /**
@@ -32,29 +438,286 @@
   *
   * This structure maintains the state for each request that is currently sleeping.
   * It's stored in the request context and contains the event timer and request reference.
+  * Contexts are taken from a per-worker free list when one is configured, and
+  * carry their own pool cleanup entry so a delayed request allocates nothing.
+  * Requests that are only throttled get a bare context without a sleep; its
+  * request field stays NULL.
   */
+ typedef struct ngx_http_sleep_conn_s  ngx_http_sleep_conn_t;
+
  typedef struct {
      ngx_event_t  sleep_event;    /* Timer event for waking up after sleep */
      ngx_http_request_t *request; /* Reference to the HTTP request */
      ngx_flag_t  waiting;         /* Flag indicating if request is currently waiting */
      ngx_flag_t  cleaned_up;      /* Flag indicating if context has been cleaned up */
+     ngx_uint_t  log_mode;        /* Logging mode resolved for this request */
+     ngx_flag_t  pooled;          /* Flag indicating the context belongs to the free list */
+     ngx_queue_t queue;           /* Link in the free list, a wheel slot or the wake-up queue */
+     ngx_pool_cleanup_t cln;      /* Embedded cleanup entry for pooled contexts */
+     ngx_uint_t  scheduler;       /* Scheduler the sleep was started with */
+     ngx_msec_t  wake_time;       /* Absolute requested wake time */
+     uint64_t    wake_us;         /* Wake time on the monotonic clock in microseconds, precise scheduler */
+     ngx_uint_t  heap_index;      /* Position in the precise scheduler's heap */
+     ngx_flag_t  in_heap;         /* Flag indicating the context is in the precise scheduler's heap */
+     ngx_msec_t  start_time;      /* Time the sleep started */
+     ngx_msec_t  end_time;        /* Time the request resumed */
+     ngx_uint_t  wheel_level;     /* Wheel level holding the context */
+     ngx_flag_t  in_wheel;        /* Flag indicating the context is linked in a wheel slot */
+     ngx_uint_t  batch_max;       /* Wake-up batch limit of the location */
+     ngx_flag_t  ready;           /* Flag indicating the context waits in the wake-up queue */
+     ngx_http_sleep_throttle_t *throttle; /* Response throttling state, NULL if not throttled */
+     ngx_http_sleep_rbody_t *rbody; /* Request body pause state, NULL if not paused */
+     ngx_uint_t  at;              /* Point the request sleeps at, one of NGX_HTTP_SLEEP_AT_* */
+     ngx_atomic_t *concurrent;    /* Concurrency counter held by the sleep, NULL if none */
+     ngx_http_sleep_conn_t *conn; /* Connection sleep state, NULL for request scope */
+     ngx_flag_t  following;       /* Flag indicating the context waits for the connection's timer */
+     ngx_uint_t  fault;           /* Fault injected once the sleep is over, 0 for none */
+     ngx_flag_t  slept;           /* Flag indicating a sleep was started for the request */
+     ngx_flag_t  budgeted;        /* Flag indicating a filter sleep used the budget */
  } ngx_http_sleep_ctx_t;
 
+ /**
+  * Connection Sleep Structure
+  *
+  * State of "sb_sleep_scope connection", kept in the pool of the client
+  * connection: the decision of its first request, and the context owning
+  * the one timer that all streams sleeping at the same time wake up with.
+  */
+ struct ngx_http_sleep_conn_s {
+     ngx_flag_t             decided;    /* Flag indicating the decision has been made */
+     uint64_t               delay;      /* Delay of the connection's requests in microseconds, 0 if not selected */
+     ngx_http_sleep_ctx_t  *leader;     /* Context owning the timer, NULL while nobody sleeps */
+     ngx_queue_t            followers;  /* Contexts waking up with the leader */
+ };
+
+ /**
+  * Timing Wheel Structure
+  *
+  * Per-worker hierarchical timing wheel. Level 0 has one slot per millisecond,
+  * each higher level covers a 64 times longer span and is cascaded down when
+  * the level below wraps around. A single nginx timer drives the wheel, so
+  * sleeping requests never enter nginx's global timer tree.
+  */
+ typedef struct {
+     ngx_queue_t  slots[NGX_HTTP_SLEEP_WHEEL_LEVELS][NGX_HTTP_SLEEP_WHEEL_SLOTS];
+     ngx_uint_t   counts[NGX_HTTP_SLEEP_WHEEL_LEVELS]; /* Contexts per level */
+     ngx_msec_t   now;            /* Next millisecond to be processed */
+     ngx_event_t  event;          /* The wheel's only nginx timer */
+ } ngx_http_sleep_wheel_t;
+
+ /**
+  * Precise Scheduler Structure
+  *
+  * Per-worker binary min-heap of sleepers ordered by their wake time in
+  * microseconds. A timerfd armed for the earliest one wakes epoll_wait()
+  * at that time, independent of nginx's millisecond timers and
+  * timer_resolution. A backup nginx timer a millisecond later covers a
+  * timerfd that could not be armed and keeps graceful shutdown waiting
+  * for the sleepers.
+  */
+ typedef struct {
+     ngx_http_sleep_ctx_t  **heap;      /* Sleepers, the earliest first */
+     ngx_uint_t              nelts;     /* Number of sleepers */
+     ngx_uint_t              nalloc;    /* Capacity of the heap */
+     ngx_connection_t       *conn;      /* Connection of the timerfd, NULL if unavailable */
+     uint64_t                armed;     /* Wake time the timerfd is set to, 0 if none */
+     ngx_event_t             event;     /* Backup nginx timer */
+ } ngx_http_sleep_precise_t;
+
  /* Function prototypes - these functions implement the module's core functionality */
+ static ngx_int_t ngx_http_sleep_add_variables(ngx_conf_t *cf); // Register $sb_sleep_* variables
+ static ngx_int_t ngx_http_sleep_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data); // Evaluate a $sb_sleep_* variable
  static ngx_int_t ngx_http_sleep_init(ngx_conf_t *cf); // Module initialization function
+ static ngx_int_t ngx_http_sleep_init_process(ngx_cycle_t *cycle); // Worker initialization function
+ static void *ngx_http_sleep_create_main_conf(ngx_conf_t *cf); // Create main config
+ static char *ngx_http_sleep_init_main_conf(ngx_conf_t *cf, void *conf); // Initialize main config
+ static void *ngx_http_sleep_create_srv_conf(ngx_conf_t *cf); // Create upstream config
  static void *ngx_http_sleep_create_loc_conf(ngx_conf_t *cf); // Create location config
  static char *ngx_http_sleep_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child); // Merge location config
  static char *ngx_http_sleep_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_ms directive
- static ngx_int_t ngx_http_sleep_handler(ngx_http_request_t *r); // Main request handler
+ static char *ngx_http_sleep_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_log directive
+ static char *ngx_http_sleep_batch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_batch directive
+ static char *ngx_http_sleep_dist(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_dist directive
+ static char *ngx_http_sleep_percent(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_percent directive
+ static char *ngx_http_sleep_ramp(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_ramp directive
+ static ngx_int_t ngx_http_sleep_ramp_parse(ngx_str_t *value, ngx_http_sleep_ramp_t *ramp); // Parse one ramp parameter
+ static ngx_msec_t ngx_http_sleep_ramp_value(ngx_http_sleep_ramp_t *ramp, ngx_msec_int_t elapsed); // Delay at a point of the ramp
+ static ngx_int_t ngx_http_sleep_dist_build(ngx_conf_t *cf, ngx_http_sleep_dist_t *dist); // Build inverse-CDF table
+ static double ngx_http_sleep_normal_quantile(double p); // Inverse standard normal CDF
+ static char *ngx_http_sleep_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_zone directive
+ static ngx_int_t ngx_http_sleep_init_zone(ngx_shm_zone_t *shm_zone, void *data); // Initialize shared zone
+ static uint32_t ngx_http_sleep_rule_hash(ngx_uint_t type, u_char *key, size_t len); // Hash a rule key
+ static ngx_http_sleep_rule_t *ngx_http_sleep_rule_find(ngx_http_sleep_shctx_t *sh, ngx_uint_t type, u_char *key, size_t len, uint32_t hash); // Probe the rule table
+ static ngx_int_t ngx_http_sleep_zone_read(ngx_http_sleep_shctx_t *sh, ngx_uint_t type, u_char *key, size_t len, uint32_t hash, ngx_http_sleep_rule_t *rule); // Read one rule lock-free
+ static ngx_int_t ngx_http_sleep_zone_lookup(ngx_http_request_t *r, ngx_http_sleep_main_conf_t *smcf, ngx_http_sleep_loc_conf_t *slcf, ngx_http_sleep_rule_t *rule); // Find the rule of a request
+ static char *ngx_http_sleep_api(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_api directive
+ static ngx_int_t ngx_http_sleep_api_handler(ngx_http_request_t *r); // Control endpoint handler
+ static char *ngx_http_sleep_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_status directive
+ static ngx_int_t ngx_http_sleep_init_stats_zone(ngx_shm_zone_t *shm_zone, void *data); // Initialize statistics zone
+ static ngx_int_t ngx_http_sleep_status_handler(ngx_http_request_t *r); // Statistics endpoint handler
+ static void ngx_http_sleep_stats_done(ngx_http_sleep_ctx_t *ctx, ngx_uint_t aborted); // Account a finished sleep
+ static ngx_int_t ngx_http_sleep_body_filter(ngx_http_request_t *r, ngx_chain_t *in); // Throttling body filter
+ static ngx_int_t ngx_http_sleep_throttle_send(ngx_http_request_t *r, ngx_http_sleep_throttle_t *t); // Pass on what the bucket allows
+ static void ngx_http_sleep_throttle_handler(ngx_event_t *ev); // Bucket refill timer handler
+ static void ngx_http_sleep_throttle_cleanup(void *data); // Stop the refill timer
+ static char *ngx_http_sleep_rbody_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_request_body directive
+ static ngx_int_t ngx_http_sleep_request_body_filter(ngx_http_request_t *r, ngx_chain_t *in); // Pause request body reading
+ static void ngx_http_sleep_rbody_handler(ngx_event_t *ev); // End of a request body pause
+ static void ngx_http_sleep_rbody_cleanup(void *data); // Stop the pause timer
+ static char *ngx_http_sleep_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_upstream_sleep_ms directive
+ static char *ngx_http_sleep_window(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_window directive
+ static void ngx_http_sleep_rules_expire(ngx_http_sleep_shctx_t *sh); // Delete rules whose TTL has run out
+static void ngx_http_sleep_rules_tidy(ngx_http_sleep_shctx_t *sh); // Clear deleted slots of the rule table
+ static char *ngx_http_sleep_rule(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_rule directive
+ static ngx_int_t ngx_http_sleep_rules_build(ngx_conf_t *cf, ngx_array_t *matchers); // Compile sb_sleep_rule hashes
+ static ngx_int_t ngx_http_sleep_match(ngx_http_request_t *r, ngx_http_sleep_loc_conf_t *slcf, ngx_msec_t *delay); // Match a request against sb_sleep_rule
+ static char *ngx_http_sleep_max_concurrent(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_max_concurrent directive
+ static char *ngx_http_sleep_budget(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_budget directive
+ static ngx_int_t ngx_http_sleep_limit_slot(ngx_conf_t *cf, ngx_uint_t *slot); // Reserve a limits zone counter
+static ngx_int_t ngx_http_sleep_budget_take(ngx_http_request_t *r, ngx_http_sleep_budget_t *budget); // Use one request of a budget
+ static char *ngx_http_sleep_fault_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_fault directive
+ static ngx_uint_t ngx_http_sleep_fault_pick(ngx_array_t *faults); // Decide on a fault
+ static ngx_int_t ngx_http_sleep_fault(ngx_http_request_t *r, ngx_uint_t status); // Inject a fault
+ static ngx_int_t ngx_http_sleep_annotate_response(ngx_http_request_t *r); // Add the delay header to the response
+ static ngx_int_t ngx_http_sleep_annotate_request(ngx_http_request_t *r, ngx_http_sleep_ctx_t *ctx, ngx_uint_t annotate); // Mark the delay in the upstream request
+ static ngx_int_t ngx_http_sleep_annotate_header(ngx_http_request_t *r, ngx_list_t *headers, ngx_str_t *key, u_char *lowcase, ngx_uint_t hash, ngx_str_t *value); // Append a header
+ static ngx_msec_t ngx_http_sleep_injected(ngx_http_sleep_ctx_t *ctx); // Milliseconds injected into a request
+ static ngx_int_t ngx_http_sleep_init_limits_zone(ngx_shm_zone_t *shm_zone, void *data); // Set up shared concurrency counters
+ static ngx_int_t ngx_http_sleep_acquire(ngx_http_request_t *r, ngx_http_sleep_loc_conf_t *slcf, ngx_atomic_t **counter); // Count a sleep against its limit
+ static void ngx_http_sleep_release(ngx_http_sleep_ctx_t *ctx); // Release the counted sleep
+static ngx_int_t ngx_http_sleep_filter_acquire(ngx_http_request_t *r, ngx_http_sleep_loc_conf_t *slcf, ngx_http_sleep_ctx_t *ctx); // Count a filter sleep against its limit and budget
+ static ngx_int_t ngx_http_sleep_upstream_init(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us); // Wrap the balancer
+ static ngx_int_t ngx_http_sleep_upstream_init_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us); // Wrap the peer callbacks
+ static ngx_int_t ngx_http_sleep_upstream_get_peer(ngx_peer_connection_t *pc, void *data); // Select a peer and its delay
+ static void ngx_http_sleep_upstream_free_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state); // Release a peer
+ #if (NGX_HTTP_SSL)
+ static ngx_int_t ngx_http_sleep_upstream_set_session(ngx_peer_connection_t *pc, void *data); // Pass on to the balancer
+ static void ngx_http_sleep_upstream_save_session(ngx_peer_connection_t *pc, void *data); // Pass on to the balancer
+ #endif
+ static ngx_int_t ngx_http_sleep_upstream_output(void *data, ngx_chain_t *in); // Hold the request while sleeping
+ static void ngx_http_sleep_upstream_wake(ngx_event_t *ev); // Upstream delay timer handler
+ static void ngx_http_sleep_upstream_cleanup(void *data); // Stop the upstream delay timer
+ static ngx_int_t ngx_http_sleep_delay(ngx_http_request_t *r, ngx_http_sleep_loc_conf_t *slcf, ngx_uint_t select, uint64_t *delay); // Compute the delay of a request in microseconds
+ static void ngx_http_sleep_start(ngx_http_request_t *r, ngx_http_sleep_loc_conf_t *slcf, ngx_http_sleep_ctx_t *ctx, uint64_t delay); // Start a sleep of a request
+ static ngx_int_t ngx_http_sleep_handler(ngx_http_request_t *r, ngx_uint_t phase); // Main request handler
+ static ngx_int_t ngx_http_sleep_preaccess_handler(ngx_http_request_t *r); // Preaccess phase handler
+ static ngx_int_t ngx_http_sleep_access_handler(ngx_http_request_t *r); // Access phase handler
+ static ngx_int_t ngx_http_sleep_precontent_handler(ngx_http_request_t *r); // Precontent phase handler
+ static ngx_int_t ngx_http_sleep_header_filter(ngx_http_request_t *r); // Header filter for filter sleeps
+ static ngx_int_t ngx_http_sleep_body_sleep(ngx_http_request_t *r, ngx_http_sleep_ctx_t *ctx, ngx_chain_t *in); // Sleep before an output chain
  static void ngx_http_sleep_wake_handler(ngx_event_t *ev); // Timer wake-up handler
+ static void ngx_http_sleep_resume(ngx_http_sleep_ctx_t *ctx); // Resume a woken request
+ static void ngx_http_sleep_batch_handler(ngx_event_t *ev); // Resume queued wake-ups
  static void ngx_http_sleep_cleanup_handler(void *data); // Cleanup handler
+ static ngx_http_sleep_ctx_t *ngx_http_sleep_ctx_alloc(ngx_http_request_t *r); // Get a sleep context
+ static ngx_http_sleep_ctx_t *ngx_http_sleep_get_ctx(ngx_http_request_t *r); // Find the context, also after internal redirects
+ static ngx_int_t ngx_http_sleep_ctx_attach(ngx_http_request_t *r, ngx_http_sleep_ctx_t *ctx); // Make a bare context a sleep context
+ static ngx_http_sleep_conn_t *ngx_http_sleep_conn_get(ngx_http_request_t *r); // Get the connection sleep state
+ static void ngx_http_sleep_conn_cleanup(void *data); // Connection pool cleanup marker
+ static void ngx_http_sleep_conn_wake(ngx_http_sleep_ctx_t *leader); // Wake all streams of a connection
+ static void ngx_http_sleep_wake(ngx_http_sleep_ctx_t *ctx); // Resume or queue a woken context
+ static void ngx_http_sleep_conn_promote(ngx_http_sleep_conn_t *conn); // Hand the timer to the next stream
+ static void ngx_http_sleep_schedule(ngx_http_sleep_ctx_t *ctx, uint64_t delay); // Start a sleep of the given microseconds
+ static void ngx_http_sleep_cancel(ngx_http_sleep_ctx_t *ctx); // Stop a pending sleep
+ static void ngx_http_sleep_wheel_insert(ngx_http_sleep_ctx_t *ctx); // Link context into a wheel slot
+ static void ngx_http_sleep_wheel_arm(void); // Set the wheel's nginx timer
+ static void ngx_http_sleep_wheel_handler(ngx_event_t *ev); // Wheel tick handler
+ static char *ngx_http_sleep_set_us(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse sb_sleep_us directive
+ static ngx_http_sleep_value_t *ngx_http_sleep_value(ngx_conf_t *cf, ngx_str_t *source, ngx_uint_t us); // Compile or share a delay value
+ static ngx_int_t ngx_http_sleep_precise_init(ngx_cycle_t *cycle); // Create the timerfd of the precise scheduler
+ static void ngx_http_sleep_exit_process(ngx_cycle_t *cycle); // Close the timerfd
+ static uint64_t ngx_http_sleep_precise_now(void); // Monotonic time in microseconds
+ static ngx_int_t ngx_http_sleep_precise_insert(ngx_http_sleep_ctx_t *ctx, uint64_t delay); // Add a sleeper to the heap
+ static void ngx_http_sleep_precise_remove(ngx_http_sleep_ctx_t *ctx); // Remove a sleeper from the heap
+ static void ngx_http_sleep_precise_place(ngx_uint_t i, ngx_http_sleep_ctx_t *ctx); // Restore heap order
+ static void ngx_http_sleep_precise_arm(void); // Arm the timerfd for the earliest sleeper
+ static void ngx_http_sleep_precise_handler(ngx_event_t *ev); // Wake expired sleepers
 
  /**
   * Module Commands Configuration
   *
   * Defines the "sb_sleep_ms" directive that can be used in nginx configuration.
   * This directive accepts one parameter (the sleep duration in milliseconds).
+  * The "sb_sleep_us" directive is the same with a duration in microseconds.
+  * The "sb_sleep_log" directive controls per-request logging of sleeps.
+  * The "sb_sleep_ctx_pool" directive sets the per-worker context free list size.
+  * The "sb_sleep_scheduler" directive selects nginx timers, the timing wheel
+  * or the precise scheduler.
+  * The "sb_sleep_batch" directive bounds and spreads out wake-ups.
+  * The "sb_sleep_dist" directive samples delays from a distribution.
+  * The "sb_sleep_percent" directive delays only a random share of requests.
+  * The "sb_sleep_zone" directive defines a shared zone of runtime delay rules,
+  * which the "sb_sleep_api" control endpoint updates without a reload.
+  * The "sb_sleep_status" directive exposes sleep statistics to Prometheus.
+  * The "sb_throttle_rate" and "sb_throttle_burst" directives pace the
+  * response body with a token bucket.
+  * The "sb_sleep_request_body" directive pauses reading the request body.
+  * The "sb_sleep_at" directive moves the sleep into the response output.
+  * The "sb_sleep_phase" directive selects the request phase of access sleeps.
+  * The "sb_sleep_scope" directive shares one access sleep among the streams of a connection.
+  * The "sb_sleep_once" directive selects whether subrequests and redirects sleep again.
+  * The "sb_upstream_sleep_ms" directive delays requests sent to upstream peers.
+  * The "sb_sleep_max_concurrent" directive bounds the number of sleeping requests.
+  * The "sb_sleep_budget" directive bounds the number of delayed requests across workers.
+  * The "sb_fault" directive fails or resets a share of requests, after any sleep.
+  * The "sb_sleep_rule" directive delays requests with a given header or cookie value.
+  * The "sb_sleep_ramp" directive moves the delay gradually between two values.
+  * The "sb_sleep_window" directive limits configured delays to a time window.
+  * The "sb_sleep_annotate" directive marks injected delays in headers.
   */
+ static ngx_conf_enum_t  ngx_http_sleep_schedulers[] = {
+     { ngx_string("timer"), NGX_HTTP_SLEEP_SCHED_TIMER },
+     { ngx_string("wheel"), NGX_HTTP_SLEEP_SCHED_WHEEL },
+ #if (NGX_LINUX)
+     { ngx_string("precise"), NGX_HTTP_SLEEP_SCHED_PRECISE },
+ #endif
+     { ngx_null_string, 0 }
+ };
+
+ static ngx_conf_bitmask_t  ngx_http_sleep_annotate_mask[] = {
+     { ngx_string("off"), NGX_HTTP_SLEEP_ANNOTATE_OFF },
+     { ngx_string("response"), NGX_HTTP_SLEEP_ANNOTATE_RESPONSE },
+     { ngx_string("upstream"), NGX_HTTP_SLEEP_ANNOTATE_UPSTREAM },
+     { ngx_string("tracestate"), NGX_HTTP_SLEEP_ANNOTATE_TRACESTATE },
+     { ngx_null_string, 0 }
+ };
+
+ /* Rule key type names used by the control API, indexed by NGX_HTTP_SLEEP_KEY_* */
+ static ngx_str_t  ngx_http_sleep_key_types[] = {
+     ngx_null_string,
+     ngx_string("location"),
+     ngx_string("host"),
+     ngx_string("stream")
+ };
+
+ static ngx_conf_enum_t  ngx_http_sleep_at[] = {
+     { ngx_string("access"), NGX_HTTP_SLEEP_AT_ACCESS },
+     { ngx_string("header"), NGX_HTTP_SLEEP_AT_HEADER },
+     { ngx_string("body_chunk"), NGX_HTTP_SLEEP_AT_BODY_CHUNK },
+     { ngx_string("last_buf"), NGX_HTTP_SLEEP_AT_LAST_BUF },
+     { ngx_null_string, 0 }
+ };
+
+ static ngx_conf_enum_t  ngx_http_sleep_scopes[] = {
+     { ngx_string("request"), NGX_HTTP_SLEEP_SCOPE_REQUEST },
+     { ngx_string("connection"), NGX_HTTP_SLEEP_SCOPE_CONNECTION },
+     { ngx_null_string, 0 }
+ };
+
+ static ngx_conf_enum_t  ngx_http_sleep_once[] = {
+     { ngx_string("main"), NGX_HTTP_SLEEP_ONCE_MAIN },
+     { ngx_string("each"), NGX_HTTP_SLEEP_ONCE_EACH },
+     { ngx_null_string, 0 }
+ };
+
+ /* Request phases "sb_sleep_at access" sleeps can run in */
+ static ngx_conf_enum_t  ngx_http_sleep_phases[] = {
+     { ngx_string("preaccess"), NGX_HTTP_PREACCESS_PHASE },
+     { ngx_string("access"), NGX_HTTP_ACCESS_PHASE },
+     { ngx_string("precontent"), NGX_HTTP_PRECONTENT_PHASE },
+     { ngx_null_string, 0 }
+ };
+
  static ngx_command_t ngx_http_sleep_commands[] = {
      { ngx_string("sb_sleep_ms"),                           /* Directive name */
        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1, /* Context and argument count */
@@ -62,6 +725,156 @@
        NGX_HTTP_LOC_CONF_OFFSET,                           /* Configuration level */
        offsetof(ngx_http_sleep_loc_conf_t, sleep_ms),      /* Field offset in config struct */
        NULL },                                              /* Post-processing function */
+     { ngx_string("sb_sleep_us"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+       ngx_http_sleep_set_us,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       offsetof(ngx_http_sleep_loc_conf_t, sleep_ms),
+       NULL },
+     { ngx_string("sb_sleep_dist"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
+       ngx_http_sleep_dist,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_sleep_percent"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+       ngx_http_sleep_percent,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_sleep_log"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+       ngx_http_sleep_log,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_sleep_scheduler"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+       ngx_conf_set_enum_slot,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       offsetof(ngx_http_sleep_loc_conf_t, scheduler),
+       &ngx_http_sleep_schedulers },
+     { ngx_string("sb_sleep_batch"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+       ngx_http_sleep_batch,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_sleep_zone"),
+       NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+       ngx_http_sleep_zone,
+       NGX_HTTP_MAIN_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_sleep_api"),
+       NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+       ngx_http_sleep_api,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_sleep_status"),
+       NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+       ngx_http_sleep_status,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_sleep_at"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+       ngx_conf_set_enum_slot,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       offsetof(ngx_http_sleep_loc_conf_t, at),
+       &ngx_http_sleep_at },
+     { ngx_string("sb_sleep_phase"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+       ngx_conf_set_enum_slot,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       offsetof(ngx_http_sleep_loc_conf_t, phase),
+       &ngx_http_sleep_phases },
+     { ngx_string("sb_sleep_scope"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+       ngx_conf_set_enum_slot,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       offsetof(ngx_http_sleep_loc_conf_t, scope),
+       &ngx_http_sleep_scopes },
+     { ngx_string("sb_sleep_once"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+       ngx_conf_set_enum_slot,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       offsetof(ngx_http_sleep_loc_conf_t, once),
+       &ngx_http_sleep_once },
+     { ngx_string("sb_throttle_rate"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+       ngx_http_set_complex_value_size_slot,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       offsetof(ngx_http_sleep_loc_conf_t, throttle_rate),
+       NULL },
+     { ngx_string("sb_throttle_burst"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+       ngx_conf_set_size_slot,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       offsetof(ngx_http_sleep_loc_conf_t, throttle_burst),
+       NULL },
+     { ngx_string("sb_sleep_request_body"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+       ngx_http_sleep_rbody_conf,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_sleep_ramp"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
+       ngx_http_sleep_ramp,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_sleep_window"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+       ngx_http_sleep_window,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_sleep_rule"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE3,
+       ngx_http_sleep_rule,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_sleep_max_concurrent"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+       ngx_http_sleep_max_concurrent,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_sleep_budget"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+       ngx_http_sleep_budget,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_fault"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+       ngx_http_sleep_fault_conf,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_sleep_annotate"),
+       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+       ngx_conf_set_bitmask_slot,
+       NGX_HTTP_LOC_CONF_OFFSET,
+       offsetof(ngx_http_sleep_loc_conf_t, annotate),
+       &ngx_http_sleep_annotate_mask },
+     { ngx_string("sb_upstream_sleep_ms"),
+       NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+       ngx_http_sleep_upstream,
+       NGX_HTTP_SRV_CONF_OFFSET,
+       0,
+       NULL },
+     { ngx_string("sb_sleep_ctx_pool"),
+       NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+       ngx_conf_set_num_slot,
+       NGX_HTTP_MAIN_CONF_OFFSET,
+       offsetof(ngx_http_sleep_main_conf_t, ctx_pool_size),
+       NULL },
      ngx_null_command                                       /* Terminator */
  };
 
@@ -71,16 +884,81 @@
   * Defines the module's lifecycle hooks and configuration management functions.
   */
  static ngx_http_module_t ngx_steadybit_sleep_module_ctx = {
-     NULL,                          /* preconfiguration - called before config parsing */
+     ngx_http_sleep_add_variables,  /* preconfiguration - called before config parsing */
      ngx_http_sleep_init,           /* postconfiguration - called after config parsing */
-     NULL,                          /* create main configuration */
-     NULL,                          /* init main configuration */
-     NULL,                          /* create server configuration */
+     ngx_http_sleep_create_main_conf, /* create main configuration */
+     ngx_http_sleep_init_main_conf, /* init main configuration */
+     ngx_http_sleep_create_srv_conf, /* create server configuration */
      NULL,                          /* merge server configuration */
      ngx_http_sleep_create_loc_conf,/* create location configuration */
      ngx_http_sleep_merge_loc_conf  /* merge location configuration */
  };
 
+ /* Variables exported by the module */
+ #define NGX_HTTP_SLEEP_VAR_REQUESTED  0
+ #define NGX_HTTP_SLEEP_VAR_ACTUAL     1
+ #define NGX_HTTP_SLEEP_VAR_ABORTED    2
+
+ static ngx_http_variable_t  ngx_http_sleep_vars[] = {
+     { ngx_string("sb_sleep_requested_ms"), NULL, ngx_http_sleep_variable,
+       NGX_HTTP_SLEEP_VAR_REQUESTED, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+     { ngx_string("sb_sleep_actual_ms"), NULL, ngx_http_sleep_variable,
+       NGX_HTTP_SLEEP_VAR_ACTUAL, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+     { ngx_string("sb_sleep_aborted"), NULL, ngx_http_sleep_variable,
+       NGX_HTTP_SLEEP_VAR_ABORTED, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+     ngx_http_null_variable
+ };
+
+ /* Per-worker counter of delayed requests, used by sampled logging */
+ static ngx_uint_t  ngx_http_sleep_log_counter;
+
+ /* Per-worker xorshift64* PRNG state, seeded in ngx_http_sleep_init_process */
+ static uint64_t  ngx_http_sleep_rand_state = 0x9e3779b97f4a7c15ULL;
+
+ /**
+  * Random Number
+  *
+  * Returns the next value of the per-worker xorshift64* generator. The high
+  * bits are the best distributed ones, so callers use them for indexing.
+  */
+ static ngx_inline uint64_t
+ ngx_http_sleep_rand(void)
+ {
+     uint64_t  x = ngx_http_sleep_rand_state;
+
+     x ^= x >> 12;
+     x ^= x << 25;
+     x ^= x >> 27;
+     ngx_http_sleep_rand_state = x;
+
+     return x * 0x2545f4914f6cdd1dULL;
+ }
+
+ /* Per-worker free list of preallocated sleep contexts */
+ static ngx_queue_t  ngx_http_sleep_free_ctxs;
+
+ /* Per-worker timing wheel */
+ static ngx_http_sleep_wheel_t  ngx_http_sleep_wheel;
+
+ /* Per-worker precise scheduler */
+ static ngx_http_sleep_precise_t  ngx_http_sleep_precise;
+
+ /* Per-worker queue of woken requests waiting for their batch, and its event */
+ static ngx_queue_t  ngx_http_sleep_ready;
+ static ngx_event_t  ngx_http_sleep_batch_event;
+
+ /* Hashes of the annotation header names, computed at postconfiguration */
+ static ngx_uint_t  ngx_http_sleep_injected_hash;
+ static ngx_uint_t  ngx_http_sleep_tracestate_hash;
+
+ /* Next filters in the chains */
+ static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+ static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+ static ngx_http_request_body_filter_pt   ngx_http_next_request_body_filter;
+
+ /* This worker's slot in the statistics zone, NULL if statistics are off */
+ static ngx_http_sleep_stats_t  *ngx_http_sleep_stats;
+
  /**
   * Main Module Definition
   *
@@ -93,14 +971,117 @@
      NGX_HTTP_MODULE,               /* module type */
      NULL,                          /* init master */
      NULL,                          /* init module */
-     NULL,                          /* init process */
+     ngx_http_sleep_init_process,   /* init process */
      NULL,                          /* init thread */
      NULL,                          /* exit thread */
-     NULL,                          /* exit process */
+     ngx_http_sleep_exit_process,   /* exit process */
      NULL,                          /* exit master */
      NGX_MODULE_V1_PADDING          // Padding for module structure
  };
 
+ /**
+  * Create Main Configuration
+  *
+  * Allocates the http-wide configuration structure.
+  */
+ static void *
+ ngx_http_sleep_create_main_conf(ngx_conf_t *cf)
+ {
+     ngx_http_sleep_main_conf_t  *smcf;
+
+     smcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_sleep_main_conf_t));
+     if (smcf == NULL) {
+         return NULL;
+     }
+
+     /*
+      * set by ngx_pcalloc():
+      *
+      *     smcf->shm_zone = NULL;
+      *     smcf->stats_zone = NULL;
+      *     smcf->limits_zone = NULL;
+      *     smcf->nlimits = 0;
+      */
+
+     if (ngx_array_init(&smcf->limit_keys, cf->pool, 4,
+                        sizeof(ngx_http_sleep_limit_key_t))
+         != NGX_OK)
+     {
+         return NULL;
+     }
+
+     smcf->ctx_pool_size = NGX_CONF_UNSET; // Pool size not set
+
+     return smcf;
+ }
+
+ /**
+  * Initialize Main Configuration
+  *
+  * Applies defaults once the http block has been parsed. The context pool
+  * is disabled unless sb_sleep_ctx_pool is set.
+  */
+ static char *
+ ngx_http_sleep_init_main_conf(ngx_conf_t *cf, void *conf)
+ {
+     ngx_http_sleep_main_conf_t *smcf = conf;
+     ngx_http_sleep_limit_key_t *key;
+     ngx_http_server_name_t     *sn;
+     ngx_str_t                   name;
+     ngx_uint_t                  i;
+     uint32_t                    crc;
+
+     ngx_conf_init_value(smcf->ctx_pool_size, 0);
+
+     if (smcf->ctx_pool_size < 0) {
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "\"sb_sleep_ctx_pool\" must not be negative");
+         return NGX_CONF_ERROR;
+     }
+
+     /* All shared sb_sleep_max_concurrent and sb_sleep_budget counters are known now */
+     if (smcf->nlimits) {
+
+         /*
+          * The zone is named after the layout of its counters. A reload
+          * that adds, removes, moves or changes one gets a fresh zone, so
+          * the slots of old workers never pass to another location.
+          */
+         ngx_crc32_init(crc);
+
+         key = smcf->limit_keys.elts;
+         for (i = 0; i < smcf->limit_keys.nelts; i++) {
+             if (key[i].cscf->server_names.nelts) {
+                 sn = key[i].cscf->server_names.elts;
+                 ngx_crc32_update(&crc, sn[0].name.data, sn[0].name.len);
+             }
+
+             ngx_crc32_update(&crc, (u_char *) &key[i].crc, sizeof(uint32_t));
+         }
+
+         ngx_crc32_final(crc);
+
+         name.data = ngx_pnalloc(cf->pool, sizeof("sb_sleep_limits_ffffffff") - 1);
+         if (name.data == NULL) {
+             return NGX_CONF_ERROR;
+         }
+
+         name.len = ngx_sprintf(name.data, "sb_sleep_limits_%08xD", crc) - name.data;
+
+         smcf->limits_zone = ngx_shared_memory_add(cf, &name,
+                                 8 * ngx_pagesize
+                                 + smcf->nlimits * NGX_HTTP_SLEEP_LIMIT_STRIDE,
+                                 &ngx_steadybit_sleep_module);
+         if (smcf->limits_zone == NULL) {
+             return NGX_CONF_ERROR;
+         }
+
+         smcf->limits_zone->init = ngx_http_sleep_init_limits_zone;
+     }
+
+     return NGX_CONF_OK;
+ }
+
  /**
   * Create Location Configuration
   *
@@ -120,10 +1101,59 @@
 
      /* Initialize sleep_ms to NULL (no sleep configured by default) */
      conf->sleep_ms = NULL; // No sleep by default
+     conf->dist = NULL; // No distribution by default
+     conf->ramp = NULL; // No ramp by default
+     conf->percent = NGX_CONF_UNSET_UINT; // Sampling not set
+     conf->log_mode = NGX_CONF_UNSET_UINT; // Logging mode not set
+     conf->log_sample = NGX_CONF_UNSET_UINT; // Sampling interval not set
+     conf->scheduler = NGX_CONF_UNSET_UINT; // Scheduler not set
+     conf->at = NGX_CONF_UNSET_UINT; // Sleep point not set
+     conf->phase = NGX_CONF_UNSET_UINT; // Sleep phase not set
+     conf->scope = NGX_CONF_UNSET_UINT; // Sleep scope not set
+     conf->once = NGX_CONF_UNSET_UINT; // Once mode not set
+     conf->batch_max = NGX_CONF_UNSET_UINT; // Batch limit not set
+     conf->batch_spread = NGX_CONF_UNSET_MSEC; // Jitter not set
+     conf->throttle_rate = NGX_CONF_UNSET_PTR; // Throttling not set
+     conf->throttle_burst = NGX_CONF_UNSET_SIZE; // Burst not set
+     conf->rbody_delay = NGX_CONF_UNSET_MSEC; // Request body pause not set
+     conf->rbody_every = NGX_CONF_UNSET; // Set together with the pause
+     conf->max_concurrent = NGX_CONF_UNSET_UINT; // Concurrency limit not set
+     conf->budget = NGX_CONF_UNSET_PTR; // Budget not set
+     conf->faults = NGX_CONF_UNSET_PTR; // No faults set
+     conf->matchers = NGX_CONF_UNSET_PTR; // No request rules set
+     conf->window_start = NGX_CONF_UNSET; // Window not set
+     conf->window_end = NGX_CONF_UNSET;
 
      return conf; // Return the allocated config
  }
 
+ /**
+  * Create Server Configuration
+  *
+  * Allocates the per upstream block configuration; fields are set by
+  * sb_upstream_sleep_ms.
+  */
+ static void *
+ ngx_http_sleep_create_srv_conf(ngx_conf_t *cf)
+ {
+     ngx_http_sleep_srv_conf_t  *conf;
+
+     conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_sleep_srv_conf_t));
+     if (conf == NULL) {
+         return NULL;
+     }
+
+     /*
+      * set by ngx_pcalloc():
+      *
+      *     conf->rules = NULL;
+      *     conf->original_init_upstream = NULL;
+      *     conf->original_init_peer = NULL;
+      */
+
+     return conf;
+ }
+
  /**
   * Merge Location Configurations
   *
@@ -135,10 +1165,167 @@
  {
      ngx_http_sleep_loc_conf_t *prev = parent;  /* Parent configuration */
      ngx_http_sleep_loc_conf_t *conf = child;   /* Child configuration */
+     ngx_http_core_loc_conf_t  *clcf;
+     ngx_http_sleep_main_conf_t *smcf;
+     ngx_flag_t                 delays;    /* Some delay source applies to the location */
+
+     /* Remember the location name as the key of runtime location rules */
+     clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+     conf->loc_name = clcf->name;
+     conf->loc_hash = ngx_http_sleep_rule_hash(NGX_HTTP_SLEEP_KEY_LOCATION,
+                                               clcf->name.data, clcf->name.len);
+
+     /*
+      * If child doesn't have a delay configured, inherit from parent.
+      * sb_sleep_ms, sb_sleep_us, sb_sleep_dist and sb_sleep_ramp replace each other.
+      */
+     if (conf->sleep_ms == NULL && conf->dist == NULL && conf->ramp == NULL) {
+         conf->sleep_ms = prev->sleep_ms; // Inherit the shared value from parent
+         conf->dist = prev->dist; // Inherit distribution from parent
+         conf->ramp = prev->ramp; // Inherit ramp from parent
+     }
+
+     /* Build the lookup table once; inheriting locations share it */
+     if (conf->dist != NULL && conf->dist->table == NULL) {
+         if (ngx_http_sleep_dist_build(cf, conf->dist) != NGX_OK) {
+             return NGX_CONF_ERROR;
+         }
+     }
+
+     /* All requests are delayed unless a percentage is configured */
+     ngx_conf_merge_uint_value(conf->percent, prev->percent, 10000);
+     conf->percent_threshold = (uint32_t) (((uint64_t) conf->percent << 32) / 10000);
+
+     /* Per-request logging is debug-only unless configured otherwise */
+     ngx_conf_merge_uint_value(conf->log_mode, prev->log_mode,
+                               NGX_HTTP_SLEEP_LOG_DEBUG);
+     ngx_conf_merge_uint_value(conf->log_sample, prev->log_sample, 0);
+
+     ngx_conf_merge_uint_value(conf->scheduler, prev->scheduler,
+                               NGX_HTTP_SLEEP_SCHED_TIMER);
+     ngx_conf_merge_uint_value(conf->at, prev->at, NGX_HTTP_SLEEP_AT_ACCESS);
+     ngx_conf_merge_uint_value(conf->phase, prev->phase, NGX_HTTP_ACCESS_PHASE);
+     ngx_conf_merge_uint_value(conf->scope, prev->scope, NGX_HTTP_SLEEP_SCOPE_REQUEST);
+
+     ngx_conf_merge_uint_value(conf->once, prev->once, NGX_HTTP_SLEEP_ONCE_MAIN);
+
+     /*
+      * nginx passes subrequests on past the access phase before any handler
+      * runs, so "each" delays them only in the preaccess or precontent phase.
+      * Warn for the outermost location using the merged combination, not
+      * again for nested locations inheriting it unchanged.
+      */
+     if (conf->once == NGX_HTTP_SLEEP_ONCE_EACH && conf->phase == NGX_HTTP_ACCESS_PHASE
+         && conf->loc_name.len
+         && (prev->loc_name.len == 0 || prev->once != conf->once
+             || prev->phase != conf->phase))
+     {
+         ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                            "\"sb_sleep_once each\" does not delay subrequests "
+                            "with \"sb_sleep_phase access\" in location \"%V\", "
+                            "use preaccess or precontent", &conf->loc_name);
+     }
+
+     /* Wake-ups are resumed immediately and without jitter by default */
+     ngx_conf_merge_uint_value(conf->batch_max, prev->batch_max, 0);
+     ngx_conf_merge_msec_value(conf->batch_spread, prev->batch_spread, 0);
+
+     /* Responses are not throttled by default */
+     ngx_conf_merge_ptr_value(conf->throttle_rate, prev->throttle_rate, NULL);
+     ngx_conf_merge_size_value(conf->throttle_burst, prev->throttle_burst, 0);
+
+     if (conf->rbody_delay == NGX_CONF_UNSET_MSEC) {
+         conf->rbody_delay = (prev->rbody_delay == NGX_CONF_UNSET_MSEC) ? 0 : prev->rbody_delay;
+         conf->rbody_every = (prev->rbody_every == NGX_CONF_UNSET) ? 0 : prev->rbody_every;
+     }
+
+     /* Locations inheriting a concurrency limit share its counter */
+     if (conf->max_concurrent == NGX_CONF_UNSET_UINT) {
+         conf->concurrent = prev->concurrent;
+         conf->concurrent_slot = prev->concurrent_slot;
+         conf->concurrent_status = prev->concurrent_status;
+     }
+
+     ngx_conf_merge_uint_value(conf->max_concurrent, prev->max_concurrent, 0);
 
-     /* If child doesn't have sleep_ms configured, inherit from parent */
-     if (conf->sleep_ms == NULL) {
-         conf->sleep_ms = prev->sleep_ms; // Inherit sleep_ms from parent
+     /* Locations inheriting a budget share it */
+     ngx_conf_merge_ptr_value(conf->budget, prev->budget, NULL);
+
+     /* Faults replace those of the parent */
+     ngx_conf_merge_ptr_value(conf->faults, prev->faults, NULL);
+
+     /* Injected delays are not annotated by default */
+     ngx_conf_merge_bitmask_value(conf->annotate, prev->annotate,
+                                  (NGX_CONF_BITMASK_SET|NGX_HTTP_SLEEP_ANNOTATE_OFF));
+
+     if (conf->annotate & NGX_HTTP_SLEEP_ANNOTATE_OFF) {
+         conf->annotate = NGX_CONF_BITMASK_SET|NGX_HTTP_SLEEP_ANNOTATE_OFF;
+     }
+
+     /* Configured delays apply at all times unless a window is set */
+     if (conf->window_end == NGX_CONF_UNSET) {
+         conf->window_start = prev->window_start;
+         conf->window_end = prev->window_end;
+     }
+
+     ngx_conf_merge_sec_value(conf->window_start, prev->window_start, 0);
+     ngx_conf_merge_sec_value(conf->window_end, prev->window_end, 0);
+
+     /*
+      * Ramps start with the window, or else when the configuration is loaded.
+      * Workers inherit the start time, so they all follow the same ramp. A
+      * reload restarts ramps, unless the window has a fixed start= time.
+      */
+     if (conf->ramp != NULL) {
+         conf->ramp_start = ngx_current_msec;
+
+         if (conf->window_end) {
+             conf->ramp_start += (ngx_msec_t) ((conf->window_start - ngx_time()) * 1000);
+         }
+     }
+
+     /* Request rules replace those of the parent; hashes are built once and shared */
+     ngx_conf_merge_ptr_value(conf->matchers, prev->matchers, NULL);
+
+     if (conf->matchers != NULL
+         && ngx_http_sleep_rules_build(cf, conf->matchers) != NGX_OK)
+     {
+         return NGX_CONF_ERROR;
+     }
+
+     /*
+      * Note the phase if requests of this location may sleep in one, and
+      * the filters its sleep point and other settings use, so the handler
+      * and the filters are only installed where needed. Runtime rules may
+      * apply to any location once a rule zone exists.
+      */
+     smcf = ngx_http_conf_get_module_main_conf(cf, ngx_steadybit_sleep_module);
+
+     delays = (conf->sleep_ms != NULL || conf->dist != NULL || conf->ramp != NULL
+               || conf->matchers != NULL || smcf->shm_zone != NULL);
+
+     if ((conf->at == NGX_HTTP_SLEEP_AT_ACCESS && delays) || conf->faults != NULL) {
+         smcf->phases |= (ngx_uint_t) 1 << conf->phase;
+     }
+
+     if ((conf->at != NGX_HTTP_SLEEP_AT_ACCESS && delays)
+         || (conf->annotate & NGX_HTTP_SLEEP_ANNOTATE_RESPONSE))
+     {
+         smcf->filters |= NGX_HTTP_SLEEP_FILTER_HEADER;
+     }
+
+     if ((conf->at >= NGX_HTTP_SLEEP_AT_BODY_CHUNK && delays)
+         || conf->throttle_rate != NULL)
+     {
+         smcf->filters |= NGX_HTTP_SLEEP_FILTER_BODY;
+     }
+
+     if (conf->rbody_delay) {
+         smcf->filters |= NGX_HTTP_SLEEP_FILTER_REQUEST_BODY;
+     }
+
+     if (conf->scheduler == NGX_HTTP_SLEEP_SCHED_PRECISE) {
+         smcf->precise = 1; // Workers create the timerfd
      }
 
      return NGX_CONF_OK; // Return OK
@@ -148,218 +1335,5733 @@
   * Parse sb_sleep_ms Directive
   *
   * Called when nginx encounters the "sb_sleep_ms" directive in configuration.
-  * Parses the sleep duration value and stores it as a complex value.
+  * Points the location to the shared compiled value of the argument.
   */
  static char *
  ngx_http_sleep_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
  {
      ngx_http_sleep_loc_conf_t *slcf = conf; // Cast conf to our config struct
      ngx_str_t *value; // Pointer to directive arguments
-     ngx_http_compile_complex_value_t ccv; // Complex value compilation context
 
      /* Check if directive is already configured (prevent duplicates) */
      if (slcf->sleep_ms != NULL) {
-         return "is duplicate"; // Error if already set
+         return slcf->sleep_ms->us ? "conflicts with \"sb_sleep_us\"" : "is duplicate";
+     }
+
+     if (slcf->dist != NULL) {
+         return "conflicts with \"sb_sleep_dist\""; // Only one delay source per level
+     }
+
+     if (slcf->ramp != NULL) {
+         return "conflicts with \"sb_sleep_ramp\"";
      }
 
      /* Get the directive arguments */
      value = cf->args->elts; // Get arguments array
 
-     /* Allocate memory for the complex value structure */
-     slcf->sleep_ms = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t)); // Allocate memory
+     slcf->sleep_ms = ngx_http_sleep_value(cf, &value[1], 0);
      if (slcf->sleep_ms == NULL) {
-         return NGX_CONF_ERROR; // Error if allocation fails
+         return NGX_CONF_ERROR; // Invalid value, already reported
      }
 
-     /* Initialize complex value compilation context */
-     ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t)); // Zero the struct
-
-     ccv.cf = cf; // Set config pointer
-     ccv.value = &value[1];           /* First argument (value[0] is directive name) */
-     ccv.complex_value = slcf->sleep_ms; // Set output pointer
+     return NGX_CONF_OK; // Success
+ }
 
-     /* Compile the complex value (handles variables, expressions, etc.) */
+ /**
+  * Parse sb_sleep_us Directive
+  *
+  * Same as sb_sleep_ms, with the value in microseconds. Combined with
+  * "sb_sleep_scheduler precise" the delay is kept to the microsecond;
+  * the other schedulers round it up to whole milliseconds.
+  */
+ static char *
+ ngx_http_sleep_set_us(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_sleep_loc_conf_t  *slcf = conf;
+     ngx_str_t                  *value;
+
+     if (slcf->sleep_ms != NULL) {
+         return slcf->sleep_ms->us ? "is duplicate" : "conflicts with \"sb_sleep_ms\"";
+     }
+
+     if (slcf->dist != NULL) {
+         return "conflicts with \"sb_sleep_dist\"";
+     }
+
+     if (slcf->ramp != NULL) {
+         return "conflicts with \"sb_sleep_ramp\"";
+     }
+
+     value = cf->args->elts;
+
+     slcf->sleep_ms = ngx_http_sleep_value(cf, &value[1], 1);
+     if (slcf->sleep_ms == NULL) {
+         return NGX_CONF_ERROR;
+     }
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Intern Delay Value
+  *
+  * Returns the shared compiled value for a sb_sleep_ms or sb_sleep_us
+  * argument, compiling it on first use. Literals must be non-negative
+  * integers; anything else is rejected here instead of being reported
+  * on every request.
+  */
+ static ngx_http_sleep_value_t *
+ ngx_http_sleep_value(ngx_conf_t *cf, ngx_str_t *source, ngx_uint_t us)
+ {
+     ngx_http_sleep_main_conf_t        *smcf;
+     ngx_http_sleep_value_t            *v, **bucket;
+     ngx_http_compile_complex_value_t   ccv;
+
+     smcf = ngx_http_conf_get_module_main_conf(cf, ngx_steadybit_sleep_module);
+
+     if (smcf->values == NULL) {
+         smcf->values = ngx_pcalloc(cf->pool, NGX_HTTP_SLEEP_VALUE_BUCKETS
+                                              * sizeof(ngx_http_sleep_value_t *));
+         if (smcf->values == NULL) {
+             return NULL;
+         }
+     }
+
+     bucket = &smcf->values[(ngx_crc32_short(source->data, source->len) ^ us)
+                            % NGX_HTTP_SLEEP_VALUE_BUCKETS];
+
+     for (v = *bucket; v; v = v->next) {
+         if (v->us == (ngx_flag_t) us && v->source.len == source->len
+             && ngx_strncmp(v->source.data, source->data, source->len) == 0)
+         {
+             return v; // Seen before, share it
+         }
+     }
+
+     v = ngx_pcalloc(cf->pool, sizeof(ngx_http_sleep_value_t));
+     if (v == NULL) {
+         return NULL;
+     }
+
+     ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+     ccv.cf = cf;
+     ccv.value = source;
+     ccv.complex_value = &v->cv;
+
+     /* Compile the complex value (handles variables, expressions, etc.) */
      if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-         return NGX_CONF_ERROR; // Error if compilation fails
+         return NULL;
+     }
+
+     v->value = NGX_CONF_UNSET;
+
+     /* A value without variables is constant: parse and check it once here */
+     if (v->cv.lengths == NULL) {
+         v->value = ngx_atoi(source->data, source->len);
+         if (v->value == NGX_ERROR) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "invalid value \"%V\", expected %s",
+                                source, us ? "microseconds" : "milliseconds");
+             return NULL;
+         }
+     }
+
+     v->us = us;
+     v->source = *source; // Argument strings live in the configuration pool
+     v->next = *bucket;
+     *bucket = v;
+
+     return v;
+ }
+
+ /**
+  * Parse sb_sleep_dist Directive
+  *
+  * Syntax: sb_sleep_dist uniform min=A max=B [cap=C];
+  *         sb_sleep_dist normal mean=M stddev=S [cap=C];
+  *         sb_sleep_dist lognormal mean=M p99=P [cap=C];
+  *         sb_sleep_dist pareto min=A alpha=K [cap=C];
+  * All times are in milliseconds. The lookup table is built at merge time.
+  */
+ static char *
+ ngx_http_sleep_dist(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_sleep_loc_conf_t *slcf = conf;
+     ngx_str_t                 *value;
+     ngx_http_sleep_dist_t     *dist;
+     ngx_uint_t                 i, n;
+     ngx_int_t                  v;
+     u_char                    *p;
+     double                    *param;
+
+     if (slcf->dist != NULL) {
+         return "is duplicate";
+     }
+
+     if (slcf->sleep_ms != NULL) {
+         return "conflicts with \"sb_sleep_ms\"";
+     }
+
+     if (slcf->ramp != NULL) {
+         return "conflicts with \"sb_sleep_ramp\"";
+     }
+
+     value = cf->args->elts;
+
+     dist = ngx_pcalloc(cf->pool, sizeof(ngx_http_sleep_dist_t));
+     if (dist == NULL) {
+         return NGX_CONF_ERROR;
+     }
+
+     if (ngx_strcmp(value[1].data, "uniform") == 0) {
+         dist->type = NGX_HTTP_SLEEP_DIST_UNIFORM;
+
+     } else if (ngx_strcmp(value[1].data, "normal") == 0) {
+         dist->type = NGX_HTTP_SLEEP_DIST_NORMAL;
+
+     } else if (ngx_strcmp(value[1].data, "lognormal") == 0) {
+         dist->type = NGX_HTTP_SLEEP_DIST_LOGNORMAL;
+
+     } else if (ngx_strcmp(value[1].data, "pareto") == 0) {
+         dist->type = NGX_HTTP_SLEEP_DIST_PARETO;
+
+     } else {
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "unknown distribution \"%V\"", &value[1]);
+         return NGX_CONF_ERROR;
+     }
+
+     dist->p1 = -1;
+     dist->p2 = -1;
+
+     for (i = 2; i < cf->args->nelts; i++) {
+         p = (u_char *) ngx_strchr(value[i].data, '=');
+         if (p == NULL) {
+             goto invalid;
+         }
+
+         n = p - value[i].data; // Length of the parameter name
+         p++;
+
+         /* Map the parameter name to its slot for this distribution */
+         if (n == 3 && ngx_strncmp(value[i].data, "cap", 3) == 0) {
+             param = &dist->cap;
+
+         } else if (n == 3 && ngx_strncmp(value[i].data, "min", 3) == 0
+                    && (dist->type == NGX_HTTP_SLEEP_DIST_UNIFORM
+                        || dist->type == NGX_HTTP_SLEEP_DIST_PARETO))
+         {
+             param = &dist->p1;
+
+         } else if (n == 4 && ngx_strncmp(value[i].data, "mean", 4) == 0
+                    && (dist->type == NGX_HTTP_SLEEP_DIST_NORMAL
+                        || dist->type == NGX_HTTP_SLEEP_DIST_LOGNORMAL))
+         {
+             param = &dist->p1;
+
+         } else if ((n == 3 && ngx_strncmp(value[i].data, "max", 3) == 0
+                     && dist->type == NGX_HTTP_SLEEP_DIST_UNIFORM)
+                    || (n == 6 && ngx_strncmp(value[i].data, "stddev", 6) == 0
+                        && dist->type == NGX_HTTP_SLEEP_DIST_NORMAL)
+                    || (n == 3 && ngx_strncmp(value[i].data, "p99", 3) == 0
+                        && dist->type == NGX_HTTP_SLEEP_DIST_LOGNORMAL)
+                    || (n == 5 && ngx_strncmp(value[i].data, "alpha", 5) == 0
+                        && dist->type == NGX_HTTP_SLEEP_DIST_PARETO))
+         {
+             param = &dist->p2;
+
+         } else {
+             goto invalid;
+         }
+
+         v = ngx_atofp(p, value[i].len - n - 1, 3); // Fixed point, 3 decimals
+         if (v == NGX_ERROR) {
+             goto invalid;
+         }
+
+         *param = (double) v / 1000;
+     }
+
+     if (dist->p1 < 0 || dist->p2 < 0) {
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "missing parameters for \"%V\" distribution",
+                            &value[1]);
+         return NGX_CONF_ERROR;
+     }
+
+     slcf->dist = dist;
+
+     return NGX_CONF_OK;
+
+ invalid:
+
+     ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                        "invalid parameter \"%V\"", &value[i]);
+     return NGX_CONF_ERROR;
+ }
+
+ /**
+  * Build Distribution Table
+  *
+  * Evaluates the inverse CDF at the midpoints of 2^12 equally likely
+  * quantile buckets. This is the only place where log(), exp() and sqrt()
+  * are used; requests only look up a random table entry.
+  */
+ static ngx_int_t
+ ngx_http_sleep_dist_build(ngx_conf_t *cf, ngx_http_sleep_dist_t *dist)
+ {
+     ngx_uint_t  i;
+     double      q, x, mu, sigma, d;
+
+     mu = 0;
+     sigma = 0;
+
+     switch (dist->type) {
+
+     case NGX_HTTP_SLEEP_DIST_UNIFORM:
+         if (dist->p2 < dist->p1) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "uniform \"max\" must not be less than \"min\"");
+             return NGX_ERROR;
+         }
+         break;
+
+     case NGX_HTTP_SLEEP_DIST_LOGNORMAL:
+         /*
+          * Solve mean = exp(mu + sigma^2 / 2) and p99 = exp(mu + z99 * sigma)
+          * for sigma, taking the smaller root of the quadratic.
+          */
+         if (dist->p1 <= 0 || dist->p2 <= dist->p1) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "lognormal \"p99\" must be greater than \"mean\"");
+             return NGX_ERROR;
+         }
+
+         d = 2.326347874 * 2.326347874 - 2 * (log(dist->p2) - log(dist->p1));
+         if (d < 0) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "lognormal \"p99\" is too large for \"mean\"");
+             return NGX_ERROR;
+         }
+
+         sigma = 2.326347874 - sqrt(d);
+         mu = log(dist->p1) - sigma * sigma / 2;
+         break;
+
+     case NGX_HTTP_SLEEP_DIST_PARETO:
+         if (dist->p1 <= 0 || dist->p2 <= 0) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "pareto \"min\" and \"alpha\" must be positive");
+             return NGX_ERROR;
+         }
+         break;
+
+     default: /* NGX_HTTP_SLEEP_DIST_NORMAL */
+         break;
+     }
+
+     dist->table = ngx_palloc(cf->pool, NGX_HTTP_SLEEP_DIST_SIZE * sizeof(uint32_t));
+     if (dist->table == NULL) {
+         return NGX_ERROR;
+     }
+
+     for (i = 0; i < NGX_HTTP_SLEEP_DIST_SIZE; i++) {
+         q = (i + 0.5) / NGX_HTTP_SLEEP_DIST_SIZE; // Bucket midpoint
+
+         switch (dist->type) {
+
+         case NGX_HTTP_SLEEP_DIST_UNIFORM:
+             x = dist->p1 + q * (dist->p2 - dist->p1);
+             break;
+
+         case NGX_HTTP_SLEEP_DIST_NORMAL:
+             x = dist->p1 + dist->p2 * ngx_http_sleep_normal_quantile(q);
+             break;
+
+         case NGX_HTTP_SLEEP_DIST_LOGNORMAL:
+             x = exp(mu + sigma * ngx_http_sleep_normal_quantile(q));
+             break;
+
+         default: /* NGX_HTTP_SLEEP_DIST_PARETO */
+             x = dist->p1 / pow(1 - q, 1 / dist->p2);
+             break;
+         }
+
+         if (dist->cap > 0 && x > dist->cap) {
+             x = dist->cap;
+         }
+
+         /* Negative normal samples mean no delay; keep within the timer range */
+         if (x < 0) {
+             x = 0;
+         }
+
+         if (x > NGX_MAX_UINT32_VALUE) {
+             x = NGX_MAX_UINT32_VALUE;
+         }
+
+         dist->table[i] = (uint32_t) (x + 0.5);
+     }
+
+     return NGX_OK;
+ }
+
+ /**
+  * Inverse Standard Normal CDF
+  *
+  * Acklam's rational approximation, relative error below 1.2e-9, which is
+  * far finer than the millisecond resolution of the table.
+  */
+ static double
+ ngx_http_sleep_normal_quantile(double p)
+ {
+     static const double  a[] = { -3.969683028665376e+01,  2.209460984245205e+02,
+                                  -2.759285104469687e+02,  1.383577518672690e+02,
+                                  -3.066479806614716e+01,  2.506628277459239e+00 };
+     static const double  b[] = { -5.447609879822406e+01,  1.615858368580409e+02,
+                                  -1.556989798598866e+02,  6.680131188771972e+01,
+                                  -1.328068155288572e+01 };
+     static const double  c[] = { -7.784894002430293e-03, -3.223964580411365e-01,
+                                  -2.400758277161838e+00, -2.549732539343734e+00,
+                                   4.374664141464968e+00,  2.938163982698783e+00 };
+     static const double  d[] = {  7.784695709041462e-03,  3.224671290700398e-01,
+                                   2.445134137142996e+00,  3.754408661907416e+00 };
+     double  q, r;
+
+     if (p < 0.02425) {
+         q = sqrt(-2 * log(p));
+         return (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5])
+                / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+     }
+
+     if (p > 1 - 0.02425) {
+         q = sqrt(-2 * log(1 - p));
+         return -(((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5])
+                / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+     }
+
+     q = p - 0.5;
+     r = q * q;
+
+     return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q
+            / (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+ }
+
+ /**
+  * Parse sb_sleep_percent Directive
+  *
+  * Accepts a percentage with up to two decimals, with or without a trailing
+  * "%" sign, e.g. "5%" or "0.25%".
+  */
+ static char *
+ ngx_http_sleep_percent(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_sleep_loc_conf_t *slcf = conf;
+     ngx_str_t                 *value;
+     ngx_int_t                  n;
+     size_t                     len;
+
+     if (slcf->percent != NGX_CONF_UNSET_UINT) {
+         return "is duplicate";
+     }
+
+     value = cf->args->elts;
+
+     len = value[1].len;
+     if (len && value[1].data[len - 1] == '%') {
+         len--; // Strip the percent sign
+     }
+
+     n = ngx_atofp(value[1].data, len, 2); // Hundredths of a percent
+     if (n == NGX_ERROR || n > 10000) {
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "invalid percentage \"%V\"", &value[1]);
+         return NGX_CONF_ERROR;
+     }
+
+     slcf->percent = (ngx_uint_t) n;
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Parse sb_sleep_zone Directive
+  *
+  * Syntax: sb_sleep_zone name size;
+  * Defines the shared zone holding runtime delay rules for the http block.
+  */
+ static char *
+ ngx_http_sleep_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_sleep_main_conf_t *smcf = conf;
+     ngx_str_t                  *value;
+     ssize_t                     size;
+     ngx_http_sleep_zone_ctx_t  *zctx;
+
+     if (smcf->shm_zone != NULL) {
+         return "is duplicate";
+     }
+
+     value = cf->args->elts;
+
+     size = ngx_parse_size(&value[2]);
+     if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "invalid zone size \"%V\"", &value[2]);
+         return NGX_CONF_ERROR;
+     }
+
+     zctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_sleep_zone_ctx_t));
+     if (zctx == NULL) {
+         return NGX_CONF_ERROR;
+     }
+
+     smcf->shm_zone = ngx_shared_memory_add(cf, &value[1], size,
+                                            &ngx_steadybit_sleep_module);
+     if (smcf->shm_zone == NULL) {
+         return NGX_CONF_ERROR;
+     }
+
+     if (smcf->shm_zone->data) {
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "duplicate zone \"%V\"", &value[1]);
+         return NGX_CONF_ERROR;
+     }
+
+     smcf->shm_zone->init = ngx_http_sleep_init_zone;
+     smcf->shm_zone->data = zctx;
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Initialize Shared Zone
+  *
+  * Carves the rule table out of the zone. On reload the existing table is
+  * kept, so rules set through the API survive configuration changes.
+  */
+ static ngx_int_t
+ ngx_http_sleep_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+ {
+     ngx_http_sleep_zone_ctx_t  *ozctx = data;
+     ngx_http_sleep_zone_ctx_t  *zctx;
+     size_t                      avail;
+     ngx_uint_t                  nslots;
+
+     zctx = shm_zone->data;
+
+     if (ozctx) {
+         zctx->sh = ozctx->sh; // Keep rules across reloads
+         zctx->shpool = ozctx->shpool;
+         return NGX_OK;
+     }
+
+     zctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+     if (shm_zone->shm.exists) {
+         zctx->sh = zctx->shpool->data; // Zone inherited by a new binary
+         return NGX_OK;
+     }
+
+     /* Use the largest power of two slots that fits into half of the zone */
+     avail = shm_zone->shm.size / 2;
+
+     for (nslots = 1; (nslots * 2) * sizeof(ngx_http_sleep_rule_t) <= avail; nslots *= 2) {
+         /* void */
+     }
+
+     zctx->sh = ngx_slab_calloc(zctx->shpool, sizeof(ngx_http_sleep_shctx_t)
+                                + (nslots - 1) * sizeof(ngx_http_sleep_rule_t));
+     if (zctx->sh == NULL) {
+         return NGX_ERROR;
+     }
+
+     zctx->sh->nslots = nslots;
+     zctx->shpool->data = zctx->sh;
+
+     return NGX_OK;
+ }
+
+ /**
+  * Rule Hash
+  *
+  * Hashes a rule key together with its type.
+  */
+ static uint32_t
+ ngx_http_sleep_rule_hash(ngx_uint_t type, u_char *key, size_t len)
+ {
+     return ngx_crc32_short(key, len) ^ (uint32_t) type;
+ }
+
+ /**
+  * Find Rule Slot
+  *
+  * Probes the rule table linearly from the key's home slot. Returns the slot
+  * holding the key, or NULL. The probe is bounded by the table size, so it
+  * terminates even if a writer changes the table underneath a reader.
+  */
+ static ngx_http_sleep_rule_t *
+ ngx_http_sleep_rule_find(ngx_http_sleep_shctx_t *sh, ngx_uint_t type,
+     u_char *key, size_t len, uint32_t hash)
+ {
+     ngx_uint_t              i, mask;
+     ngx_http_sleep_rule_t  *rule;
+
+     mask = sh->nslots - 1;
+
+     for (i = 0; i < sh->nslots; i++) {
+         rule = &sh->rules[(hash + i) & mask];
+
+         if (rule->state == NGX_HTTP_SLEEP_RULE_EMPTY) {
+             return NULL; // End of the probe chain
+         }
+
+         if (rule->state == NGX_HTTP_SLEEP_RULE_USED
+             && rule->hash == hash
+             && rule->type == type
+             && rule->len == len
+             && ngx_memcmp(rule->key, key, len) == 0)
+         {
+             return rule;
+         }
+     }
+
+     return NULL;
+ }
+
+ /**
+  * Read Runtime Rule
+  *
+  * Copies the rule for a key out of shared memory. The read is lock-free;
+  * it is retried if a writer was active, and treated as "no rule" if that
+  * keeps happening.
+  */
+ static ngx_int_t
+ ngx_http_sleep_zone_read(ngx_http_sleep_shctx_t *sh, ngx_uint_t type,
+     u_char *key, size_t len, uint32_t hash, ngx_http_sleep_rule_t *rule)
+ {
+     ngx_http_sleep_rule_t  *found;
+     ngx_atomic_uint_t       seq;
+     ngx_uint_t              tries;
+
+     for (tries = 0; tries < NGX_HTTP_SLEEP_READ_TRIES; tries++) {
+         seq = sh->seq;
+
+         if (seq & 1) {
+             ngx_cpu_pause(); // Writer active, try again
+             continue;
+         }
+
+         ngx_memory_barrier();
+
+         found = ngx_http_sleep_rule_find(sh, type, key, len, hash);
+
+         if (found && ngx_http_sleep_rule_expired(found)) {
+             found = NULL; // Switched off even if nobody deletes it
+         }
+
+         if (found) {
+             rule->delay = found->ramp.over
+                           ? ngx_http_sleep_ramp_value(&found->ramp,
+                                                       ngx_current_msec - found->started)
+                           : found->delay;
+             rule->percent = found->percent;
+         }
+
+         ngx_memory_barrier();
+
+         if (sh->seq == seq) {
+             return found ? NGX_OK : NGX_DECLINED; // Consistent snapshot
+         }
+     }
+
+     return NGX_DECLINED;
+ }
+
+ /**
+  * Look Up Runtime Rule
+  *
+  * Finds the rule for the request's location, or else for its host.
+  */
+ static ngx_int_t
+ ngx_http_sleep_zone_lookup(ngx_http_request_t *r,
+     ngx_http_sleep_main_conf_t *smcf, ngx_http_sleep_loc_conf_t *slcf,
+     ngx_http_sleep_rule_t *rule)
+ {
+     ngx_http_sleep_zone_ctx_t  *zctx;
+     ngx_http_sleep_shctx_t     *sh;
+     ngx_str_t                  *host;
+
+     zctx = smcf->shm_zone->data;
+     sh = zctx->sh;
+
+     if (sh->nrules == 0) {
+         return NGX_DECLINED; // No experiment running, the common case
+     }
+
+     if (ngx_http_sleep_zone_read(sh, NGX_HTTP_SLEEP_KEY_LOCATION,
+                                  slcf->loc_name.data, slcf->loc_name.len,
+                                  slcf->loc_hash, rule)
+         == NGX_OK)
+     {
+         return NGX_OK;
+     }
+
+     host = &r->headers_in.server;
+
+     if (host->len == 0) {
+         return NGX_DECLINED;
+     }
+
+     return ngx_http_sleep_zone_read(sh, NGX_HTTP_SLEEP_KEY_HOST, host->data, host->len,
+                                     ngx_http_sleep_rule_hash(NGX_HTTP_SLEEP_KEY_HOST,
+                                                              host->data, host->len),
+                                     rule);
+ }
+
+ /**
+  * Parse sb_sleep_api Directive
+  *
+  * Installs the control endpoint as the content handler of the location.
+  */
+ static char *
+ ngx_http_sleep_api(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_core_loc_conf_t    *clcf;
+     ngx_http_sleep_main_conf_t  *smcf;
+
+     smcf = ngx_http_conf_get_module_main_conf(cf, ngx_steadybit_sleep_module);
+     if (smcf->shm_zone == NULL) {
+         return "requires \"sb_sleep_zone\" to be defined first";
+     }
+
+     clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+     clcf->handler = ngx_http_sleep_api_handler;
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Control Endpoint Handler
+  *
+  * Manages runtime rules through query arguments:
+  *   GET                                          list all rules as JSON
+  *   PUT|POST ?type=T&key=K&ms=N[&percent=P]      set a rule
+  *            [&ttl=time][&ramp=time[&from=N][&curve=C]]
+  *   DELETE   ?type=T&key=K                       remove a rule
+  *   DELETE                                       remove all rules
+  *
+  * where T is one of location, host or stream. A ramp moves the delay from
+  * "from" to "ms" over the given time, starting when the rule is set.
+  * A DELETE with only one of type and key, or an empty key, is rejected
+  * rather than taken for a request to remove all rules.
+  */
+ static ngx_int_t
+ ngx_http_sleep_api_handler(ngx_http_request_t *r)
+ {
+     static ngx_str_t  ramp_args[] = {
+         ngx_string("ramp"), ngx_string("from"), ngx_string("curve")
+     };
+     static ngx_str_t  ramp_params[] = {
+         ngx_string("over="), ngx_string("from="), ngx_string("curve=")
+     };
+
+     ngx_http_sleep_main_conf_t  *smcf;
+     ngx_http_sleep_zone_ctx_t   *zctx;
+     ngx_http_sleep_shctx_t      *sh;
+     ngx_http_sleep_rule_t       *rule, *slot;
+     ngx_str_t                    arg, key, param;
+     ngx_uint_t                   type, i, mask;
+     ngx_http_sleep_ramp_t        ramp;
+     ngx_int_t                    rc, ms, percent;
+     time_t                       ttl;
+     uint32_t                     hash;
+     size_t                       len;
+     u_char                      *p, *dst;
+     ngx_buf_t                   *b;
+     ngx_chain_t                  out;
+     u_char                       keybuf[NGX_HTTP_SLEEP_KEY_MAX];
+
+     if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_PUT|NGX_HTTP_POST|NGX_HTTP_DELETE))) {
+         return NGX_HTTP_NOT_ALLOWED;
+     }
+
+     rc = ngx_http_discard_request_body(r);
+     if (rc != NGX_OK) {
+         return rc;
+     }
+
+     smcf = ngx_http_get_module_main_conf(r, ngx_steadybit_sleep_module);
+     zctx = smcf->shm_zone->data;
+     sh = zctx->sh;
+
+     type = 0;
+     key.len = 0;
+     key.data = NULL; // No key argument
+
+     if (ngx_http_arg(r, (u_char *) "type", 4, &arg) == NGX_OK) {
+         for (type = NGX_HTTP_SLEEP_KEY_LOCATION; type <= NGX_HTTP_SLEEP_KEY_STREAM; type++) {
+             if (arg.len == ngx_http_sleep_key_types[type].len
+                 && ngx_strncmp(arg.data, ngx_http_sleep_key_types[type].data, arg.len) == 0)
+             {
+                 break;
+             }
+         }
+
+         if (type > NGX_HTTP_SLEEP_KEY_STREAM) {
+             return NGX_HTTP_BAD_REQUEST;
+         }
+     }
+
+     if (ngx_http_arg(r, (u_char *) "key", 3, &arg) == NGX_OK) {
+         if (arg.len > NGX_HTTP_SLEEP_KEY_MAX) {
+             return NGX_HTTP_BAD_REQUEST;
+         }
+
+         dst = keybuf;
+         p = arg.data;
+         ngx_unescape_uri(&dst, &p, arg.len, 0);
+         key.data = keybuf;
+         key.len = dst - keybuf;
+
+         if (type == NGX_HTTP_SLEEP_KEY_HOST) {
+             ngx_strlow(keybuf, keybuf, key.len); // Host names are matched lowercase
+         }
+     }
+
+     if (r->method & (NGX_HTTP_PUT|NGX_HTTP_POST)) {
+         if (type == 0 || key.len == 0
+             || ngx_http_arg(r, (u_char *) "ms", 2, &arg) != NGX_OK)
+         {
+             return NGX_HTTP_BAD_REQUEST;
+         }
+
+         ms = ngx_atoi(arg.data, arg.len);
+         if (ms == NGX_ERROR) {
+             return NGX_HTTP_BAD_REQUEST;
+         }
+
+         percent = 10000;
+
+         if (ngx_http_arg(r, (u_char *) "percent", 7, &arg) == NGX_OK) {
+             percent = ngx_atofp(arg.data, arg.len, 2);
+             if (percent == NGX_ERROR || percent > 10000) {
+                 return NGX_HTTP_BAD_REQUEST;
+             }
+         }
+
+         ttl = 0;
+
+         if (ngx_http_arg(r, (u_char *) "ttl", 3, &arg) == NGX_OK) {
+             ttl = ngx_parse_time(&arg, 1);
+             if (ttl == NGX_ERROR) {
+                 return NGX_HTTP_BAD_REQUEST;
+             }
+         }
+
+         ngx_memzero(&ramp, sizeof(ngx_http_sleep_ramp_t));
+         ramp.to = (ngx_msec_t) ms;
+
+         /* Ramp arguments are parsed as the sb_sleep_ramp parameters they map to */
+         if (ngx_http_arg(r, (u_char *) "ramp", 4, &arg) == NGX_OK) {
+             for (i = 0; i < 3; i++) {
+                 if (ngx_http_arg(r, ramp_args[i].data, ramp_args[i].len, &arg) != NGX_OK) {
+                     continue;
+                 }
+
+                 param.len = ramp_params[i].len + arg.len;
+                 param.data = ngx_pnalloc(r->pool, param.len);
+                 if (param.data == NULL) {
+                     return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                 }
+
+                 ngx_memcpy(ngx_cpymem(param.data, ramp_params[i].data, ramp_params[i].len),
+                            arg.data, arg.len);
+
+                 if (ngx_http_sleep_ramp_parse(&param, &ramp) != NGX_OK) {
+                     return NGX_HTTP_BAD_REQUEST;
+                 }
+             }
+         }
+
+         hash = ngx_http_sleep_rule_hash(type, key.data, key.len);
+         mask = sh->nslots - 1;
+
+         ngx_shmtx_lock(&zctx->shpool->mutex);
+
+         ngx_http_sleep_rules_expire(sh); // Free the slots of expired rules
+
+         rule = ngx_http_sleep_rule_find(sh, type, key.data, key.len, hash);
+
+         if (rule == NULL) {
+             /* Take the first free or deleted slot of the probe chain */
+             for (i = 0; i < sh->nslots; i++) {
+                 slot = &sh->rules[(hash + i) & mask];
+
+                 if (slot->state != NGX_HTTP_SLEEP_RULE_USED) {
+                     rule = slot;
+                     break;
+                 }
+             }
+
+             if (rule == NULL) {
+                 ngx_shmtx_unlock(&zctx->shpool->mutex);
+                 ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                               "sb_sleep_zone \"%V\" is full", &smcf->shm_zone->shm.name);
+                 return NGX_HTTP_INTERNAL_SERVER_ERROR;
+             }
+         }
+
+         sh->seq++; // Odd: readers retry
+         ngx_memory_barrier();
+
+         if (rule->state != NGX_HTTP_SLEEP_RULE_USED) {
+             rule->hash = hash;
+             rule->type = (u_char) type;
+             rule->len = (u_char) key.len;
+             ngx_memcpy(rule->key, key.data, key.len);
+             rule->state = NGX_HTTP_SLEEP_RULE_USED;
+             sh->nrules++;
+         }
+
+         rule->delay = (ngx_msec_t) ms;
+         rule->percent = (ngx_uint_t) percent;
+         rule->expires = ttl ? ngx_current_msec + (ngx_msec_t) ttl * 1000 : 0;
+         rule->ramp = ramp;
+         rule->started = ngx_current_msec; // Setting a rule again restarts its ramp
+
+         ngx_memory_barrier();
+         sh->seq++; // Even: update complete
+
+         ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+     } else if (r->method == NGX_HTTP_DELETE) {
+         /* One rule needs both arguments, all rules neither */
+         if ((type == 0) != (key.data == NULL)
+             || (key.data != NULL && key.len == 0))
+         {
+             return NGX_HTTP_BAD_REQUEST;
+         }
+
+         ngx_shmtx_lock(&zctx->shpool->mutex);
+
+         sh->seq++;
+         ngx_memory_barrier();
+
+         if (type) {
+             hash = ngx_http_sleep_rule_hash(type, key.data, key.len);
+
+             rule = ngx_http_sleep_rule_find(sh, type, key.data, key.len, hash);
+             if (rule) {
+                 rule->state = NGX_HTTP_SLEEP_RULE_DELETED;
+                 sh->nrules--;
+                 ngx_http_sleep_rules_tidy(sh);
+             }
+
+         } else {
+             for (i = 0; i < sh->nslots; i++) {
+                 sh->rules[i].state = NGX_HTTP_SLEEP_RULE_EMPTY;
+             }
+
+             sh->nrules = 0;
+         }
+
+         ngx_memory_barrier();
+         sh->seq++;
+
+         ngx_shmtx_unlock(&zctx->shpool->mutex);
+     }
+
+     /* Respond with the current rule set */
+     ngx_shmtx_lock(&zctx->shpool->mutex);
+
+     ngx_http_sleep_rules_expire(sh);
+
+     len = sizeof("{\"generation\":,\"rules\":[]}\n") - 1 + NGX_ATOMIC_T_LEN;
+
+     for (i = 0; i < sh->nslots; i++) {
+         rule = &sh->rules[i];
+
+         if (rule->state == NGX_HTTP_SLEEP_RULE_USED) {
+             len += sizeof("{\"type\":\"location\",\"key\":\"\",\"ms\":,\"percent\":.00,\"ttl\":},") - 1
+                    + rule->len + ngx_escape_json(NULL, rule->key, rule->len)
+                    + NGX_INT_T_LEN * 3;
+         }
+     }
+
+     b = ngx_create_temp_buf(r->pool, len);
+     if (b == NULL) {
+         ngx_shmtx_unlock(&zctx->shpool->mutex);
+         return NGX_HTTP_INTERNAL_SERVER_ERROR;
+     }
+
+     p = ngx_sprintf(b->last, "{\"generation\":%uA,\"rules\":[", sh->seq / 2);
+
+     for (i = 0; i < sh->nslots; i++) {
+         rule = &sh->rules[i];
+
+         if (rule->state != NGX_HTTP_SLEEP_RULE_USED) {
+             continue;
+         }
+
+         if (p[-1] == '}') {
+             *p++ = ',';
+         }
+
+         p = ngx_sprintf(p, "{\"type\":\"%V\",\"key\":\"",
+                         &ngx_http_sleep_key_types[rule->type]);
+         p = (u_char *) ngx_escape_json(p, rule->key, rule->len);
+         p = ngx_sprintf(p, "\",\"ms\":%M,\"percent\":%ui.%02ui,\"ttl\":%M}",
+                         rule->delay, rule->percent / 100, rule->percent % 100,
+                         rule->expires ? (rule->expires - ngx_current_msec + 999) / 1000 : 0);
+     }
+
+     ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+     p = ngx_cpymem(p, "]}\n", 3);
+     b->last = p;
+     b->last_buf = (r == r->main) ? 1 : 0;
+     b->last_in_chain = 1;
+
+     r->headers_out.status = NGX_HTTP_OK;
+     r->headers_out.content_length_n = b->last - b->pos;
+     ngx_str_set(&r->headers_out.content_type, "application/json");
+     r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+     rc = ngx_http_send_header(r);
+     if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+         return rc;
+     }
+
+     out.buf = b;
+     out.next = NULL;
+
+     return ngx_http_output_filter(r, &out);
+ }
+
+ /**
+  * Expire Rules
+  *
+  * Deletes the rules whose TTL has run out, so their slots can be reused
+  * and listings stay current. Readers already ignore expired rules; this
+  * runs with the slab mutex held, whenever the control API is used.
+  */
+ static void
+ ngx_http_sleep_rules_expire(ngx_http_sleep_shctx_t *sh)
+ {
+     ngx_uint_t              i;
+     ngx_http_sleep_rule_t  *rule;
+     ngx_flag_t              writing;
+
+     writing = 0;
+
+     for (i = 0; i < sh->nslots; i++) {
+         rule = &sh->rules[i];
+
+         if (rule->state != NGX_HTTP_SLEEP_RULE_USED || !ngx_http_sleep_rule_expired(rule)) {
+             continue;
+         }
+
+         if (!writing) {
+             sh->seq++; // Odd: readers retry
+             ngx_memory_barrier();
+             writing = 1;
+         }
+
+         rule->state = NGX_HTTP_SLEEP_RULE_DELETED;
+         sh->nrules--;
+     }
+
+     if (writing) {
+         ngx_http_sleep_rules_tidy(sh);
+
+         ngx_memory_barrier();
+         sh->seq++;
+     }
+ }
+
+ /**
+  * Tidy Rule Table
+  *
+  * Keeps deleted slots from lengthening the probes of lookups that miss.
+  * A deleted slot followed by an empty one ends no probe chain and becomes
+  * empty again. If deleted slots still make up a quarter of the table, the
+  * rules are inserted anew into a cleared table. Runs with the slab mutex
+  * held and seq odd, so readers retry instead of seeing a half-moved rule.
+  */
+ static void
+ ngx_http_sleep_rules_tidy(ngx_http_sleep_shctx_t *sh)
+ {
+     ngx_uint_t              i, j, k, mask, deleted;
+     ngx_http_sleep_rule_t  *rules, *slot;
+
+     mask = sh->nslots - 1;
+     deleted = 0;
+
+     for (i = 0; i < sh->nslots; i++) {
+         if (sh->rules[i].state != NGX_HTTP_SLEEP_RULE_EMPTY) {
+             continue;
+         }
+
+         for (j = (i - 1) & mask;
+              j != i && sh->rules[j].state == NGX_HTTP_SLEEP_RULE_DELETED;
+              j = (j - 1) & mask)
+         {
+             sh->rules[j].state = NGX_HTTP_SLEEP_RULE_EMPTY;
+         }
+     }
+
+     for (i = 0; i < sh->nslots; i++) {
+         if (sh->rules[i].state == NGX_HTTP_SLEEP_RULE_DELETED) {
+             deleted++;
+         }
+     }
+
+     if (deleted <= sh->nslots / 4) {
+         return;
+     }
+
+     rules = NULL;
+
+     if (sh->nrules) {
+         rules = ngx_alloc(sh->nrules * sizeof(ngx_http_sleep_rule_t), ngx_cycle->log);
+         if (rules == NULL) {
+             return; // Lookups stay correct, only longer
+         }
+     }
+
+     for (i = 0, k = 0; i < sh->nslots; i++) {
+         if (sh->rules[i].state == NGX_HTTP_SLEEP_RULE_USED) {
+             rules[k++] = sh->rules[i];
+         }
+
+         sh->rules[i].state = NGX_HTTP_SLEEP_RULE_EMPTY;
+     }
+
+     for (i = 0; i < k; i++) {
+         for (j = rules[i].hash; ; j++) {
+             slot = &sh->rules[j & mask];
+
+             if (slot->state == NGX_HTTP_SLEEP_RULE_EMPTY) {
+                 *slot = rules[i];
+                 break;
+             }
+         }
+     }
+
+     if (rules) {
+         ngx_free(rules);
+     }
+ }
+
+ /**
+  * Parse sb_sleep_status Directive
+  *
+  * Installs the statistics endpoint as the content handler of the location
+  * and adds the statistics zone; every sb_sleep_status shares the same zone.
+  */
+ static char *
+ ngx_http_sleep_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_core_loc_conf_t    *clcf;
+     ngx_http_sleep_main_conf_t  *smcf;
+     ngx_str_t                    name = ngx_string("sb_sleep_stats");
+
+     smcf = ngx_http_conf_get_module_main_conf(cf, ngx_steadybit_sleep_module);
+
+     if (smcf->stats_zone == NULL) {
+         smcf->stats_zone = ngx_shared_memory_add(cf, &name,
+                                8 * ngx_pagesize
+                                + NGX_HTTP_SLEEP_STATS_SLOTS * NGX_HTTP_SLEEP_STATS_STRIDE,
+                                &ngx_steadybit_sleep_module);
+         if (smcf->stats_zone == NULL) {
+             return NGX_CONF_ERROR;
+         }
+
+         smcf->stats_zone->init = ngx_http_sleep_init_stats_zone;
+     }
+
+     clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+     clcf->handler = ngx_http_sleep_status_handler;
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Initialize Statistics Zone
+  *
+  * Allocates the worker slots. Counters are kept across reloads, so the
+  * exported counters stay monotonic.
+  */
+ static ngx_int_t
+ ngx_http_sleep_init_stats_zone(ngx_shm_zone_t *shm_zone, void *data)
+ {
+     ngx_slab_pool_t  *shpool;
+
+     if (data) {
+         shm_zone->data = data; // Keep counters across reloads
+         return NGX_OK;
+     }
+
+     shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+     if (shm_zone->shm.exists) {
+         shm_zone->data = shpool->data; // Zone inherited by a new binary
+         return NGX_OK;
+     }
+
+     /* Page-aligned, so every slot starts on its own cache line */
+     shm_zone->data = ngx_slab_calloc(shpool, NGX_HTTP_SLEEP_STATS_SLOTS
+                                              * NGX_HTTP_SLEEP_STATS_STRIDE);
+     if (shm_zone->data == NULL) {
+         return NGX_ERROR;
+     }
+
+     shpool->data = shm_zone->data;
+
+     return NGX_OK;
+ }
+
+ /**
+  * Account Finished Sleep
+  *
+  * Updates this worker's statistics when a sleep ends, either by waking up
+  * or by the request being terminated. Wake skew, the lateness of the
+  * wake-up against the requested time, goes into a log-linear histogram
+  * with four buckets per power of two.
+  */
+ static void
+ ngx_http_sleep_stats_done(ngx_http_sleep_ctx_t *ctx, ngx_uint_t aborted)
+ {
+     ngx_http_sleep_stats_t  *st = ngx_http_sleep_stats;
+     ngx_msec_int_t           skew;
+     ngx_uint_t               v, msb, idx;
+
+     (void) ngx_atomic_fetch_add(&st->active, -1);
+     (void) ngx_atomic_fetch_add(&st->slept_ms, ngx_current_msec - ctx->start_time);
+
+     if (aborted) {
+         (void) ngx_atomic_fetch_add(&st->aborted, 1);
+         return;
+     }
+
+     skew = (ngx_msec_int_t) (ngx_current_msec - ctx->wake_time);
+     v = skew > 0 ? (ngx_uint_t) skew : 0;
+
+     if (v < 4) {
+         idx = v;
+
+     } else {
+         for (msb = 2; (v >> (msb + 1)) != 0; msb++) {
+             /* void */
+         }
+
+         idx = (msb - 1) * 4 + ((v >> (msb - 2)) & 3);
+         if (idx > NGX_HTTP_SLEEP_SKEW_BUCKETS) {
+             idx = NGX_HTTP_SLEEP_SKEW_BUCKETS; // Beyond the last finite bucket
+         }
+     }
+
+     (void) ngx_atomic_fetch_add(&st->skew[idx], 1);
+     (void) ngx_atomic_fetch_add(&st->skew_sum, v);
+ }
+
+ /**
+  * Statistics Endpoint Handler
+  *
+  * Reports the statistics in Prometheus text format: counters per worker
+  * slot, labelled with the slot number, and the wake skew histogram summed
+  * over all workers.
+  */
+ static ngx_int_t
+ ngx_http_sleep_status_handler(ngx_http_request_t *r)
+ {
+     static const char *names[] = {
+         "sb_sleep_active", "gauge", "Requests currently sleeping.",
+         "sb_sleep_delayed_total", "counter", "Requests delayed.",
+         "sb_sleep_aborted_total", "counter", "Requests terminated while sleeping.",
+         "sb_sleep_slept_milliseconds_total", "counter", "Milliseconds slept.",
+         "sb_sleep_faults_total", "counter", "Requests failed or reset by sb_fault."
+     };
+
+     ngx_http_sleep_main_conf_t  *smcf;
+     ngx_http_sleep_stats_t      *st;
+     ngx_atomic_uint_t            skew[NGX_HTTP_SLEEP_SKEW_BUCKETS + 1];
+     ngx_atomic_uint_t            sum, count, value;
+     ngx_uint_t                   i, m, idx, msb, sub, upper;
+     ngx_int_t                    rc;
+     size_t                       len;
+     u_char                      *base, *p;
+     ngx_buf_t                   *b;
+     ngx_chain_t                  out;
+
+     if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+         return NGX_HTTP_NOT_ALLOWED;
+     }
+
+     rc = ngx_http_discard_request_body(r);
+     if (rc != NGX_OK) {
+         return rc;
+     }
+
+     smcf = ngx_http_get_module_main_conf(r, ngx_steadybit_sleep_module);
+     base = smcf->stats_zone->data;
+
+     /* Generous upper bound: every line fits into 128 bytes */
+     len = (5 * (NGX_HTTP_SLEEP_STATS_SLOTS + 2) + NGX_HTTP_SLEEP_SKEW_BUCKETS + 6) * 128;
+
+     b = ngx_create_temp_buf(r->pool, len);
+     if (b == NULL) {
+         return NGX_HTTP_INTERNAL_SERVER_ERROR;
+     }
+
+     p = b->last;
+
+     for (m = 0; m < 5; m++) {
+         p = ngx_sprintf(p, "# HELP %s %s\n# TYPE %s %s\n",
+                         names[m * 3], names[m * 3 + 2], names[m * 3], names[m * 3 + 1]);
+
+         for (i = 0; i < NGX_HTTP_SLEEP_STATS_SLOTS; i++) {
+             st = (ngx_http_sleep_stats_t *) (base + i * NGX_HTTP_SLEEP_STATS_STRIDE);
+
+             if (st->delayed == 0 && st->faulted == 0) {
+                 continue; // Slot never used
+             }
+
+             value = (m == 0) ? st->active
+                   : (m == 1) ? st->delayed
+                   : (m == 2) ? st->aborted
+                   : (m == 3) ? st->slept_ms
+                   : st->faulted;
+
+             p = ngx_sprintf(p, "%s{worker=\"%ui\"} %uA\n", names[m * 3], i, value);
+         }
+     }
+
+     /* Sum the histograms of all workers */
+     ngx_memzero(skew, sizeof(skew));
+     sum = 0;
+
+     for (i = 0; i < NGX_HTTP_SLEEP_STATS_SLOTS; i++) {
+         st = (ngx_http_sleep_stats_t *) (base + i * NGX_HTTP_SLEEP_STATS_STRIDE);
+
+         for (idx = 0; idx <= NGX_HTTP_SLEEP_SKEW_BUCKETS; idx++) {
+             skew[idx] += st->skew[idx];
+         }
+
+         sum += st->skew_sum;
+     }
+
+     p = ngx_cpymem(p, "# HELP sb_sleep_wake_skew_milliseconds Lateness of wake-ups.\n"
+                       "# TYPE sb_sleep_wake_skew_milliseconds histogram\n",
+                    sizeof("# HELP sb_sleep_wake_skew_milliseconds Lateness of wake-ups.\n"
+                           "# TYPE sb_sleep_wake_skew_milliseconds histogram\n") - 1);
+
+     count = 0;
+
+     for (idx = 0; idx < NGX_HTTP_SLEEP_SKEW_BUCKETS; idx++) {
+         count += skew[idx];
+
+         /* Inclusive upper bound of the bucket */
+         if (idx < 4) {
+             upper = idx;
+
+         } else {
+             msb = idx / 4 + 1;
+             sub = idx % 4;
+             upper = ((4 + sub + 1) << (msb - 2)) - 1;
+         }
+
+         p = ngx_sprintf(p, "sb_sleep_wake_skew_milliseconds_bucket{le=\"%ui\"} %uA\n",
+                         upper, count);
+     }
+
+     count += skew[NGX_HTTP_SLEEP_SKEW_BUCKETS];
+
+     p = ngx_sprintf(p, "sb_sleep_wake_skew_milliseconds_bucket{le=\"+Inf\"} %uA\n"
+                        "sb_sleep_wake_skew_milliseconds_sum %uA\n"
+                        "sb_sleep_wake_skew_milliseconds_count %uA\n",
+                     count, sum, count);
+
+     b->last = p;
+     b->last_buf = (r == r->main) ? 1 : 0;
+     b->last_in_chain = 1;
+
+     r->headers_out.status = NGX_HTTP_OK;
+     r->headers_out.content_length_n = b->last - b->pos;
+     ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+     r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+     rc = ngx_http_send_header(r);
+     if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+         return rc;
+     }
+
+     out.buf = b;
+     out.next = NULL;
+
+     return ngx_http_output_filter(r, &out);
+ }
+
+ /**
+  * Throttling Body Filter
+  *
+  * Injects filter sleeps before output chains, see ngx_http_sleep_body_sleep.
+  * Paces the main request's response body with a token bucket. Output the
+  * bucket doesn't cover is queued and passed on by a per-request timer, and
+  * c->write->delayed is set meanwhile, so nginx's writers and upstream
+  * pipes wait for the filter instead of pushing more output.
+  */
+ static ngx_int_t
+ ngx_http_sleep_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+ {
+     ngx_http_sleep_loc_conf_t  *slcf;
+     ngx_http_sleep_ctx_t       *ctx;
+     ngx_http_sleep_throttle_t  *t;
+     ngx_pool_cleanup_t         *cln;
+     size_t                      rate;
+
+     ctx = ngx_http_get_module_ctx(r, ngx_steadybit_sleep_module);
+
+     if (ctx && ctx->at >= NGX_HTTP_SLEEP_AT_BODY_CHUNK && in
+         && ngx_http_sleep_body_sleep(r, ctx, in) != NGX_OK)
+     {
+         return NGX_ERROR;
+     }
+
+     t = ctx ? ctx->throttle : NULL;
+
+     if (t == NULL) {
+         slcf = ngx_http_get_module_loc_conf(r, ngx_steadybit_sleep_module);
+
+         if (slcf->throttle_rate == NULL || r != r->main || in == NULL) {
+             return ngx_http_next_body_filter(r, in); // Not throttled
+         }
+
+         rate = ngx_http_complex_value_size(r, slcf->throttle_rate, 0);
+
+         if (ctx == NULL) {
+             ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_sleep_ctx_t)); // Context without a sleep
+             if (ctx == NULL) {
+                 return NGX_ERROR;
+             }
+
+             ngx_http_set_ctx(r, ctx, ngx_steadybit_sleep_module);
+         }
+
+         t = ngx_pcalloc(r->pool, sizeof(ngx_http_sleep_throttle_t));
+         if (t == NULL) {
+             return NGX_ERROR;
+         }
+
+         cln = ngx_pool_cleanup_add(r->pool, 0);
+         if (cln == NULL) {
+             return NGX_ERROR;
+         }
+
+         cln->handler = ngx_http_sleep_throttle_cleanup;
+         cln->data = t;
+
+         t->request = r;
+         t->rate = rate;
+         t->burst = slcf->throttle_burst ? slcf->throttle_burst : ngx_max(rate / 10, 1);
+         t->tokens = t->burst; // Start with a full bucket
+         t->last = ngx_current_msec;
+
+         t->event.handler = ngx_http_sleep_throttle_handler;
+         t->event.data = t;
+         t->event.log = r->connection->log;
+
+         ctx->throttle = t;
+     }
+
+     if (t->rate == 0) {
+         return ngx_http_next_body_filter(r, in); // Rate evaluated to 0, throttling off
+     }
+
+     /* Queue the new output by reference */
+     if (in && ngx_chain_add_copy(r->pool, &t->pending, in) != NGX_OK) {
+         return NGX_ERROR;
+     }
+
+     if (t->event.timer_set) {
+         return NGX_AGAIN; // Bucket still refilling
+     }
+
+     return ngx_http_sleep_throttle_send(r, t);
+ }
+
+ /**
+  * Throttle Send
+  *
+  * Refills the bucket and passes on as much pending output as it covers,
+  * splitting the first buffer that doesn't fit. If output remains, arms the
+  * refill timer for the time the next burst, or the rest of that buffer,
+  * takes at the configured rate.
+  */
+ static ngx_int_t
+ ngx_http_sleep_throttle_send(ngx_http_request_t *r, ngx_http_sleep_throttle_t *t)
+ {
+     ngx_connection_t  *c = r->connection;
+     ngx_chain_t       *cl, *out, **ll;
+     ngx_buf_t         *b, *sb;
+     ngx_msec_t         now, delay;
+     ngx_int_t          rc;
+     off_t              size;
+
+     /* Refill the bucket for the time that has passed */
+     now = ngx_current_msec;
+     t->tokens = ngx_min((off_t) t->burst,
+                         t->tokens + (off_t) (now - t->last) * t->rate / 1000);
+     t->last = now;
+
+     out = NULL;
+     ll = &out;
+
+     while (t->pending) {
+         cl = t->pending;
+         b = cl->buf;
+         size = ngx_buf_size(b) - t->offset;
+
+         if (size <= t->tokens) {
+             /* The rest of the buffer fits: pass on the original itself */
+             if (t->offset) {
+                 if (ngx_buf_in_memory(b)) {
+                     b->pos += t->offset;
+                 }
+
+                 if (b->in_file) {
+                     b->file_pos += t->offset;
+                 }
+
+                 t->offset = 0;
+             }
+
+             t->tokens -= size;
+             t->pending = cl->next;
+
+             *ll = cl;
+             ll = &cl->next;
+             continue;
+         }
+
+         if (t->tokens == 0) {
+             break; // Bucket empty
+         }
+
+         /*
+          * Pass on the part the bucket covers with a shadow buffer; the
+          * original stays untouched, and thereby busy for its owner, until
+          * its last part is passed on.
+          */
+         cl = ngx_chain_get_free_buf(r->pool, &t->free);
+         if (cl == NULL) {
+             return NGX_ERROR;
+         }
+
+         sb = cl->buf;
+         ngx_memcpy(sb, b, sizeof(ngx_buf_t));
+
+         sb->tag = (ngx_buf_tag_t) &ngx_steadybit_sleep_module;
+         sb->shadow = NULL;
+         sb->last_shadow = 0;
+         sb->recycled = 0;
+         sb->flush = 0;
+         sb->last_buf = 0;
+         sb->last_in_chain = 0;
+
+         if (ngx_buf_in_memory(b)) {
+             sb->pos = b->pos + t->offset;
+             sb->last = sb->pos + t->tokens;
+         }
+
+         if (b->in_file) {
+             sb->file_pos = b->file_pos + t->offset;
+             sb->file_last = sb->file_pos + t->tokens;
+         }
+
+         t->offset += t->tokens;
+         t->tokens = 0;
+
+         *ll = cl;
+         ll = &cl->next;
+         break;
+     }
+
+     *ll = NULL;
+
+     /*
+      * Clear the flag first: with nothing left to pass on, the postpone
+      * filter only forwards an empty call if the connection is buffered.
+      */
+     if (t->pending == NULL) {
+         c->buffered &= ~NGX_HTTP_SLEEP_THROTTLE_BUFFERED;
+     }
+
+     rc = (out || t->pending == NULL) ? ngx_http_next_body_filter(r, out) : NGX_OK;
+
+     ngx_chain_update_chains(r->pool, &t->free, &t->busy, &out,
+                             (ngx_buf_tag_t) &ngx_steadybit_sleep_module);
+
+     if (t->pending == NULL) {
+         return rc;
+     }
+
+     if (rc == NGX_ERROR) {
+         return NGX_ERROR;
+     }
+
+     /* Wait until the bucket covers the next burst or the rest of the buffer */
+     size = ngx_min((off_t) t->burst, ngx_buf_size(t->pending->buf) - t->offset);
+     delay = (ngx_msec_t) ((size - t->tokens) * 1000 / t->rate);
+
+     ngx_add_timer(&t->event, ngx_max(delay, 1));
+
+     c->write->delayed = 1;
+     c->buffered |= NGX_HTTP_SLEEP_THROTTLE_BUFFERED;
+
+     return NGX_AGAIN;
+ }
+
+ /**
+  * Throttle Timer Handler
+  *
+  * Passes on the next part of the held back output, then lets the request's
+  * write handler continue, whichever module installed it.
+  */
+ static void
+ ngx_http_sleep_throttle_handler(ngx_event_t *ev)
+ {
+     ngx_http_sleep_throttle_t  *t = ev->data;
+     ngx_http_request_t         *r = t->request;
+     ngx_connection_t           *c = r->connection;
+     ngx_http_sleep_ctx_t       *ctx;
+
+     ctx = ngx_http_get_module_ctx(r, ngx_steadybit_sleep_module);
+     if (ctx->waiting) {
+         return; // A filter sleep holds the output, its wake-up continues
+     }
+
+     c->write->delayed = 0;
+
+     if (ngx_http_sleep_throttle_send(r, t) == NGX_ERROR) {
+         c->error = 1; // Let the write handler finalize the request
+     }
+
+     ngx_post_event(c->write, &ngx_posted_events);
+ }
+
+ /**
+  * Throttle Cleanup
+  *
+  * Stops the refill timer when the request pool is destroyed.
+  */
+ static void
+ ngx_http_sleep_throttle_cleanup(void *data)
+ {
+     ngx_http_sleep_throttle_t  *t = data;
+
+     if (t->event.timer_set) {
+         ngx_del_timer(&t->event);
+     }
+ }
+
+ /**
+  * Parse sb_sleep_request_body Directive
+  *
+  * Syntax: sb_sleep_request_body time [every=size];
+  */
+ static char *
+ ngx_http_sleep_rbody_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_sleep_loc_conf_t  *slcf = conf;
+     ngx_str_t                  *value, s;
+     ngx_msec_int_t              delay;
+     off_t                       every;
+
+     if (slcf->rbody_delay != NGX_CONF_UNSET_MSEC) {
+         return "is duplicate";
+     }
+
+     value = cf->args->elts;
+
+     delay = ngx_parse_time(&value[1], 0);
+     if (delay == (ngx_msec_int_t) NGX_ERROR) {
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "invalid time \"%V\"", &value[1]);
+         return NGX_CONF_ERROR;
+     }
+
+     every = 0;
+
+     if (cf->args->nelts == 3) {
+         if (ngx_strncmp(value[2].data, "every=", 6) != 0) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "invalid parameter \"%V\"", &value[2]);
+             return NGX_CONF_ERROR;
+         }
+
+         s.data = value[2].data + 6;
+         s.len = value[2].len - 6;
+
+         every = ngx_parse_offset(&s);
+         if (every <= 0) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "invalid size \"%V\"", &value[2]);
+             return NGX_CONF_ERROR;
+         }
+     }
+
+     slcf->rbody_delay = (ngx_msec_t) delay;
+     slcf->rbody_every = every;
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Request Body Filter
+  *
+  * Pauses reading the main request's body before its first bytes are passed
+  * on, and again after every "every" bytes. While paused, the data already
+  * read is held by reference. The body reader, buffered or not, then finds its
+  * buffer busy, removes its read timer and waits for the next call, so at most
+  * one client_body_buffer_size of the body is in memory and nothing goes to a
+  * temporary file because of the pause. HTTP/2 and HTTP/3 bodies are passed
+  * through, their readers are driven by the connection instead.
+  */
+ static ngx_int_t
+ ngx_http_sleep_request_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+ {
+     ngx_http_sleep_loc_conf_t  *slcf;
+     ngx_http_sleep_ctx_t       *ctx;
+     ngx_http_sleep_rbody_t     *rb;
+     ngx_pool_cleanup_t         *cln;
+     ngx_chain_t                *cl;
+     off_t                       size;
+
+     ctx = ngx_http_get_module_ctx(r, ngx_steadybit_sleep_module);
+     rb = ctx ? ctx->rbody : NULL;
+
+     if (rb == NULL) {
+         slcf = ngx_http_get_module_loc_conf(r, ngx_steadybit_sleep_module);
+
+         if (slcf->rbody_delay == 0 || r != r->main || in == NULL) {
+             return ngx_http_next_request_body_filter(r, in); // Not paused
+         }
+
+ #if (NGX_HTTP_V2)
+         if (r->stream) {
+             return ngx_http_next_request_body_filter(r, in);
+         }
+ #endif
+
+ #if (NGX_HTTP_V3)
+         if (r->connection->quic) {
+             return ngx_http_next_request_body_filter(r, in);
+         }
+ #endif
+
+ #if (nginx_version < 1021002)
+         /* Buffered readers can't wait for filters before 1.21.2 */
+         if (!r->request_body_no_buffering) {
+             return ngx_http_next_request_body_filter(r, in);
+         }
+ #endif
+
+         if (ctx == NULL) {
+             ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_sleep_ctx_t)); // Context without a sleep
+             if (ctx == NULL) {
+                 return NGX_ERROR;
+             }
+
+             ngx_http_set_ctx(r, ctx, ngx_steadybit_sleep_module);
+         }
+
+         rb = ngx_pcalloc(r->pool, sizeof(ngx_http_sleep_rbody_t));
+         if (rb == NULL) {
+             return NGX_ERROR;
+         }
+
+         cln = ngx_pool_cleanup_add(r->pool, 0);
+         if (cln == NULL) {
+             return NGX_ERROR;
+         }
+
+         cln->handler = ngx_http_sleep_rbody_cleanup;
+         cln->data = rb;
+
+         rb->request = r;
+         rb->delay = slcf->rbody_delay;
+         rb->every = slcf->rbody_every;
+         rb->next = 0; // Pause before the first byte is passed on
+
+         rb->event.handler = ngx_http_sleep_rbody_handler;
+         rb->event.data = rb;
+         rb->event.log = r->connection->log;
+
+         ctx->rbody = rb;
+     }
+
+     if (rb->event.timer_set) {
+         /* Paused: hold whatever else was read, in order */
+         if (in && ngx_chain_add_copy(r->pool, &rb->held, in) != NGX_OK) {
+             return NGX_ERROR;
+         }
+
+         return NGX_OK;
+     }
+
+     size = 0;
+     for (cl = in; cl; cl = cl->next) {
+         size += ngx_buf_size(cl->buf);
+     }
+
+     if (size == 0 || rb->passed + size <= rb->next) {
+         rb->passed += size;
+         return ngx_http_next_request_body_filter(r, in);
+     }
+
+     /* The chain crosses the next pause: hold it, the caller's links are reused */
+     if (ngx_chain_add_copy(r->pool, &rb->held, in) != NGX_OK) {
+         return NGX_ERROR;
+     }
+
+     rb->passed += size;
+     rb->next = rb->every ? rb->passed + rb->every : NGX_MAX_OFF_T_VALUE;
+
+ #if (nginx_version >= 1021002)
+     r->request_body->filter_need_buffering = 1; // Let buffered readers wait too
+ #endif
+
+     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                    "sb_sleep_request_body: pausing for %M after %O bytes",
+                    rb->delay, rb->passed);
+
+     ngx_add_timer(&rb->event, rb->delay);
+
+     return NGX_OK;
+ }
+
+ /**
+  * Request Body Pause Handler
+  *
+  * Passes on the held back data, then lets the body reader continue through
+  * the request's read handler, whichever module installed it: the buffered
+  * reader, or an upstream sending the body unbuffered.
+  */
+ static void
+ ngx_http_sleep_rbody_handler(ngx_event_t *ev)
+ {
+     ngx_http_sleep_rbody_t  *rb = ev->data;
+     ngx_http_request_t      *r = rb->request;
+     ngx_connection_t        *c = r->connection;
+     ngx_chain_t             *out;
+     ngx_int_t                rc;
+
+     out = rb->held;
+     rb->held = NULL;
+
+     rc = ngx_http_next_request_body_filter(r, out);
+
+     if (rc != NGX_OK) {
+         ngx_http_finalize_request(r, rc);
+
+     } else {
+         r->read_event_handler(r);
+     }
+
+     ngx_http_run_posted_requests(c);
+ }
+
+ /**
+  * Request Body Pause Cleanup
+  *
+  * Stops the pause timer when the request pool is destroyed.
+  */
+ static void
+ ngx_http_sleep_rbody_cleanup(void *data)
+ {
+     ngx_http_sleep_rbody_t  *rb = data;
+
+     if (rb->event.timer_set) {
+         ngx_del_timer(&rb->event);
+     }
+ }
+
+ /**
+  * Parse sb_sleep_ramp Directive
+  *
+  * Syntax: sb_sleep_ramp [from=ms] to=ms over=time [curve=linear|exp];
+  * The delay moves from "from" to "to" over the given time and then stays
+  * at "to". Ramping down works the same with "from" above "to".
+  */
+ static char *
+ ngx_http_sleep_ramp(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_sleep_loc_conf_t *slcf = conf;
+     ngx_str_t                 *value;
+     ngx_http_sleep_ramp_t     *ramp;
+     ngx_uint_t                 i, to;
+
+     if (slcf->ramp != NULL) {
+         return "is duplicate";
+     }
+
+     if (slcf->sleep_ms != NULL) {
+         return "conflicts with \"sb_sleep_ms\"";
+     }
+
+     if (slcf->dist != NULL) {
+         return "conflicts with \"sb_sleep_dist\"";
+     }
+
+     value = cf->args->elts;
+
+     ramp = ngx_pcalloc(cf->pool, sizeof(ngx_http_sleep_ramp_t));
+     if (ramp == NULL) {
+         return NGX_CONF_ERROR;
+     }
+
+     to = 0;
+
+     for (i = 1; i < cf->args->nelts; i++) {
+         if (ngx_http_sleep_ramp_parse(&value[i], ramp) != NGX_OK) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "invalid parameter \"%V\"", &value[i]);
+             return NGX_CONF_ERROR;
+         }
+
+         if (ngx_strncmp(value[i].data, "to=", 3) == 0) {
+             to = 1;
+         }
+     }
+
+     if (!to || ramp->over == 0) {
+         return "requires \"to=\" and \"over=\"";
+     }
+
+     slcf->ramp = ramp;
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Parse Ramp Parameter
+  *
+  * Parses one of from=ms, to=ms, over=time or curve=linear|exp into the
+  * ramp. Shared by sb_sleep_ramp and the control endpoint, which passes its
+  * ramp, from and curve arguments as over=, from= and curve= parameters.
+  */
+ static ngx_int_t
+ ngx_http_sleep_ramp_parse(ngx_str_t *value, ngx_http_sleep_ramp_t *ramp)
+ {
+     ngx_str_t   s;
+     ngx_int_t   n;
+
+     if (ngx_strncmp(value->data, "from=", 5) == 0
+         || ngx_strncmp(value->data, "to=", 3) == 0)
+     {
+         s.data = (u_char *) ngx_strchr(value->data, '=') + 1;
+         s.len = value->data + value->len - s.data;
+
+         n = ngx_atoi(s.data, s.len);
+         if (n == NGX_ERROR) {
+             return NGX_ERROR;
+         }
+
+         if (value->data[0] == 'f') {
+             ramp->from = (ngx_msec_t) n;
+
+         } else {
+             ramp->to = (ngx_msec_t) n;
+         }
+
+         return NGX_OK;
+     }
+
+     if (ngx_strncmp(value->data, "over=", 5) == 0) {
+         s.data = value->data + 5;
+         s.len = value->len - 5;
+
+         ramp->over = ngx_parse_time(&s, 0);
+         if (ramp->over == (ngx_msec_t) NGX_ERROR) {
+             return NGX_ERROR;
+         }
+
+         return NGX_OK;
+     }
+
+     if (value->len == sizeof("curve=linear") - 1
+         && ngx_strncmp(value->data, "curve=linear", value->len) == 0)
+     {
+         ramp->curve = NGX_HTTP_SLEEP_RAMP_LINEAR;
+         return NGX_OK;
+     }
+
+     if (value->len == sizeof("curve=exp") - 1
+         && ngx_strncmp(value->data, "curve=exp", value->len) == 0)
+     {
+         ramp->curve = NGX_HTTP_SLEEP_RAMP_EXP;
+         return NGX_OK;
+     }
+
+     return NGX_ERROR;
+ }
+
+ /**
+  * Compute Ramp Delay
+  *
+  * Returns the delay at the given time since the start of the ramp. The
+  * progress is a 16-bit fraction; the exponential curve (2^8x - 1) / 255
+  * is interpolated from a small table, so no floating point is involved.
+  */
+ static ngx_msec_t
+ ngx_http_sleep_ramp_value(ngx_http_sleep_ramp_t *ramp, ngx_msec_int_t elapsed)
+ {
+     uint32_t  f, lo, hi;
+
+     static uint32_t  exp_curve[33] = {
+         0, 49, 106, 175, 257, 354, 470, 607, 771, 966, 1197, 1472, 1799,
+         2188, 2651, 3201, 3855, 4633, 5558, 6659, 7967, 9523, 11374, 13574,
+         16191, 19303, 23004, 27406, 32639, 38864, 46266, 55068, 65536
+     };
+
+     if (elapsed <= 0) {
+         return ramp->from; // Not started yet
+     }
+
+     if ((ngx_msec_t) elapsed >= ramp->over) {
+         return ramp->to; // Ramp complete
+     }
+
+     f = (uint32_t) (((uint64_t) elapsed << 16) / ramp->over); // 0 .. 65535
+
+     if (ramp->curve == NGX_HTTP_SLEEP_RAMP_EXP) {
+         lo = exp_curve[f >> 11];
+         hi = exp_curve[(f >> 11) + 1];
+         f = lo + (((hi - lo) * (f & 2047)) >> 11);
+     }
+
+     return (ngx_msec_t) ((int64_t) ramp->from
+                          + ((((int64_t) ramp->to - (int64_t) ramp->from) * f) >> 16));
+ }
+
+ /**
+  * Parse sb_sleep_window Directive
+  *
+  * Syntax: sb_sleep_window [start=unixtime] duration=time;
+  * Limits the configured delays to a time window, which starts when the
+  * configuration is loaded unless a start time is given. After the window
+  * the delays stop without a reload. Without a start time, every reload
+  * opens the window anew, as nothing of the old configuration is kept.
+  */
+ static char *
+ ngx_http_sleep_window(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_sleep_loc_conf_t  *slcf = conf;
+     ngx_str_t                  *value, s;
+     ngx_uint_t                  i;
+     time_t                      start, duration;
+
+     if (slcf->window_end != NGX_CONF_UNSET) {
+         return "is duplicate";
+     }
+
+     value = cf->args->elts;
+
+     start = ngx_time();
+     duration = NGX_ERROR;
+
+     for (i = 1; i < cf->args->nelts; i++) {
+
+         if (ngx_strncmp(value[i].data, "start=", 6) == 0) {
+             start = ngx_atotm(value[i].data + 6, value[i].len - 6);
+             if (start == NGX_ERROR) {
+                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                    "invalid start time \"%V\"", &value[i]);
+                 return NGX_CONF_ERROR;
+             }
+             continue;
+         }
+
+         if (ngx_strncmp(value[i].data, "duration=", 9) == 0) {
+             s.data = value[i].data + 9;
+             s.len = value[i].len - 9;
+
+             duration = ngx_parse_time(&s, 1);
+             if (duration == NGX_ERROR || duration == 0) {
+                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                    "invalid duration \"%V\"", &value[i]);
+                 return NGX_CONF_ERROR;
+             }
+             continue;
+         }
+
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "invalid parameter \"%V\"", &value[i]);
+         return NGX_CONF_ERROR;
+     }
+
+     if (duration == NGX_ERROR) {
+         return "requires \"duration=\"";
+     }
+
+     slcf->window_start = start;
+     slcf->window_end = start + duration;
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Parse sb_sleep_rule Directive
+  *
+  * Syntax: sb_sleep_rule header=name|cookie=name value=value ms=ms;
+  * Adds a value to the matcher of the header or cookie. All rules of a
+  * level are compiled into one hash per header or cookie at merge time.
+  */
+ static char *
+ ngx_http_sleep_rule(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_sleep_loc_conf_t  *slcf = conf;
+     ngx_http_sleep_matcher_t   *m;
+     ngx_hash_key_t             *key;
+     ngx_str_t                  *value, name, val;
+     ngx_uint_t                  i, source;
+     ngx_int_t                   ms;
+     ngx_msec_t                 *delay;
+
+     value = cf->args->elts;
+
+     source = NGX_CONF_UNSET_UINT;
+     ngx_str_null(&name);
+     ngx_str_null(&val);
+     ms = NGX_ERROR;
+
+     for (i = 1; i < cf->args->nelts; i++) {
+
+         if (ngx_strncmp(value[i].data, "header=", 7) == 0) {
+             source = NGX_HTTP_SLEEP_MATCH_HEADER;
+             name.data = value[i].data + 7;
+             name.len = value[i].len - 7;
+             continue;
+         }
+
+         if (ngx_strncmp(value[i].data, "cookie=", 7) == 0) {
+             source = NGX_HTTP_SLEEP_MATCH_COOKIE;
+             name.data = value[i].data + 7;
+             name.len = value[i].len - 7;
+             continue;
+         }
+
+         if (ngx_strncmp(value[i].data, "value=", 6) == 0) {
+             val.data = value[i].data + 6;
+             val.len = value[i].len - 6;
+             continue;
+         }
+
+         if (ngx_strncmp(value[i].data, "ms=", 3) == 0) {
+             ms = ngx_atoi(value[i].data + 3, value[i].len - 3);
+             if (ms == NGX_ERROR) {
+                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                    "invalid delay \"%V\"", &value[i]);
+                 return NGX_CONF_ERROR;
+             }
+             continue;
+         }
+
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "invalid parameter \"%V\"", &value[i]);
+         return NGX_CONF_ERROR;
+     }
+
+     if (source == NGX_CONF_UNSET_UINT || name.len == 0
+         || val.len == 0 || ms == NGX_ERROR)
+     {
+         return "requires \"header=\" or \"cookie=\", \"value=\" and \"ms=\"";
+     }
+
+     if (val.len > NGX_HTTP_SLEEP_KEY_MAX) {
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "value \"%V\" is too long", &val);
+         return NGX_CONF_ERROR;
+     }
+
+     if (source == NGX_HTTP_SLEEP_MATCH_HEADER) {
+         ngx_strlow(name.data, name.data, name.len); // Header names are case-insensitive
+     }
+
+     if (slcf->matchers == NGX_CONF_UNSET_PTR) {
+         slcf->matchers = ngx_array_create(cf->pool, 2, sizeof(ngx_http_sleep_matcher_t));
+         if (slcf->matchers == NULL) {
+             return NGX_CONF_ERROR;
+         }
+     }
+
+     /* Find the matcher of this header or cookie */
+     m = slcf->matchers->elts;
+
+     for (i = 0; i < slcf->matchers->nelts; i++) {
+         if (m[i].source == source
+             && m[i].name.len == name.len
+             && ngx_strncmp(m[i].name.data, name.data, name.len) == 0)
+         {
+             break;
+         }
+     }
+
+     if (i == slcf->matchers->nelts) {
+         m = ngx_array_push(slcf->matchers);
+         if (m == NULL) {
+             return NGX_CONF_ERROR;
+         }
+
+         ngx_memzero(m, sizeof(ngx_http_sleep_matcher_t));
+
+         m->source = source;
+         m->name = name;
+         m->name_hash = ngx_hash_key(name.data, name.len);
+
+         m->keys = ngx_array_create(cf->temp_pool, 16, sizeof(ngx_hash_key_t));
+         if (m->keys == NULL) {
+             return NGX_CONF_ERROR;
+         }
+
+     } else {
+         m = &m[i];
+     }
+
+     /* Values are compared in lowercase, as ngx_hash_init stores them */
+     ngx_strlow(val.data, val.data, val.len);
+
+     key = m->keys->elts;
+
+     for (i = 0; i < m->keys->nelts; i++) {
+         if (key[i].key.len == val.len
+             && ngx_strncmp(key[i].key.data, val.data, val.len) == 0)
+         {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "duplicate rule for value \"%V\"", &val);
+             return NGX_CONF_ERROR;
+         }
+     }
+
+     delay = ngx_palloc(cf->pool, sizeof(ngx_msec_t));
+     if (delay == NULL) {
+         return NGX_CONF_ERROR;
+     }
+
+     *delay = (ngx_msec_t) ms;
+
+     key = ngx_array_push(m->keys);
+     if (key == NULL) {
+         return NGX_CONF_ERROR;
+     }
+
+     key->key = val;
+     key->key_hash = ngx_hash_key(val.data, val.len);
+     key->value = delay;
+
+     if (val.len > m->max_len) {
+         m->max_len = val.len;
+     }
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Build Request Rule Hashes
+  *
+  * Compiles the values of each matcher into a hash sized to its rules,
+  * with buckets large enough for the longest value.
+  */
+ static ngx_int_t
+ ngx_http_sleep_rules_build(ngx_conf_t *cf, ngx_array_t *matchers)
+ {
+     ngx_http_sleep_matcher_t  *m;
+     ngx_hash_key_t            *key;
+     ngx_hash_init_t            hash;
+     ngx_uint_t                 i, k, size;
+
+     m = matchers->elts;
+
+     for (i = 0; i < matchers->nelts; i++) {
+
+         if (m[i].hash.buckets) {
+             continue; // Built for the level that defined the rules
+         }
+
+         key = m[i].keys->elts;
+         hash.bucket_size = ngx_cacheline_size;
+
+         for (k = 0; k < m[i].keys->nelts; k++) {
+             size = NGX_HASH_ELT_SIZE(&key[k]) + sizeof(void *);
+             if (size > hash.bucket_size) {
+                 hash.bucket_size = ngx_align(size, ngx_cacheline_size);
+             }
+         }
+
+         hash.hash = &m[i].hash;
+         hash.key = ngx_hash_key;
+         hash.max_size = ngx_max(512, 4 * m[i].keys->nelts);
+         hash.name = "sb_sleep_rule_hash";
+         hash.pool = cf->pool;
+         hash.temp_pool = NULL;
+
+         if (ngx_hash_init(&hash, key, m[i].keys->nelts) != NGX_OK) {
+             return NGX_ERROR;
+         }
+     }
+
+     return NGX_OK;
+ }
+
+ /**
+  * Match Request Rules
+  *
+  * Looks up the request's value of each matched header or cookie in the
+  * matcher's hash: one scan of the request headers, comparing precomputed
+  * hashes, and one hash probe per matcher. The first matching rule wins.
+  */
+ static ngx_int_t
+ ngx_http_sleep_match(ngx_http_request_t *r, ngx_http_sleep_loc_conf_t *slcf,
+     ngx_msec_t *delay)
+ {
+     ngx_http_sleep_matcher_t  *m;
+     ngx_list_part_t           *part;
+     ngx_table_elt_t           *h;
+     ngx_str_t                 *value, cookie;
+     ngx_msec_t                *found;
+     ngx_uint_t                 i, j, hash;
+     u_char                     buf[NGX_HTTP_SLEEP_KEY_MAX];
+
+     m = slcf->matchers->elts;
+
+     for (i = 0; i < slcf->matchers->nelts; i++) {
+         value = NULL;
+
+         if (m[i].source == NGX_HTTP_SLEEP_MATCH_HEADER) {
+             part = &r->headers_in.headers.part;
+             h = part->elts;
+
+             for (j = 0; /* void */; j++) {
+
+                 if (j >= part->nelts) {
+                     if (part->next == NULL) {
+                         break;
+                     }
+
+                     part = part->next;
+                     h = part->elts;
+                     j = 0;
+                 }
+
+                 if (h[j].hash == m[i].name_hash
+                     && h[j].key.len == m[i].name.len
+                     && ngx_strncmp(h[j].lowcase_key, m[i].name.data, m[i].name.len) == 0)
+                 {
+                     value = &h[j].value;
+                     break;
+                 }
+             }
+
+         } else {
+ #if (nginx_version >= 1023000)
+             if (ngx_http_parse_multi_header_lines(r, r->headers_in.cookie,
+                                                   &m[i].name, &cookie)
+                 != NULL)
+ #else
+             if (ngx_http_parse_multi_header_lines(&r->headers_in.cookies,
+                                                   &m[i].name, &cookie)
+                 != NGX_DECLINED)
+ #endif
+             {
+                 value = &cookie;
+             }
+         }
+
+         if (value == NULL || value->len == 0 || value->len > m[i].max_len) {
+             continue;
+         }
+
+         hash = ngx_hash_strlow(buf, value->data, value->len);
+
+         found = ngx_hash_find(&m[i].hash, hash, buf, value->len);
+         if (found) {
+             *delay = *found;
+             return NGX_OK;
+         }
+     }
+
+     return NGX_DECLINED;
+ }
+
+ /**
+  * Parse sb_sleep_max_concurrent Directive
+  *
+  * Syntax: sb_sleep_max_concurrent number [shared] [status=code];
+  * Limits the sleeps counted against this directive, per worker or, with
+  * "shared", across all workers. At the limit the delay is skipped, or the
+  * request is rejected with the given status.
+  */
+ static char *
+ ngx_http_sleep_max_concurrent(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_sleep_loc_conf_t   *slcf = conf;
+     ngx_str_t                   *value;
+     ngx_int_t                    n;
+     ngx_uint_t                   i, shared;
+
+     if (slcf->max_concurrent != NGX_CONF_UNSET_UINT) {
+         return "is duplicate";
+     }
+
+     value = cf->args->elts;
+
+     n = ngx_atoi(value[1].data, value[1].len);
+     if (n == NGX_ERROR || n == 0) {
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "invalid number \"%V\"", &value[1]);
+         return NGX_CONF_ERROR;
+     }
+
+     slcf->max_concurrent = (ngx_uint_t) n;
+     slcf->concurrent_status = 0;
+     shared = 0;
+
+     for (i = 2; i < cf->args->nelts; i++) {
+
+         if (ngx_strcmp(value[i].data, "shared") == 0) {
+             shared = 1;
+             continue;
+         }
+
+         if (ngx_strncmp(value[i].data, "status=", 7) == 0) {
+             n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+             if (n < 400 || n > 599) {
+                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                    "invalid status \"%V\"", &value[i]);
+                 return NGX_CONF_ERROR;
+             }
+
+             slcf->concurrent_status = (ngx_uint_t) n;
+             continue;
+         }
+
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "invalid parameter \"%V\"", &value[i]);
+         return NGX_CONF_ERROR;
+     }
+
+     if (shared) {
+         /* The counter lives in the limits zone added by init_main_conf */
+         if (ngx_http_sleep_limit_slot(cf, &slcf->concurrent_slot) != NGX_OK) {
+             return NGX_CONF_ERROR;
+         }
+         slcf->concurrent = NULL;
+
+     } else {
+         /* Every worker has its own copy of the configuration, and so of the counter */
+         slcf->concurrent = ngx_pcalloc(cf->pool, sizeof(ngx_atomic_t));
+         if (slcf->concurrent == NULL) {
+             return NGX_CONF_ERROR;
+         }
+     }
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Add Limits Zone Counter
+  *
+  * Reserves the next counter of the limits zone for the directive being
+  * parsed and records its identity, which names the zone's layout.
+  */
+ static ngx_int_t
+ ngx_http_sleep_limit_slot(ngx_conf_t *cf, ngx_uint_t *slot)
+ {
+     ngx_http_sleep_main_conf_t  *smcf;
+     ngx_http_core_loc_conf_t    *clcf;
+     ngx_http_sleep_limit_key_t  *key;
+     ngx_str_t                   *value;
+     ngx_uint_t                   i;
+
+     smcf = ngx_http_conf_get_module_main_conf(cf, ngx_steadybit_sleep_module);
+     clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+     key = ngx_array_push(&smcf->limit_keys);
+     if (key == NULL) {
+         return NGX_ERROR;
+     }
+
+     key->cscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_core_module);
+
+     ngx_crc32_init(key->crc);
+     ngx_crc32_update(&key->crc, clcf->name.data, clcf->name.len);
+
+     value = cf->args->elts;
+     for (i = 0; i < cf->args->nelts; i++) {
+         ngx_crc32_update(&key->crc, (u_char *) " ", 1); // Keep "a b" apart from "ab"
+         ngx_crc32_update(&key->crc, value[i].data, value[i].len);
+     }
+
+     ngx_crc32_final(key->crc);
+
+     *slot = smcf->nlimits++;
+
+     return NGX_OK;
+ }
+
+ /**
+  * Parse sb_sleep_budget Directive
+  *
+  * Syntax: sb_sleep_budget number [chunk=number];
+  * Delays at most the given number of requests across all workers. The
+  * counter of claimed requests lives in the limits zone.
+  */
+ static char *
+ ngx_http_sleep_budget(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_sleep_loc_conf_t   *slcf = conf;
+     ngx_http_sleep_budget_t     *budget;
+     ngx_str_t                   *value;
+     ngx_int_t                    n;
+
+     if (slcf->budget != NGX_CONF_UNSET_PTR) {
+         return "is duplicate";
+     }
+
+     value = cf->args->elts;
+
+     n = ngx_atoi(value[1].data, value[1].len);
+     if (n == NGX_ERROR || n == 0) {
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "invalid number \"%V\"", &value[1]);
+         return NGX_CONF_ERROR;
+     }
+
+     budget = ngx_pcalloc(cf->pool, sizeof(ngx_http_sleep_budget_t));
+     if (budget == NULL) {
+         return NGX_CONF_ERROR;
+     }
+
+     budget->total = (ngx_atomic_uint_t) n;
+     budget->chunk = NGX_HTTP_SLEEP_BUDGET_CHUNK;
+
+     if (cf->args->nelts == 3) {
+         if (ngx_strncmp(value[2].data, "chunk=", 6) != 0) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "invalid parameter \"%V\"", &value[2]);
+             return NGX_CONF_ERROR;
+         }
+
+         n = ngx_atoi(value[2].data + 6, value[2].len - 6);
+         if (n == NGX_ERROR || n == 0) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "invalid chunk \"%V\"", &value[2]);
+             return NGX_CONF_ERROR;
+         }
+
+         budget->chunk = (ngx_atomic_uint_t) n;
+     }
+
+     /* The counter lives in the limits zone added by init_main_conf */
+     if (ngx_http_sleep_limit_slot(cf, &budget->slot) != NGX_OK) {
+         return NGX_CONF_ERROR;
+     }
+
+     slcf->budget = budget;
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Take From Budget
+  *
+  * Uses one request of the budget, from the worker's cache if possible.
+  * Otherwise a chunk is claimed with one atomic fetch-add on the shared
+  * counter; requests beyond the total are never handed out, so the budget
+  * is exact. Chunks shrink towards the end, so that few claimed requests
+  * are left unused in workers that receive no more traffic.
+  */
+ static ngx_int_t
+ ngx_http_sleep_budget_take(ngx_http_request_t *r, ngx_http_sleep_budget_t *budget)
+ {
+     ngx_http_sleep_main_conf_t  *smcf;
+     ngx_core_conf_t             *ccf;
+     ngx_atomic_t                *claimed;
+     ngx_atomic_uint_t            old, n;
+
+     if (budget->cached) {
+         budget->cached--;
+         return NGX_OK; // Fast path, no shared memory access
+     }
+
+     if (budget->exhausted) {
+         return NGX_DECLINED;
+     }
+
+     smcf = ngx_http_get_module_main_conf(r, ngx_steadybit_sleep_module);
+     claimed = (ngx_atomic_t *) ((u_char *) smcf->limits_zone->data
+                                 + budget->slot * NGX_HTTP_SLEEP_LIMIT_STRIDE);
+
+     /* Claim at most half of an even share of what is left */
+     ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx, ngx_core_module);
+
+     old = *claimed;
+     n = (old < budget->total) ? budget->total - old : 0;
+     n /= 2 * (ngx_atomic_uint_t) ngx_max(ccf->worker_processes, 1);
+     n = ngx_max(ngx_min(n, budget->chunk), 1);
+
+     old = ngx_atomic_fetch_add(claimed, n);
+
+     if (old >= budget->total) {
+         budget->exhausted = 1; // Stop touching the shared counter
+
+         ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                       "sb_sleep_budget of %uA requests used up", budget->total);
+
+         return NGX_DECLINED;
+     }
+
+     budget->cached = ngx_min(n, budget->total - old) - 1; // One is used right now
+
+     return NGX_OK;
+ }
+
+ /**
+  * Parse sb_fault Directive
+  *
+  * Syntax: sb_fault status=code|reset [percent=P];
+  * Several faults of a level must not add up to more than 100%.
+  */
+ static char *
+ ngx_http_sleep_fault_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_sleep_loc_conf_t  *slcf = conf;
+     ngx_http_sleep_fault_t     *fault, *f;
+     ngx_str_t                  *value;
+     ngx_int_t                   n;
+     ngx_uint_t                  i, total;
+     size_t                      len;
+
+     value = cf->args->elts;
+
+     if (slcf->faults == NGX_CONF_UNSET_PTR) {
+         slcf->faults = ngx_array_create(cf->pool, 2, sizeof(ngx_http_sleep_fault_t));
+         if (slcf->faults == NULL) {
+             return NGX_CONF_ERROR;
+         }
+     }
+
+     fault = ngx_array_push(slcf->faults);
+     if (fault == NULL) {
+         return NGX_CONF_ERROR;
+     }
+
+     if (ngx_strcmp(value[1].data, "reset") == 0) {
+         fault->status = NGX_HTTP_CLOSE;
+
+     } else if (ngx_strncmp(value[1].data, "status=", 7) == 0) {
+         n = ngx_atoi(value[1].data + 7, value[1].len - 7);
+         if (n < 400 || n > 599) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "invalid status \"%V\"", &value[1]);
+             return NGX_CONF_ERROR;
+         }
+
+         fault->status = (ngx_uint_t) n;
+
+     } else {
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "invalid parameter \"%V\"", &value[1]);
+         return NGX_CONF_ERROR;
+     }
+
+     fault->percent = 10000;
+
+     if (cf->args->nelts == 3) {
+         if (ngx_strncmp(value[2].data, "percent=", 8) != 0) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "invalid parameter \"%V\"", &value[2]);
+             return NGX_CONF_ERROR;
+         }
+
+         len = value[2].len - 8;
+         if (len && value[2].data[value[2].len - 1] == '%') {
+             len--; // Strip the percent sign
+         }
+
+         n = ngx_atofp(value[2].data + 8, len, 2); // Hundredths of a percent
+         if (n == NGX_ERROR || n > 10000) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "invalid percentage \"%V\"", &value[2]);
+             return NGX_CONF_ERROR;
+         }
+
+         fault->percent = (ngx_uint_t) n;
+     }
+
+     /* One random draw picks at most one fault, so the shares must fit */
+     f = slcf->faults->elts;
+     total = 0;
+
+     for (i = 0; i < slcf->faults->nelts; i++) {
+         total += f[i].percent;
+     }
+
+     if (total > 10000) {
+         return "adds up to more than 100%";
+     }
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Pick Fault
+  *
+  * Draws one random number and returns the status of the fault it falls
+  * into, or 0 for none. Called once per request, with the sleep decision.
+  */
+ static ngx_uint_t
+ ngx_http_sleep_fault_pick(ngx_array_t *faults)
+ {
+     ngx_http_sleep_fault_t  *f;
+     ngx_uint_t               i, v;
+
+     v = (ngx_uint_t) (((ngx_http_sleep_rand() >> 32) * 10000) >> 32); // 0 .. 9999
+     f = faults->elts;
+
+     for (i = 0; i < faults->nelts; i++) {
+         if (v < f[i].percent) {
+             return f[i].status;
+         }
+
+         v -= f[i].percent;
+     }
+
+     return 0;
+ }
+
+ /**
+  * Inject Fault
+  *
+  * Returns the status to finalize the request with. A reset closes the
+  * connection with SO_LINGER 0, so the client gets a RST and no response;
+  * HTTP/2 and HTTP/3 requests have their stream reset instead, which
+  * leaves the other streams of the connection alone.
+  */
+ static ngx_int_t
+ ngx_http_sleep_fault(ngx_http_request_t *r, ngx_uint_t status)
+ {
+     struct linger  linger;
+
+     if (ngx_http_sleep_stats) {
+         (void) ngx_atomic_fetch_add(&ngx_http_sleep_stats->faulted, 1);
+     }
+
+     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                    "sb_fault: finalizing with %ui", status);
+
+     if (status != NGX_HTTP_CLOSE) {
+         return (ngx_int_t) status;
+     }
+
+ #if (NGX_HTTP_V2)
+     if (r->stream) {
+         return NGX_HTTP_CLOSE;
+     }
+ #endif
+
+ #if (NGX_HTTP_V3)
+     if (r->connection->quic) {
+         return NGX_HTTP_CLOSE;
+     }
+ #endif
+
+     linger.l_onoff = 1;
+     linger.l_linger = 0;
+
+     if (setsockopt(r->connection->fd, SOL_SOCKET, SO_LINGER,
+                    (const void *) &linger, sizeof(struct linger)) == -1)
+     {
+         ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_socket_errno,
+                       "setsockopt(SO_LINGER) failed");
+     }
+
+     return NGX_HTTP_CLOSE;
+ }
+
+ /**
+  * Injected Delay
+  *
+  * Milliseconds the request slept, or is going to sleep if its sleep is
+  * still pending, as for sleeps before the response header.
+  */
+ static ngx_msec_t
+ ngx_http_sleep_injected(ngx_http_sleep_ctx_t *ctx)
+ {
+     return (ctx->waiting ? ctx->wake_time : ctx->end_time) - ctx->start_time;
+ }
+
+ /**
+  * Annotate Response
+  *
+  * Adds "X-Sb-Injected-Delay: <ms>" to the response headers of a request
+  * that slept. Requests without a sleep allocate nothing.
+  */
+ static ngx_int_t
+ ngx_http_sleep_annotate_response(ngx_http_request_t *r)
+ {
+     ngx_http_sleep_ctx_t  *ctx;
+     ngx_str_t              key, value;
+     u_char                *p;
+
+     ctx = ngx_http_sleep_get_ctx(r);
+     if (ctx == NULL || !ctx->slept) {
+         return NGX_OK;
+     }
+
+     p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN);
+     if (p == NULL) {
+         return NGX_ERROR;
+     }
+
+     value.data = p;
+     value.len = ngx_sprintf(p, "%M", ngx_http_sleep_injected(ctx)) - p;
+
+     ngx_str_set(&key, "X-Sb-Injected-Delay");
+
+     return ngx_http_sleep_annotate_header(r, &r->headers_out.headers, &key,
+                                           (u_char *) "x-sb-injected-delay",
+                                           ngx_http_sleep_injected_hash, &value);
+ }
+
+ /**
+  * Annotate Upstream Request
+  *
+  * Called when an access sleep ends, before the request is passed on.
+  * Adds "X-Sb-Injected-Delay: <ms>" to the request headers, which proxied
+  * requests carry to the upstream, and/or puts "sb=delay:<ms>" first into
+  * the W3C tracestate header of traced requests, replacing an sb entry of
+  * an earlier hop.
+  */
+ static ngx_int_t
+ ngx_http_sleep_annotate_request(ngx_http_request_t *r, ngx_http_sleep_ctx_t *ctx,
+     ngx_uint_t annotate)
+ {
+     ngx_list_part_t  *part;
+     ngx_table_elt_t  *h, *traceparent, *tracestate;
+     ngx_str_t         key, value;
+     ngx_msec_t        ms;
+     ngx_uint_t        i;
+     u_char           *p, *last, *s, *e, *b, *end;
+     size_t            len;
+
+     ms = ngx_http_sleep_injected(ctx);
+
+     if (annotate & NGX_HTTP_SLEEP_ANNOTATE_UPSTREAM) {
+         p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN);
+         if (p == NULL) {
+             return NGX_ERROR;
+         }
+
+         value.data = p;
+         value.len = ngx_sprintf(p, "%M", ms) - p;
+
+         ngx_str_set(&key, "X-Sb-Injected-Delay");
+
+         if (ngx_http_sleep_annotate_header(r, &r->headers_in.headers, &key,
+                                            (u_char *) "x-sb-injected-delay",
+                                            ngx_http_sleep_injected_hash, &value)
+             != NGX_OK)
+         {
+             return NGX_ERROR;
+         }
+     }
+
+     if (!(annotate & NGX_HTTP_SLEEP_ANNOTATE_TRACESTATE)) {
+         return NGX_OK;
+     }
+
+     traceparent = NULL;
+     tracestate = NULL;
+
+     part = &r->headers_in.headers.part;
+     h = part->elts;
+
+     for (i = 0; /* void */; i++) {
+
+         if (i >= part->nelts) {
+             if (part->next == NULL) {
+                 break;
+             }
+
+             part = part->next;
+             h = part->elts;
+             i = 0;
+         }
+
+         if (h[i].key.len == sizeof("traceparent") - 1
+             && ngx_strncasecmp(h[i].key.data, (u_char *) "traceparent",
+                                sizeof("traceparent") - 1) == 0)
+         {
+             traceparent = &h[i];
+
+         } else if (tracestate == NULL
+                    && h[i].key.len == sizeof("tracestate") - 1
+                    && ngx_strncasecmp(h[i].key.data, (u_char *) "tracestate",
+                                       sizeof("tracestate") - 1) == 0)
+         {
+             tracestate = &h[i];
+         }
+     }
+
+     if (traceparent == NULL) {
+         return NGX_OK; // A tracestate without a trace means nothing
+     }
+
+     len = sizeof("sb=delay:") - 1 + NGX_TIME_T_LEN
+           + (tracestate ? 1 + tracestate->value.len : 0);
+
+     p = ngx_pnalloc(r->pool, len);
+     if (p == NULL) {
+         return NGX_ERROR;
+     }
+
+     last = ngx_sprintf(p, "sb=delay:%M", ms);
+
+     if (tracestate == NULL) {
+         value.data = p;
+         value.len = last - p;
+
+         ngx_str_set(&key, "tracestate");
+
+         return ngx_http_sleep_annotate_header(r, &r->headers_in.headers, &key,
+                                               (u_char *) "tracestate",
+                                               ngx_http_sleep_tracestate_hash, &value);
+     }
+
+     /* Keep the other members in order, our updated entry goes first */
+     s = tracestate->value.data;
+     end = s + tracestate->value.len;
+
+     while (s < end) {
+         e = ngx_strlchr(s, end, ',');
+         if (e == NULL) {
+             e = end;
+         }
+
+         for (b = s; b < e && (*b == ' ' || *b == '\t'); b++) {
+             /* void */
+         }
+
+         if (b < e && !(e - b >= 3 && ngx_strncmp(b, "sb=", 3) == 0)) {
+             *last++ = ',';
+             last = ngx_cpymem(last, b, e - b);
+         }
+
+         s = e + 1;
+     }
+
+     tracestate->value.data = p;
+     tracestate->value.len = last - p;
+
+     return NGX_OK;
+ }
+
+ /**
+  * Append Annotation Header
+  *
+  * Pushes a header with a static name onto a request or response header list.
+  */
+ static ngx_int_t
+ ngx_http_sleep_annotate_header(ngx_http_request_t *r, ngx_list_t *headers,
+     ngx_str_t *key, u_char *lowcase, ngx_uint_t hash, ngx_str_t *value)
+ {
+     ngx_table_elt_t  *h;
+
+     h = ngx_list_push(headers);
+     if (h == NULL) {
+         return NGX_ERROR;
+     }
+
+     h->hash = hash;
+     h->key = *key;
+     h->lowcase_key = lowcase;
+     h->value = *value;
+ #if (nginx_version >= 1023000)
+     h->next = NULL;
+ #endif
+
+     return NGX_OK;
+ }
+
+ /**
+  * Initialize Limits Zone
+  *
+  * Allocates the shared concurrency and budget counters. Counters are kept
+  * across reloads that leave their layout unchanged, so sleeps of old
+  * workers are released against the same slots and budgets that are used
+  * up stay used up. Other layouts live in a zone of another name.
+  */
+ static ngx_int_t
+ ngx_http_sleep_init_limits_zone(ngx_shm_zone_t *shm_zone, void *data)
+ {
+     ngx_slab_pool_t  *shpool;
+
+     if (data) {
+         shm_zone->data = data; // Keep counters across reloads
+         return NGX_OK;
+     }
+
+     shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+     if (shm_zone->shm.exists) {
+         shm_zone->data = shpool->data; // Zone inherited by a new binary
+         return NGX_OK;
+     }
+
+     /* Page-aligned, so every counter starts on its own cache line */
+     shm_zone->data = ngx_slab_calloc(shpool, shm_zone->shm.size - 8 * ngx_pagesize);
+     if (shm_zone->data == NULL) {
+         return NGX_ERROR;
+     }
+
+     shpool->data = shm_zone->data;
+
+     return NGX_OK;
+ }
+
+ /**
+  * Acquire Concurrency Slot
+  *
+  * Counts a sleep against sb_sleep_max_concurrent. Returns NGX_OK and the
+  * counter to release in *counter, NULL without a limit; NGX_DECLINED if
+  * the limit is reached and the delay is skipped; or the rejection status.
+  */
+ static ngx_int_t
+ ngx_http_sleep_acquire(ngx_http_request_t *r, ngx_http_sleep_loc_conf_t *slcf,
+     ngx_atomic_t **counter)
+ {
+     ngx_http_sleep_main_conf_t  *smcf;
+     ngx_atomic_t                *c;
+
+     *counter = NULL;
+
+     if (slcf->max_concurrent == 0) {
+         return NGX_OK;
+     }
+
+     c = slcf->concurrent;
+
+     if (c == NULL) {
+         smcf = ngx_http_get_module_main_conf(r, ngx_steadybit_sleep_module);
+         c = (ngx_atomic_t *) ((u_char *) smcf->limits_zone->data
+                               + slcf->concurrent_slot * NGX_HTTP_SLEEP_LIMIT_STRIDE);
+     }
+
+     if (ngx_atomic_fetch_add(c, 1) >= slcf->max_concurrent) {
+         (void) ngx_atomic_fetch_add(c, -1);
+
+         ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                       "not sleeping, %ui concurrent sleeps reached",
+                       slcf->max_concurrent);
+
+         return slcf->concurrent_status ? (ngx_int_t) slcf->concurrent_status
+                                        : NGX_DECLINED;
+     }
+
+     *counter = c;
+
+     return NGX_OK;
+ }
+
+ /**
+  * Release Concurrency Slot
+  *
+  * Uncounts a finished or aborted sleep.
+  */
+ static void
+ ngx_http_sleep_release(ngx_http_sleep_ctx_t *ctx)
+ {
+     if (ctx->concurrent) {
+         (void) ngx_atomic_fetch_add(ctx->concurrent, -1);
+         ctx->concurrent = NULL;
+     }
+ }
+
+ /**
+  * Acquire Filter Sleep
+  *
+  * Counts a filter sleep against sb_sleep_max_concurrent and, for its
+  * first sleep, the request against the budget, in the order the access
+  * handler uses: a skipped sleep never uses up a budget unit. A request
+  * whose budget is used up sleeps no more.
+  */
+ static ngx_int_t
+ ngx_http_sleep_filter_acquire(ngx_http_request_t *r,
+     ngx_http_sleep_loc_conf_t *slcf, ngx_http_sleep_ctx_t *ctx)
+ {
+     if (ngx_http_sleep_acquire(r, slcf, &ctx->concurrent) != NGX_OK) {
+         return NGX_DECLINED;
+     }
+
+     /* The budget counts requests, however often their response sleeps */
+     if (slcf->budget != NULL && !ctx->budgeted) {
+         if (ngx_http_sleep_budget_take(r, slcf->budget) != NGX_OK) {
+             ngx_http_sleep_release(ctx);
+             ctx->at = NGX_HTTP_SLEEP_AT_ACCESS; // No more filter sleeps
+             return NGX_DECLINED;
+         }
+
+         ctx->budgeted = 1;
+     }
+
+     return NGX_OK;
+ }
+
+ /**
+  * Parse sb_upstream_sleep_ms Directive
+  *
+  * Syntax: sb_upstream_sleep_ms ms [peer];
+  * Adds a delay for all peers of the upstream block, or for the peer with
+  * the given address. The first use wraps the balancer configured so far,
+  * the same way the keepalive module does.
+  */
+ static char *
+ ngx_http_sleep_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_sleep_srv_conf_t       *sscf = conf;
+     ngx_http_upstream_srv_conf_t    *uscf;
+     ngx_http_sleep_upstream_rule_t  *rule;
+     ngx_str_t                       *value;
+     ngx_int_t                        ms;
+
+     value = cf->args->elts;
+
+     ms = ngx_atoi(value[1].data, value[1].len);
+     if (ms == NGX_ERROR) {
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "invalid delay \"%V\"", &value[1]);
+         return NGX_CONF_ERROR;
+     }
+
+     if (sscf->rules == NULL) {
+         sscf->rules = ngx_array_create(cf->pool, 2, sizeof(ngx_http_sleep_upstream_rule_t));
+         if (sscf->rules == NULL) {
+             return NGX_CONF_ERROR;
+         }
+
+         uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+         sscf->original_init_upstream = uscf->peer.init_upstream
+                                        ? uscf->peer.init_upstream
+                                        : ngx_http_upstream_init_round_robin;
+
+         uscf->peer.init_upstream = ngx_http_sleep_upstream_init;
+     }
+
+     rule = ngx_array_push(sscf->rules);
+     if (rule == NULL) {
+         return NGX_CONF_ERROR;
+     }
+
+     rule->delay = (ngx_msec_t) ms;
+
+     if (cf->args->nelts == 3) {
+         rule->peer = value[2];
+
+     } else {
+         ngx_str_null(&rule->peer);
+     }
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Initialize Upstream
+  *
+  * Initializes the wrapped balancer and takes over its per-request init.
+  */
+ static ngx_int_t
+ ngx_http_sleep_upstream_init(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+ {
+     ngx_http_sleep_srv_conf_t  *sscf;
+
+     sscf = ngx_http_conf_upstream_srv_conf(us, ngx_steadybit_sleep_module);
+
+     if (sscf->original_init_upstream(cf, us) != NGX_OK) {
+         return NGX_ERROR;
+     }
+
+     sscf->original_init_peer = us->peer.init;
+     us->peer.init = ngx_http_sleep_upstream_init_peer;
+
+     return NGX_OK;
+ }
+
+ /**
+  * Initialize Upstream Peer
+  *
+  * Wraps the balancer's peer callbacks and the upstream's output filter of
+  * a request. The output filter is where the request is held back, so the
+  * connection, fresh or from the keepalive cache, is set up as usual.
+  */
+ static ngx_int_t
+ ngx_http_sleep_upstream_init_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us)
+ {
+     ngx_http_sleep_srv_conf_t       *sscf;
+     ngx_http_sleep_upstream_peer_t  *sp;
+     ngx_http_upstream_t             *u;
+     ngx_pool_cleanup_t              *cln;
+
+     sscf = ngx_http_conf_upstream_srv_conf(us, ngx_steadybit_sleep_module);
+
+     sp = ngx_pcalloc(r->pool, sizeof(ngx_http_sleep_upstream_peer_t));
+     if (sp == NULL) {
+         return NGX_ERROR;
+     }
+
+     if (sscf->original_init_peer(r, us) != NGX_OK) {
+         return NGX_ERROR;
+     }
+
+     cln = ngx_pool_cleanup_add(r->pool, 0);
+     if (cln == NULL) {
+         return NGX_ERROR;
+     }
+
+     cln->handler = ngx_http_sleep_upstream_cleanup;
+     cln->data = sp;
+
+     u = r->upstream;
+
+     sp->conf = sscf;
+     sp->request = r;
+     sp->data = u->peer.data;
+     sp->original_get_peer = u->peer.get;
+     sp->original_free_peer = u->peer.free;
+
+     u->peer.data = sp;
+     u->peer.get = ngx_http_sleep_upstream_get_peer;
+     u->peer.free = ngx_http_sleep_upstream_free_peer;
+
+ #if (NGX_HTTP_SSL)
+     sp->original_set_session = u->peer.set_session;
+     sp->original_save_session = u->peer.save_session;
+
+     u->peer.set_session = ngx_http_sleep_upstream_set_session;
+     u->peer.save_session = ngx_http_sleep_upstream_save_session;
+ #endif
+
+     sp->original_output = u->output.output_filter;
+     sp->output_ctx = u->output.filter_ctx;
+
+     u->output.output_filter = ngx_http_sleep_upstream_output;
+     u->output.filter_ctx = sp;
+
+     sp->event.handler = ngx_http_sleep_upstream_wake;
+     sp->event.data = sp;
+     sp->event.log = r->connection->log;
+
+     return NGX_OK;
+ }
+
+ /**
+  * Get Upstream Peer
+  *
+  * Lets the balancer select the peer, then looks up the delay for it:
+  * a rule for its address wins over a rule for all peers. Every attempt,
+  * including retries with the next peer, gets its own delay.
+  */
+ static ngx_int_t
+ ngx_http_sleep_upstream_get_peer(ngx_peer_connection_t *pc, void *data)
+ {
+     ngx_http_sleep_upstream_peer_t  *sp = data;
+     ngx_http_sleep_upstream_rule_t  *rule;
+     ngx_uint_t                       i;
+     ngx_int_t                        rc;
+
+     rc = sp->original_get_peer(pc, sp->data);
+     if (rc != NGX_OK && rc != NGX_DONE) {
+         return rc;
+     }
+
+     sp->delay = 0;
+     sp->held = NULL;
+
+     rule = sp->conf->rules->elts;
+
+     for (i = 0; i < sp->conf->rules->nelts; i++) {
+         if (rule[i].peer.len == 0) {
+             sp->delay = rule[i].delay;
+
+         } else if (pc->name
+                    && rule[i].peer.len == pc->name->len
+                    && ngx_strncmp(rule[i].peer.data, pc->name->data, pc->name->len) == 0)
+         {
+             sp->delay = rule[i].delay;
+             break;
+         }
+     }
+
+     return rc;
+ }
+
+ /**
+  * Free Upstream Peer
+  *
+  * Stops a pending delay of a failed attempt, then lets the balancer, and
+  * the keepalive module if it wraps it, handle the connection as usual.
+  */
+ static void
+ ngx_http_sleep_upstream_free_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state)
+ {
+     ngx_http_sleep_upstream_peer_t  *sp = data;
+
+     if (sp->event.timer_set) {
+         ngx_del_timer(&sp->event);
+     }
+
+     sp->delay = 0;
+     sp->held = NULL;
+
+     sp->original_free_peer(pc, sp->data, state);
+ }
+
+ #if (NGX_HTTP_SSL)
+
+ static ngx_int_t
+ ngx_http_sleep_upstream_set_session(ngx_peer_connection_t *pc, void *data)
+ {
+     ngx_http_sleep_upstream_peer_t  *sp = data;
+
+     return sp->original_set_session(pc, sp->data);
+ }
+
+ static void
+ ngx_http_sleep_upstream_save_session(ngx_peer_connection_t *pc, void *data)
+ {
+     ngx_http_sleep_upstream_peer_t  *sp = data;
+
+     sp->original_save_session(pc, sp->data);
+ }
+
+ #endif
+
+ /**
+  * Upstream Output Filter
+  *
+  * Starts the delay with the first output of an attempt, once the
+  * connection is established, and holds back the request output by
+  * reference until the delay has elapsed.
+  */
+ static ngx_int_t
+ ngx_http_sleep_upstream_output(void *data, ngx_chain_t *in)
+ {
+     ngx_http_sleep_upstream_peer_t  *sp = data;
+
+     if (sp->delay) {
+         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, sp->request->connection->log, 0,
+                        "sleeping (async) for %M ms before sending upstream", sp->delay);
+
+         ngx_add_timer(&sp->event, sp->delay);
+         sp->delay = 0;
+     }
+
+     if (sp->event.timer_set || sp->held) {
+         if (in && ngx_chain_add_copy(sp->request->pool, &sp->held, in) != NGX_OK) {
+             return NGX_ERROR;
+         }
+
+         if (sp->event.timer_set) {
+             return NGX_AGAIN; // Still sleeping
+         }
+
+         in = sp->held;
+         sp->held = NULL;
+     }
+
+     return sp->original_output(sp->output_ctx, in);
+ }
+
+ /**
+  * Upstream Delay Timer Handler
+  *
+  * Lets the upstream continue sending the request, which passes the held
+  * output on through ngx_http_sleep_upstream_output.
+  */
+ static void
+ ngx_http_sleep_upstream_wake(ngx_event_t *ev)
+ {
+     ngx_http_sleep_upstream_peer_t  *sp = ev->data;
+     ngx_connection_t                *c;
+
+     c = sp->request->upstream->peer.connection;
+
+     if (c) {
+         ngx_post_event(c->write, &ngx_posted_events);
+     }
+ }
+
+ /**
+  * Upstream Cleanup
+  *
+  * Stops the delay timer when the request pool is destroyed.
+  */
+ static void
+ ngx_http_sleep_upstream_cleanup(void *data)
+ {
+     ngx_http_sleep_upstream_peer_t  *sp = data;
+
+     if (sp->event.timer_set) {
+         ngx_del_timer(&sp->event);
+     }
+ }
+
+ /**
+  * Parse sb_sleep_log Directive
+  *
+  * Accepts "off", "debug", "notice" or "sampled:N". In sampled mode every
+  * Nth delayed request of a worker is logged at notice level, the rest only
+  * at debug level.
+  */
+ static char *
+ ngx_http_sleep_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_sleep_loc_conf_t *slcf = conf;
+     ngx_str_t                 *value;
+     ngx_int_t                  n;
+
+     if (slcf->log_mode != NGX_CONF_UNSET_UINT) {
+         return "is duplicate";
+     }
+
+     value = cf->args->elts;
+
+     if (ngx_strcmp(value[1].data, "off") == 0) {
+         slcf->log_mode = NGX_HTTP_SLEEP_LOG_OFF;
+         return NGX_CONF_OK;
+     }
+
+     if (ngx_strcmp(value[1].data, "debug") == 0) {
+         slcf->log_mode = NGX_HTTP_SLEEP_LOG_DEBUG;
+         return NGX_CONF_OK;
+     }
+
+     if (ngx_strcmp(value[1].data, "notice") == 0) {
+         slcf->log_mode = NGX_HTTP_SLEEP_LOG_NOTICE;
+         return NGX_CONF_OK;
+     }
+
+     if (value[1].len > 8 && ngx_strncmp(value[1].data, "sampled:", 8) == 0) {
+         n = ngx_atoi(value[1].data + 8, value[1].len - 8); // Parse interval
+         if (n == NGX_ERROR || n == 0) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "invalid sampling interval \"%V\"", &value[1]);
+             return NGX_CONF_ERROR;
+         }
+
+         slcf->log_mode = NGX_HTTP_SLEEP_LOG_SAMPLED;
+         slcf->log_sample = (ngx_uint_t) n;
+         return NGX_CONF_OK;
+     }
+
+     ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                        "invalid value \"%V\", it must be \"off\", "
+                        "\"debug\", \"notice\" or \"sampled:N\"", &value[1]);
+     return NGX_CONF_ERROR;
+ }
+
+ /**
+  * Parse sb_sleep_batch Directive
+  *
+  * Accepts "max=N" to resume at most N woken requests per event loop
+  * iteration, and "spread=time" to add a random jitter of up to that time
+  * to every delay, so requests with equal delays don't wake together.
+  */
+ static char *
+ ngx_http_sleep_batch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_http_sleep_loc_conf_t *slcf = conf;
+     ngx_str_t                 *value, s;
+     ngx_int_t                  n;
+     ngx_uint_t                 i;
+
+     if (slcf->batch_max != NGX_CONF_UNSET_UINT) {
+         return "is duplicate";
+     }
+
+     value = cf->args->elts;
+
+     slcf->batch_max = 0;
+     slcf->batch_spread = 0;
+
+     for (i = 1; i < cf->args->nelts; i++) {
+
+         if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+             n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+             if (n == NGX_ERROR || n == 0) {
+                 goto invalid;
+             }
+
+             slcf->batch_max = (ngx_uint_t) n;
+             continue;
+         }
+
+         if (ngx_strncmp(value[i].data, "spread=", 7) == 0) {
+             s.len = value[i].len - 7;
+             s.data = value[i].data + 7;
+
+             n = ngx_parse_time(&s, 0); // Parse time in milliseconds
+             if (n == NGX_ERROR) {
+                 goto invalid;
+             }
+
+             slcf->batch_spread = (ngx_msec_t) n;
+             continue;
+         }
+
+         goto invalid;
+     }
+
+     return NGX_CONF_OK;
+
+ invalid:
+
+     ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                        "invalid parameter \"%V\"", &value[i]);
+     return NGX_CONF_ERROR;
+ }
+
+ /**
+  * Add Variables
+  *
+  * Registers the $sb_sleep_* variables before the configuration is parsed,
+  * so directives like log_format can refer to them.
+  */
+ static ngx_int_t
+ ngx_http_sleep_add_variables(ngx_conf_t *cf)
+ {
+     ngx_http_variable_t  *var, *v;
+
+     for (v = ngx_http_sleep_vars; v->name.len; v++) {
+         var = ngx_http_add_variable(cf, &v->name, v->flags);
+         if (var == NULL) {
+             return NGX_ERROR;
+         }
+
+         var->get_handler = v->get_handler;
+         var->data = v->data;
+     }
+
+     return NGX_OK;
+ }
+
+ /**
+  * Evaluate Variable
+  *
+  * Reads the sleep of the request from its context: the requested delay,
+  * the time actually slept so far, and whether the request was terminated
+  * while still sleeping. Requests that were not delayed yield no value.
+  */
+ static ngx_int_t
+ ngx_http_sleep_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
+     uintptr_t data)
+ {
+     ngx_http_sleep_ctx_t  *ctx;
+     ngx_msec_t             ms;
+     u_char                *p;
+
+     ctx = ngx_http_sleep_get_ctx(r);
+     if (ctx == NULL || ctx->request == NULL) {
+         v->not_found = 1; // Request was not delayed
+         return NGX_OK;
+     }
+
+     if (data == NGX_HTTP_SLEEP_VAR_ABORTED) {
+         v->len = 1;
+         v->valid = 1;
+         v->no_cacheable = 1;
+         v->not_found = 0;
+         v->data = (u_char *) (ctx->waiting ? "1" : "0");
+
+         return NGX_OK;
+     }
+
+     p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN);
+     if (p == NULL) {
+         return NGX_ERROR;
+     }
+
+     if (data == NGX_HTTP_SLEEP_VAR_REQUESTED) {
+         ms = ctx->wake_time - ctx->start_time;
+
+     } else {
+         ms = (ctx->waiting ? ngx_current_msec : ctx->end_time) - ctx->start_time;
+     }
+
+     v->len = ngx_sprintf(p, "%M", ms) - p;
+     v->valid = 1;
+     v->no_cacheable = 1;
+     v->not_found = 0;
+     v->data = p;
+
+     return NGX_OK;
+ }
+
+ /**
+  * Module Initialization
+  *
+  * Called during nginx configuration phase to register the module's handler
+  * in the HTTP request processing pipeline.
+  */
+ static ngx_int_t
+ ngx_http_sleep_init(ngx_conf_t *cf)
+ {
+     ngx_http_handler_pt        *h; // Pointer to handler array element
+     ngx_http_core_main_conf_t  *cmcf; // Pointer to main HTTP config
+     ngx_http_sleep_main_conf_t *smcf; // Pointer to our main config
+     ngx_uint_t                  i;
+
+     static ngx_http_handler_pt  handlers[] = {
+         ngx_http_sleep_preaccess_handler,
+         ngx_http_sleep_access_handler,
+         ngx_http_sleep_precontent_handler
+     };
+
+     /* Get the main HTTP configuration */
+     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module); // Get main conf
+     smcf = ngx_http_conf_get_module_main_conf(cf, ngx_steadybit_sleep_module);
+
+     /*
+      * Register our handler only in the phases some location sleeps in, so
+      * servers without experiments do not call it at all.
+      */
+     for (i = 0; ngx_http_sleep_phases[i].name.len; i++) {
+         if (!(smcf->phases & ((ngx_uint_t) 1 << ngx_http_sleep_phases[i].value))) {
+             continue;
+         }
+
+         h = ngx_array_push(&cmcf->phases[ngx_http_sleep_phases[i].value].handlers);
+         if (h == NULL) {
+             return NGX_ERROR; // Error if push fails
+         }
+
+         *h = handlers[i]; // Set our handler function
+     }
+
+     /*
+      * Install the filters for filter sleeps, throttling and body pauses
+      * only if some location uses them, for the same reason
+      */
+     if (smcf->filters & NGX_HTTP_SLEEP_FILTER_HEADER) {
+         ngx_http_next_header_filter = ngx_http_top_header_filter;
+         ngx_http_top_header_filter = ngx_http_sleep_header_filter;
+     }
+
+     if (smcf->filters & NGX_HTTP_SLEEP_FILTER_BODY) {
+         ngx_http_next_body_filter = ngx_http_top_body_filter;
+         ngx_http_top_body_filter = ngx_http_sleep_body_filter;
+     }
+
+     if (smcf->filters & NGX_HTTP_SLEEP_FILTER_REQUEST_BODY) {
+         ngx_http_next_request_body_filter = ngx_http_top_request_body_filter;
+         ngx_http_top_request_body_filter = ngx_http_sleep_request_body_filter;
+     }
+
+     ngx_http_sleep_injected_hash = ngx_hash_key((u_char *) "x-sb-injected-delay",
+                                                 sizeof("x-sb-injected-delay") - 1);
+     ngx_http_sleep_tracestate_hash = ngx_hash_key((u_char *) "tracestate",
+                                                   sizeof("tracestate") - 1);
+
+     return NGX_OK; // Success
+ }
+
+ /**
+  * Worker Process Initialization
+  *
+  * Preallocates the sleep contexts of this worker in one block and links
+  * them into the free list, so sleeping requests don't touch their pools.
+  */
+ static ngx_int_t
+ ngx_http_sleep_init_process(ngx_cycle_t *cycle)
+ {
+     ngx_http_sleep_main_conf_t  *smcf;
+     ngx_http_sleep_ctx_t        *ctxs;
+     ngx_int_t                    i;
+     ngx_uint_t                   level, slot;
+
+     ngx_queue_init(&ngx_http_sleep_free_ctxs); // Start with an empty free list
+
+     /* Give every worker its own random sequence */
+     ngx_http_sleep_rand_state ^= ((uint64_t) ngx_pid << 32) ^ (uint64_t) ngx_time()
+                                  ^ (uint64_t) ngx_random();
+     if (ngx_http_sleep_rand_state == 0) {
+         ngx_http_sleep_rand_state = 0x9e3779b97f4a7c15ULL; // xorshift must not be seeded with 0
+     }
+
+     /* Prepare the timing wheel; its timer is only armed while it holds sleepers */
+     for (level = 0; level < NGX_HTTP_SLEEP_WHEEL_LEVELS; level++) {
+         for (slot = 0; slot < NGX_HTTP_SLEEP_WHEEL_SLOTS; slot++) {
+             ngx_queue_init(&ngx_http_sleep_wheel.slots[level][slot]);
+         }
+     }
+
+     ngx_http_sleep_precise.event.handler = ngx_http_sleep_precise_handler;
+     ngx_http_sleep_precise.event.log = cycle->log;
+
+     ngx_http_sleep_wheel.event.handler = ngx_http_sleep_wheel_handler;
+     ngx_http_sleep_wheel.event.data = &ngx_http_sleep_wheel;
+     ngx_http_sleep_wheel.event.log = cycle->log;
+
+     /* Prepare the wake-up queue used by sb_sleep_batch */
+     ngx_queue_init(&ngx_http_sleep_ready);
+
+     ngx_http_sleep_batch_event.handler = ngx_http_sleep_batch_handler;
+     ngx_http_sleep_batch_event.log = cycle->log;
+
+     if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) {
+         return NGX_OK; // Cache manager and helpers never handle requests
+     }
+
+     smcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_steadybit_sleep_module);
+
+     /* Pick this worker's statistics slot */
+     if (smcf && smcf->stats_zone) {
+         ngx_http_sleep_stats = (ngx_http_sleep_stats_t *)
+             ((u_char *) smcf->stats_zone->data
+              + (ngx_worker % NGX_HTTP_SLEEP_STATS_SLOTS) * NGX_HTTP_SLEEP_STATS_STRIDE);
+     }
+
+     if (smcf && smcf->precise && ngx_http_sleep_precise_init(cycle) != NGX_OK) {
+         return NGX_ERROR;
+     }
+
+     if (smcf == NULL || smcf->ctx_pool_size == 0) {
+         return NGX_OK; // No http block or pool disabled
+     }
+
+     ctxs = ngx_calloc(smcf->ctx_pool_size * sizeof(ngx_http_sleep_ctx_t),
+                       cycle->log);
+     if (ctxs == NULL) {
+         return NGX_ERROR;
+     }
+
+     for (i = 0; i < smcf->ctx_pool_size; i++) {
+         ctxs[i].pooled = 1; // Return to the free list on cleanup
+         ngx_queue_insert_tail(&ngx_http_sleep_free_ctxs, &ctxs[i].queue);
+     }
+
+     return NGX_OK;
+ }
+
+ /**
+  * Worker Process Exit
+  *
+  * Closes the timerfd of the precise scheduler, which nginx would
+  * otherwise report as a socket left open.
+  */
+ static void
+ ngx_http_sleep_exit_process(ngx_cycle_t *cycle)
+ {
+     if (ngx_http_sleep_precise.conn) {
+         ngx_close_connection(ngx_http_sleep_precise.conn);
+         ngx_http_sleep_precise.conn = NULL;
+     }
+ }
+
+ /**
+  * Initialize Precise Scheduler
+  *
+  * Creates the worker's timerfd and adds it to the event loop. If the
+  * system has no timerfd, precise sleeps use nginx timers instead.
+  */
+ static ngx_int_t
+ ngx_http_sleep_precise_init(ngx_cycle_t *cycle)
+ {
+ #if (NGX_LINUX)
+     ngx_http_sleep_precise_t  *p = &ngx_http_sleep_precise;
+     ngx_connection_t          *c;
+     int                        fd;
+
+     fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+     if (fd == -1) {
+         ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                       "timerfd_create() failed, precise sleeps use nginx timers");
+         return NGX_OK;
+     }
+
+     c = ngx_get_connection(fd, cycle->log);
+     if (c == NULL) {
+         (void) close(fd);
+         return NGX_ERROR;
+     }
+
+     c->read->handler = ngx_http_sleep_precise_handler;
+     c->read->log = cycle->log;
+
+     if (ngx_add_event(c->read, NGX_READ_EVENT,
+                       (ngx_event_flags & NGX_USE_CLEAR_EVENT) ? NGX_CLEAR_EVENT : NGX_LEVEL_EVENT)
+         != NGX_OK)
+     {
+         ngx_close_connection(c);
+         return NGX_ERROR;
+     }
+
+     p->conn = c;
+ #endif
+
+     return NGX_OK;
+ }
+
+ /**
+  * Monotonic Time in Microseconds
+  *
+  * Reads the clock directly; nginx's cached time only has milliseconds.
+  */
+ static uint64_t
+ ngx_http_sleep_precise_now(void)
+ {
+     struct timespec  ts;
+
+     (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+     return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+ }
+
+ /**
+  * Precise Scheduler Insert
+  *
+  * Adds a sleeper to the heap and rearms the timerfd if it is the earliest.
+  * Returns NGX_DECLINED without a timerfd, and NGX_ERROR if the heap cannot
+  * grow; the caller then uses an nginx timer.
+  */
+ static ngx_int_t
+ ngx_http_sleep_precise_insert(ngx_http_sleep_ctx_t *ctx, uint64_t delay)
+ {
+     ngx_http_sleep_precise_t   *p = &ngx_http_sleep_precise;
+     ngx_http_sleep_ctx_t      **heap;
+     ngx_uint_t                  n;
+
+     if (p->conn == NULL) {
+         return NGX_DECLINED;
+     }
+
+     if (p->nelts == p->nalloc) {
+         n = p->nalloc ? p->nalloc * 2 : NGX_HTTP_SLEEP_PRECISE_HEAP;
+
+         heap = ngx_alloc(n * sizeof(ngx_http_sleep_ctx_t *), ctx->sleep_event.log);
+         if (heap == NULL) {
+             return NGX_ERROR;
+         }
+
+         if (p->heap) {
+             ngx_memcpy(heap, p->heap, p->nelts * sizeof(ngx_http_sleep_ctx_t *));
+             ngx_free(p->heap);
+         }
+
+         p->heap = heap;
+         p->nalloc = n;
+     }
+
+     ctx->wake_us = ngx_http_sleep_precise_now() + delay;
+     ctx->in_heap = 1;
+
+     ngx_http_sleep_precise_place(p->nelts++, ctx);
+
+     if (ctx->heap_index == 0) {
+         ngx_http_sleep_precise_arm();
+     }
+
+     return NGX_OK;
+ }
+
+ /**
+  * Precise Scheduler Remove
+  *
+  * Takes a sleeper out of the heap. The timerfd stays armed; if it was
+  * set for this sleeper, it fires early, finds nothing due and rearms.
+  */
+ static void
+ ngx_http_sleep_precise_remove(ngx_http_sleep_ctx_t *ctx)
+ {
+     ngx_http_sleep_precise_t  *p = &ngx_http_sleep_precise;
+     ngx_http_sleep_ctx_t      *last;
+
+     ctx->in_heap = 0;
+     last = p->heap[--p->nelts];
+
+     if (ctx->heap_index < p->nelts) {
+         ngx_http_sleep_precise_place(ctx->heap_index, last); // Fill the gap with the last one
+     }
+ }
+
+ /**
+  * Precise Scheduler Place
+  *
+  * Puts a context into the heap at position i, or wherever it moves to
+  * from there, up or down, to restore the heap order.
+  */
+ static void
+ ngx_http_sleep_precise_place(ngx_uint_t i, ngx_http_sleep_ctx_t *ctx)
+ {
+     ngx_http_sleep_ctx_t  **heap = ngx_http_sleep_precise.heap;
+     ngx_uint_t              n = ngx_http_sleep_precise.nelts;
+     ngx_uint_t              parent, child;
+
+     while (i > 0) {
+         parent = (i - 1) / 2;
+         if (heap[parent]->wake_us <= ctx->wake_us) {
+             break;
+         }
+
+         heap[i] = heap[parent];
+         heap[i]->heap_index = i;
+         i = parent;
+     }
+
+     for ( ;; ) {
+         child = 2 * i + 1;
+         if (child >= n) {
+             break;
+         }
+
+         if (child + 1 < n && heap[child + 1]->wake_us < heap[child]->wake_us) {
+             child++;
+         }
+
+         if (ctx->wake_us <= heap[child]->wake_us) {
+             break;
+         }
+
+         heap[i] = heap[child];
+         heap[i]->heap_index = i;
+         i = child;
+     }
+
+     heap[i] = ctx;
+     ctx->heap_index = i;
+ }
+
+ /**
+  * Arm Precise Scheduler
+  *
+  * Sets the timerfd to the wake time of the earliest sleeper, as an absolute
+  * time so the setup itself adds no drift, and the backup nginx timer to a
+  * millisecond after it.
+  */
+ static void
+ ngx_http_sleep_precise_arm(void)
+ {
+     ngx_http_sleep_precise_t  *p = &ngx_http_sleep_precise;
+ #if (NGX_LINUX)
+     struct itimerspec          its;
+ #endif
+     uint64_t                   wake, now;
+
+     if (p->nelts == 0) {
+         if (p->event.timer_set) {
+             ngx_del_timer(&p->event);
+         }
+
+         return; // Nothing is sleeping, a pending expiration finds nothing due
+     }
+
+     wake = p->heap[0]->wake_us;
+
+ #if (NGX_LINUX)
+     if (wake != p->armed) {
+         ngx_memzero(&its, sizeof(struct itimerspec));
+         its.it_value.tv_sec = (time_t) (wake / 1000000);
+         its.it_value.tv_nsec = (long) (wake % 1000000) * 1000;
+
+         if (timerfd_settime(p->conn->fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+             ngx_log_error(NGX_LOG_ALERT, p->conn->log, ngx_errno,
+                           "timerfd_settime() failed");
+         }
+
+         p->armed = wake;
+     }
+ #endif
+
+     now = ngx_http_sleep_precise_now();
+
+     ngx_add_timer(&p->event, wake > now ? (ngx_msec_t) ((wake - now) / 1000) + 1 : 1);
+ }
+
+ /**
+  * Precise Scheduler Handler
+  *
+  * Runs when the timerfd expires, or the backup timer if it did not. Updates
+  * nginx's cached time, so woken requests see the wake-up time, and posts the
+  * wake-up events of all sleepers that are due, like the timing wheel does.
+  */
+ static void
+ ngx_http_sleep_precise_handler(ngx_event_t *ev)
+ {
+     ngx_http_sleep_precise_t  *p = &ngx_http_sleep_precise;
+     ngx_http_sleep_ctx_t      *ctx;
+     uint64_t                   expirations, now;
+     ssize_t                    n;
+     ngx_err_t                  err;
+
+     if (p->conn && ev == p->conn->read) {
+         /* Clear the expiration; EAGAIN if the backup timer came first */
+         n = read(p->conn->fd, &expirations, sizeof(uint64_t));
+
+         err = ngx_errno;
+
+         if ((size_t) n != sizeof(uint64_t) && err != NGX_EAGAIN) {
+             ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                           "read() timerfd %d failed", p->conn->fd);
+         }
+
+         p->armed = 0;
+     }
+
+     ngx_time_update();
+     now = ngx_http_sleep_precise_now();
+
+     while (p->nelts && p->heap[0]->wake_us <= now) {
+         ctx = p->heap[0];
+         ngx_http_sleep_precise_remove(ctx);
+
+         ngx_post_event(&ctx->sleep_event, &ngx_posted_events); // Wake from the event loop
+     }
+
+     ngx_http_sleep_precise_arm();
+ }
+
+ /**
+  * Allocate Sleep Context
+  *
+  * Takes a context from the per-worker free list and links its embedded
+  * cleanup entry into the request pool. Falls back to the request pool
+  * when the free list is exhausted or disabled.
+  */
+ static ngx_http_sleep_ctx_t *
+ ngx_http_sleep_ctx_alloc(ngx_http_request_t *r)
+ {
+     ngx_http_sleep_ctx_t  *ctx;
+     ngx_pool_cleanup_t    *cln;
+     ngx_queue_t           *q;
+
+     if (!ngx_queue_empty(&ngx_http_sleep_free_ctxs)) {
+         q = ngx_queue_head(&ngx_http_sleep_free_ctxs); // Take the most recently freed context
+         ngx_queue_remove(q);
+
+         ctx = ngx_queue_data(q, ngx_http_sleep_ctx_t, queue);
+         ngx_memzero(&ctx->sleep_event, sizeof(ngx_event_t)); // Reset previous timer state
+         ctx->waiting = 0;
+         ctx->cleaned_up = 0;
+         ctx->in_wheel = 0;
+         ctx->ready = 0;
+         ctx->throttle = NULL;
+         ctx->rbody = NULL;
+         ctx->at = NGX_HTTP_SLEEP_AT_ACCESS;
+         ctx->concurrent = NULL;
+         ctx->conn = NULL;
+         ctx->following = 0;
+         ctx->fault = 0;
+         ctx->slept = 0;
+         ctx->budgeted = 0;
+
+         /* Link the embedded cleanup entry instead of allocating one */
+         cln = &ctx->cln;
+         cln->next = r->pool->cleanup;
+         r->pool->cleanup = cln;
+
+     } else {
+         ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_sleep_ctx_t)); // Allocate context
+         if (ctx == NULL) {
+             return NULL;
+         }
+
+         cln = ngx_pool_cleanup_add(r->pool, 0); // Add cleanup handler
+         if (cln == NULL) {
+             return NULL;
+         }
+     }
+
+     cln->handler = ngx_http_sleep_cleanup_handler; // Set cleanup function
+     cln->data = ctx; // Pass context to cleanup
+
+     ctx->request = r; // Store request pointer
+
+     return ctx;
+ }
+
+ /**
+  * Get Request Context
+  *
+  * Returns the sleep context of the request. Internal redirects clear the
+  * contexts of all modules, so for redirected requests the context of an
+  * earlier sleep is found through its cleanup entry in the request pool and
+  * set again, the way the realip module keeps its state across redirects.
+  */
+ static ngx_http_sleep_ctx_t *
+ ngx_http_sleep_get_ctx(ngx_http_request_t *r)
+ {
+     ngx_http_sleep_ctx_t  *ctx;
+     ngx_pool_cleanup_t    *cln;
+
+     ctx = ngx_http_get_module_ctx(r, ngx_steadybit_sleep_module);
+
+     if (ctx != NULL || !r->internal) {
+         return ctx;
+     }
+
+     for (cln = r->pool->cleanup; cln; cln = cln->next) {
+         if (cln->handler == ngx_http_sleep_cleanup_handler) {
+             ctx = cln->data;
+
+             if (ctx->request == r) {
+                 ngx_http_set_ctx(r, ctx, ngx_steadybit_sleep_module);
+                 return ctx;
+             }
+         }
+     }
+
+     return NULL;
+ }
+
+ /**
+  * Attach Sleep Context
+  *
+  * Turns a context created without a sleep, for a request body pause or the
+  * throttle, into a sleep context by registering the cleanup handler, so the
+  * state it already holds is kept instead of being replaced.
+  */
+ static ngx_int_t
+ ngx_http_sleep_ctx_attach(ngx_http_request_t *r, ngx_http_sleep_ctx_t *ctx)
+ {
+     ngx_pool_cleanup_t  *cln;
+
+     cln = ngx_pool_cleanup_add(r->pool, 0);
+     if (cln == NULL) {
+         return NGX_ERROR;
+     }
+
+     cln->handler = ngx_http_sleep_cleanup_handler;
+     cln->data = ctx;
+
+     ctx->request = r;
+
+     return NGX_OK;
+ }
+
+ /**
+  * Get Connection Sleep State
+  *
+  * Finds the sleep state of the request's client connection, or creates it
+  * on the first request. HTTP/2 and HTTP/3 streams use the state of the
+  * connection that carries them. The state is found through the marker
+  * cleanup entry in the connection pool, which lives as long as the
+  * connection and needs no lookup structure of its own.
+  */
+ static ngx_http_sleep_conn_t *
+ ngx_http_sleep_conn_get(ngx_http_request_t *r)
+ {
+     ngx_connection_t       *c;
+     ngx_pool_cleanup_t     *cln;
+     ngx_http_sleep_conn_t  *conn;
+
+     c = r->connection;
+
+ #if (NGX_HTTP_V2)
+     if (r->stream) {
+         c = r->stream->connection->connection;
+     }
+ #endif
+
+ #if (NGX_HTTP_V3)
+     if (c->quic) {
+         c = c->quic->parent;
+     }
+ #endif
+
+     for (cln = c->pool->cleanup; cln; cln = cln->next) {
+         if (cln->handler == ngx_http_sleep_conn_cleanup) {
+             return cln->data;
+         }
+     }
+
+     cln = ngx_pool_cleanup_add(c->pool, sizeof(ngx_http_sleep_conn_t));
+     if (cln == NULL) {
+         return NULL;
+     }
+
+     conn = cln->data;
+     conn->decided = 0;
+     conn->delay = 0;
+     conn->leader = NULL;
+     ngx_queue_init(&conn->followers);
+
+     cln->handler = ngx_http_sleep_conn_cleanup;
+
+     return conn;
+ }
+
+ /**
+  * Connection Cleanup Handler
+  *
+  * Marks the connection sleep state in the connection pool. All requests,
+  * and with them their contexts, are freed before the connection.
+  */
+ static void
+ ngx_http_sleep_conn_cleanup(void *data)
+ {
+     ngx_http_sleep_conn_t  *conn = data;
+
+     conn->leader = NULL;
+ }
+
+ /**
+  * Schedule Sleep
+  *
+  * Starts the sleep of a context with the scheduler selected for its
+  * location. Either way, ngx_http_sleep_wake_handler runs once the delay
+  * has elapsed. Only the precise scheduler keeps microseconds; the others
+  * round the delay up, so no request wakes up early.
+  */
+ static void
+ ngx_http_sleep_schedule(ngx_http_sleep_ctx_t *ctx, uint64_t delay_us)
+ {
+     ngx_http_sleep_wheel_t  *wheel = &ngx_http_sleep_wheel;
+     ngx_uint_t               level;
+     ngx_msec_t               delay;
+
+     delay = (ngx_msec_t) ((delay_us + 999) / 1000);
+
+     ctx->start_time = ngx_current_msec;
+     ctx->wake_time = ngx_current_msec + delay;
+     ctx->wake_us = 0; // Set by the precise scheduler only
+
+     /* Without a timerfd, precise sleeps fall back to nginx timers */
+     if (ctx->scheduler == NGX_HTTP_SLEEP_SCHED_PRECISE
+         && ngx_http_sleep_precise_insert(ctx, delay_us) == NGX_OK)
+     {
+         return;
+     }
+
+     if (ctx->scheduler != NGX_HTTP_SLEEP_SCHED_WHEEL) {
+         ngx_add_timer(&ctx->sleep_event, delay); // Set timer
+         return;
+     }
+
+     /* An empty wheel can be rebased to the current time */
+     for (level = 0; level < NGX_HTTP_SLEEP_WHEEL_LEVELS; level++) {
+         if (wheel->counts[level]) {
+             break;
+         }
+     }
+
+     if (level == NGX_HTTP_SLEEP_WHEEL_LEVELS) {
+         wheel->now = ngx_current_msec;
+     }
+
+     ctx->wake_time = ngx_current_msec + ngx_min(delay, NGX_HTTP_SLEEP_WHEEL_MAX);
+     ngx_http_sleep_wheel_insert(ctx);
+
+     /* Fire earlier if this sleep ends before the wheel's next tick */
+     if (wheel->event.timer_set
+         && (ngx_msec_int_t) (ctx->wake_time - wheel->event.timer.key) < 0)
+     {
+         ngx_del_timer(&wheel->event);
+     }
+
+     if (!wheel->event.timer_set) {
+         ngx_http_sleep_wheel_arm();
+     }
+ }
+
+ /**
+  * Cancel Sleep
+  *
+  * Removes a pending sleep from whichever scheduler holds it, including a
+  * wake-up that has already been posted but not yet run.
+  */
+ static void
+ ngx_http_sleep_cancel(ngx_http_sleep_ctx_t *ctx)
+ {
+     /* If the timer is still set, cancel it */
+     if (ctx->sleep_event.timer_set) {
+         ngx_del_timer(&ctx->sleep_event); // Remove timer
+     }
+
+     if (ctx->sleep_event.posted) {
+         ngx_delete_posted_event(&ctx->sleep_event); // Drop a pending wake-up
+     }
+
+     if (ctx->in_heap) {
+         ngx_http_sleep_precise_remove(ctx); // Take out of the precise scheduler
+     }
+
+     if (ctx->in_wheel) {
+         ngx_queue_remove(&ctx->queue); // Unlink from its wheel slot
+         ngx_http_sleep_wheel.counts[ctx->wheel_level]--;
+         ctx->in_wheel = 0;
+     }
+
+     if (ctx->ready) {
+         ngx_queue_remove(&ctx->queue); // Unlink from the wake-up queue
+         ctx->ready = 0;
+     }
+
+     if (ctx->following) {
+         ngx_queue_remove(&ctx->queue); // Stop waiting for the connection's timer
+         ctx->following = 0;
+     }
+ }
+
+ /**
+  * Insert Into Timing Wheel
+  *
+  * Links a context into the slot matching its wake time: level 0 if it is
+  * due within 64 ms, otherwise the lowest level whose span covers it.
+  */
+ static void
+ ngx_http_sleep_wheel_insert(ngx_http_sleep_ctx_t *ctx)
+ {
+     ngx_http_sleep_wheel_t  *wheel = &ngx_http_sleep_wheel;
+     ngx_msec_t               expire, delta;
+     ngx_uint_t               level, shift;
+
+     expire = ctx->wake_time;
+
+     /* Already due: put it into the slot processed next */
+     if ((ngx_msec_int_t) (expire - wheel->now) < 0) {
+         expire = wheel->now;
+     }
+
+     delta = expire - wheel->now;
+
+     for (level = 0; level < NGX_HTTP_SLEEP_WHEEL_LEVELS - 1; level++) {
+         if (delta < ((ngx_msec_t) 1 << (NGX_HTTP_SLEEP_WHEEL_BITS * (level + 1)))) {
+             break;
+         }
+     }
+
+     shift = NGX_HTTP_SLEEP_WHEEL_BITS * level;
+
+     ngx_queue_insert_tail(&wheel->slots[level][(expire >> shift) & NGX_HTTP_SLEEP_WHEEL_MASK],
+                           &ctx->queue);
+     wheel->counts[level]++;
+     ctx->wheel_level = level;
+     ctx->in_wheel = 1;
+ }
+
+ /**
+  * Arm Timing Wheel Timer
+  *
+  * Sets the wheel's nginx timer to the next occupied level 0 slot, or to the
+  * point where level 0 wraps and the next level has to be cascaded.
+  */
+ static void
+ ngx_http_sleep_wheel_arm(void)
+ {
+     ngx_http_sleep_wheel_t  *wheel = &ngx_http_sleep_wheel;
+     ngx_msec_t               next, wrap, fire;
+     ngx_uint_t               level, slot;
+
+     for (level = 0; level < NGX_HTTP_SLEEP_WHEEL_LEVELS; level++) {
+         if (wheel->counts[level]) {
+             break;
+         }
+     }
+
+     if (level == NGX_HTTP_SLEEP_WHEEL_LEVELS) {
+         return; // Nothing is sleeping, no timer needed
+     }
+
+     /*
+      * The wheel's current millisecond has not been processed yet, so when it
+      * starts a new span the cascade is due right away.
+      */
+     slot = wheel->now & NGX_HTTP_SLEEP_WHEEL_MASK;
+     wrap = (NGX_HTTP_SLEEP_WHEEL_SLOTS - slot) & NGX_HTTP_SLEEP_WHEEL_MASK;
+
+     next = wrap;
+
+     if (wheel->counts[0]) {
+         for (next = 0; next < wrap; next++) {
+             if (!ngx_queue_empty(&wheel->slots[0][slot + next])) {
+                 break;
+             }
+         }
+     }
+
+     fire = wheel->now + next;
+
+     ngx_add_timer(&wheel->event, (ngx_msec_int_t) (fire - ngx_current_msec) > 0
+                                  ? fire - ngx_current_msec : 0);
+ }
+
+ /**
+  * Timing Wheel Handler
+  *
+  * Advances the wheel up to the current time. Whenever a level wraps, the
+  * matching slot of the level above is cascaded down. Expired contexts get
+  * their wake-up events posted, so requests resume from the event loop
+  * just like with nginx timers.
+  */
+ static void
+ ngx_http_sleep_wheel_handler(ngx_event_t *ev)
+ {
+     ngx_http_sleep_wheel_t  *wheel = ev->data;
+     ngx_http_sleep_ctx_t    *ctx;
+     ngx_queue_t              cascade, *q, *slot;
+     ngx_uint_t               level, index;
+     ngx_msec_t               next;
+
+     while ((ngx_msec_int_t) (ngx_current_msec - wheel->now) >= 0) {
+
+         /* Cascade higher levels whose span begins at this millisecond */
+         for (level = 1; level < NGX_HTTP_SLEEP_WHEEL_LEVELS; level++) {
+             if (wheel->now & (((ngx_msec_t) 1 << (NGX_HTTP_SLEEP_WHEEL_BITS * level)) - 1)) {
+                 break;
+             }
+
+             index = (wheel->now >> (NGX_HTTP_SLEEP_WHEEL_BITS * level))
+                     & NGX_HTTP_SLEEP_WHEEL_MASK;
+             slot = &wheel->slots[level][index];
+
+             if (ngx_queue_empty(slot)) {
+                 continue;
+             }
+
+             /* Detach the slot before reinserting, entries may land in it again */
+             ngx_queue_init(&cascade);
+             ngx_queue_add(&cascade, slot);
+             ngx_queue_init(slot);
+
+             while (!ngx_queue_empty(&cascade)) {
+                 q = ngx_queue_head(&cascade);
+                 ngx_queue_remove(q);
+
+                 ctx = ngx_queue_data(q, ngx_http_sleep_ctx_t, queue);
+                 wheel->counts[level]--;
+                 ngx_http_sleep_wheel_insert(ctx);
+             }
+         }
+
+         if (wheel->counts[0] == 0) {
+             /*
+              * Nothing due at level 0: skip ahead to the next wrap, but not past
+              * the current time, so that later inserts still land in order.
+              */
+             next = (wheel->now | NGX_HTTP_SLEEP_WHEEL_MASK) + 1;
+             wheel->now = ((ngx_msec_int_t) (next - ngx_current_msec) > 0)
+                          ? ngx_current_msec + 1 : next;
+             continue;
+         }
+
+         slot = &wheel->slots[0][wheel->now & NGX_HTTP_SLEEP_WHEEL_MASK];
+
+         while (!ngx_queue_empty(slot)) {
+             q = ngx_queue_head(slot);
+             ngx_queue_remove(q);
+
+             ctx = ngx_queue_data(q, ngx_http_sleep_ctx_t, queue);
+             wheel->counts[0]--;
+             ctx->in_wheel = 0;
+
+             ngx_post_event(&ctx->sleep_event, &ngx_posted_events); // Wake from the event loop
+         }
+
+         wheel->now++;
+     }
+
+     ngx_http_sleep_wheel_arm();
+ }
+
+ /**
+  * Compute Delay
+  *
+  * Determines the delay of a request from the runtime rules of the shared
+  * zone, or else from the location's configuration, including the random
+  * jitter of sb_sleep_batch. With select set, sampling by percentage first
+  * decides whether the request is delayed at all. The delay is returned in
+  * microseconds. Returns NGX_DECLINED if there is nothing to sleep.
+  */
+ static ngx_int_t
+ ngx_http_sleep_delay(ngx_http_request_t *r, ngx_http_sleep_loc_conf_t *slcf,
+     ngx_uint_t select, uint64_t *delay)
+ {
+     ngx_http_sleep_main_conf_t *smcf; // Pointer to main config
+     ngx_str_t                   val; // Holds evaluated sleep_ms value
+     ngx_int_t                   sleep_time; // Sleep duration in ms, or us for sb_sleep_us
+     ngx_uint_t                  scale; // Microseconds per unit of sleep_time
+     ngx_msec_t                  matched; // Delay of a matched request rule
+     ngx_http_sleep_rule_t       rule; // Runtime rule copied from the shared zone
+
+     smcf = ngx_http_get_module_main_conf(r, ngx_steadybit_sleep_module); // Get main config
+     scale = 1000;
+
+    /* Runtime rules from the shared zone take precedence over the configuration */
+    if (smcf->shm_zone != NULL
+        && ngx_http_sleep_zone_lookup(r, smcf, slcf, &rule) == NGX_OK)
+    {
+        if (select && rule.percent < 10000
+            && (uint32_t) (ngx_http_sleep_rand() >> 32)
+               >= (uint32_t) (((uint64_t) rule.percent << 32) / 10000))
+        {
+            return NGX_DECLINED; // Not selected, continue
+        }
+
+        sleep_time = (ngx_int_t) rule.delay;
+
+    } else if (slcf->window_end
+               && (ngx_time() < slcf->window_start || ngx_time() >= slcf->window_end))
+    {
+        return NGX_DECLINED; // Outside the experiment window, one cached time check
+
+    } else if (slcf->matchers != NULL
+               && ngx_http_sleep_match(r, slcf, &matched) == NGX_OK)
+    {
+        /* A request rule matched; it applies to every matching request */
+        sleep_time = (ngx_int_t) matched;
+
+    } else if (slcf->sleep_ms == NULL && slcf->dist == NULL && slcf->ramp == NULL) {
+        return NGX_DECLINED; // No rule and no configured sleep, continue
+
+    } else if (select && slcf->percent < 10000
+               && (uint32_t) (ngx_http_sleep_rand() >> 32) >= slcf->percent_threshold)
+    {
+        /* Only delay the configured share of requests, decided before any work */
+        return NGX_DECLINED; // Not selected, continue
+
+    } else if (slcf->ramp != NULL) {
+        /* Follow the ramp from the cached clock */
+        sleep_time = (ngx_int_t) ngx_http_sleep_ramp_value(slcf->ramp,
+                                                           ngx_current_msec - slcf->ramp_start);
+
+    } else if (slcf->dist != NULL) {
+        /* Sample the distribution: one lookup at a random quantile */
+        sleep_time = slcf->dist->table[ngx_http_sleep_rand()
+                                       >> (64 - NGX_HTTP_SLEEP_DIST_BITS)];
+
+    } else if (slcf->sleep_ms->value != NGX_CONF_UNSET) {
+        /* Fast path: constant value was parsed at configuration time */
+        sleep_time = slcf->sleep_ms->value;
+        scale = slcf->sleep_ms->us ? 1 : 1000;
+
+    } else {
+        scale = slcf->sleep_ms->us ? 1 : 1000;
+
+        /* Evaluate the complex value to get the actual sleep duration */
+        if (ngx_http_complex_value(r, &slcf->sleep_ms->cv, &val) != NGX_OK) {
+            return NGX_ERROR; // Error if evaluation fails
+        }
+
+        /* If the evaluated value is empty, no sleep needed */
+        if (val.len == 0) {
+            return NGX_DECLINED; // No value, continue
+        }
+
+        /* Convert the string value to integer (milliseconds) */
+        sleep_time = ngx_atoi(val.data, val.len); // Convert to int
+        if (sleep_time == NGX_ERROR || sleep_time < 0) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "invalid %s value \"%V\"",
+                          slcf->sleep_ms->us ? "sb_sleep_us" : "sb_sleep_ms", &val); // Log error
+            return NGX_DECLINED; // Invalid value, continue
+        }
+    }
+
+    /* If sleep time is 0, no need to sleep */
+    if (sleep_time == 0) {
+        return NGX_DECLINED; // No sleep, continue
+    }
+
+    *delay = (uint64_t) sleep_time * scale;
+
+    /* Spread out wake-ups of requests with equal delays */
+    if (slcf->batch_spread) {
+        *delay += (ngx_http_sleep_rand() % (slcf->batch_spread + 1)) * 1000;
+    }
+
+    return NGX_OK;
+ }
+
+ /**
+  * Start Sleep
+  *
+  * Logs the sleep and hands the context to the scheduler of the location;
+  * ngx_http_sleep_wake_handler runs once the delay has elapsed.
+  */
+ static void
+ ngx_http_sleep_start(ngx_http_request_t *r, ngx_http_sleep_loc_conf_t *slcf,
+     ngx_http_sleep_ctx_t *ctx, uint64_t delay)
+ {
+    ngx_msec_t  ms;
+    ngx_uint_t  us;
+
+    /* Resolve the logging mode once so wake and cleanup need no config lookup */
+    ctx->log_mode = slcf->log_mode;
+    if (ctx->log_mode == NGX_HTTP_SLEEP_LOG_SAMPLED) {
+        ctx->log_mode = (++ngx_http_sleep_log_counter % slcf->log_sample == 0)
+                        ? NGX_HTTP_SLEEP_LOG_NOTICE : NGX_HTTP_SLEEP_LOG_DEBUG;
+    }
+
+    /* Sub-millisecond parts only show up if there are any */
+    ms = (ngx_msec_t) (delay / 1000);
+    us = (ngx_uint_t) (delay % 1000);
+
+    if (ctx->log_mode == NGX_HTTP_SLEEP_LOG_NOTICE) {
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      us ? "sleeping (async) for %M.%03ui ms" : "sleeping (async) for %M ms",
+                      ms, us); // Log sleep
+
+    } else if (ctx->log_mode == NGX_HTTP_SLEEP_LOG_DEBUG) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       us ? "sleeping (async) for %M.%03ui ms" : "sleeping (async) for %M ms",
+                       ms, us);
+    }
+
+    /* Initialize the timer event for asynchronous sleeping */
+    ngx_memzero(&ctx->sleep_event, sizeof(ngx_event_t)); // Zero event struct
+    ctx->sleep_event.handler = ngx_http_sleep_wake_handler; /* Callback when timer expires */
+    ctx->sleep_event.data = ctx;                            /* Pass context to callback */
+    ctx->sleep_event.log = r->connection->log;              /* Use request's log context */
+
+    /* Start the timer - this is non-blocking */
+    ctx->scheduler = slcf->scheduler;
+    ctx->batch_max = slcf->batch_max;
+
+    if (ctx->conn != NULL && ctx->conn->leader != NULL) {
+        /* Another stream sleeps already: wake up with it, without a timer */
+        ctx->start_time = ngx_current_msec;
+        ctx->wake_time = ctx->conn->leader->wake_time;
+        ctx->wake_us = ctx->conn->leader->wake_us;
+        ngx_queue_insert_tail(&ctx->conn->followers, &ctx->queue);
+        ctx->following = 1;
+
+    } else {
+        ngx_http_sleep_schedule(ctx, delay); // Set timer
+
+        if (ctx->conn != NULL) {
+            ctx->conn->leader = ctx; // Owns the connection's timer
+        }
+    }
+
+    ctx->waiting = 1; // Mark as sleeping
+    ctx->slept = 1;
+
+    if (ngx_http_sleep_stats) {
+        (void) ngx_atomic_fetch_add(&ngx_http_sleep_stats->active, 1);
+        (void) ngx_atomic_fetch_add(&ngx_http_sleep_stats->delayed, 1);
+    }
+ }
+
+ /**
+  * Phase Handlers
+  *
+  * Registered in the phases selected with sb_sleep_phase; each one tells
+  * the main handler which phase it runs in.
+  */
+ static ngx_int_t
+ ngx_http_sleep_preaccess_handler(ngx_http_request_t *r)
+ {
+     return ngx_http_sleep_handler(r, NGX_HTTP_PREACCESS_PHASE);
+ }
+
+ static ngx_int_t
+ ngx_http_sleep_access_handler(ngx_http_request_t *r)
+ {
+     return ngx_http_sleep_handler(r, NGX_HTTP_ACCESS_PHASE);
+ }
+
+ static ngx_int_t
+ ngx_http_sleep_precontent_handler(ngx_http_request_t *r)
+ {
+     return ngx_http_sleep_handler(r, NGX_HTTP_PRECONTENT_PHASE);
+ }
+
+ /**
+  * Main Request Handler
+  *
+  * This function is called for each HTTP request during the phase selected
+  * with sb_sleep_phase, ACCESS by default. It checks if sleep is configured,
+  * evaluates the sleep duration, and initiates asynchronous sleeping if needed.
+  */
+ static ngx_int_t
+ ngx_http_sleep_handler(ngx_http_request_t *r, ngx_uint_t phase)
+ {
+     ngx_http_sleep_loc_conf_t  *slcf; // Pointer to location config
+     ngx_http_sleep_main_conf_t *smcf; // Pointer to main config
+     ngx_http_sleep_ctx_t       *ctx; // Pointer to request context
+     uint64_t                    delay; // Sleep duration in microseconds
+     ngx_atomic_t               *counter; // Concurrency counter to release
+     ngx_http_sleep_conn_t      *conn; // Connection sleep state for connection scope
+     ngx_uint_t                  fault; // Fault to inject, 0 for none
+     ngx_int_t                   rc;
+
+     /* Get the location configuration for this request */
+     slcf = ngx_http_get_module_loc_conf(r, ngx_steadybit_sleep_module); // Get config
+     smcf = ngx_http_get_module_main_conf(r, ngx_steadybit_sleep_module); // Get main config
+
+     /* If no sleep is configured for this location, continue normally */
+     if (slcf->sleep_ms == NULL && slcf->dist == NULL && slcf->ramp == NULL
+         && slcf->matchers == NULL && smcf->shm_zone == NULL && slcf->faults == NULL)
+     {
+         return NGX_DECLINED; // No sleep, continue
+     }
+
+     /* Sleep in the configured phase only, and in subrequests only if asked to */
+     if (slcf->phase != phase
+         || (r != r->main && slcf->once == NGX_HTTP_SLEEP_ONCE_MAIN))
+     {
+         return NGX_DECLINED;
+     }
+
+    /* Check if we already have a context (prevent re-processing), also from before a redirect */
+    ctx = (slcf->once == NGX_HTTP_SLEEP_ONCE_MAIN)
+          ? ngx_http_sleep_get_ctx(r)
+          : ngx_http_get_module_ctx(r, ngx_steadybit_sleep_module); // Get context
+    if (ctx != NULL) {
+        return NGX_DECLINED; // Already processed, continue
+    }
+
+    /* Faults are decided in the same pass and fire after an access sleep, if any */
+    fault = (slcf->faults != NULL) ? ngx_http_sleep_fault_pick(slcf->faults) : 0;
+
+    /* Sleeps after the response has started are injected by the filters; faults don't wait for them */
+    if (slcf->at != NGX_HTTP_SLEEP_AT_ACCESS) {
+        return fault ? ngx_http_sleep_fault(r, fault) : NGX_DECLINED;
+    }
+
+    conn = NULL;
+
+    if (slcf->scope == NGX_HTTP_SLEEP_SCOPE_CONNECTION) {
+        conn = ngx_http_sleep_conn_get(r);
+        if (conn == NULL) {
+            return NGX_ERROR;
+        }
+
+        /* The first request decides for all requests of the connection */
+        if (!conn->decided) {
+            rc = ngx_http_sleep_delay(r, slcf, 1, &conn->delay);
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if (rc != NGX_OK) {
+                conn->delay = 0;
+            }
+
+            conn->decided = 1;
+        }
+
+        if (conn->delay == 0) {
+            /* Connection not selected, continue */
+            return fault ? ngx_http_sleep_fault(r, fault) : NGX_DECLINED;
+        }
+
+        delay = conn->delay;
+
+    } else {
+        rc = ngx_http_sleep_delay(r, slcf, 1, &delay);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc != NGX_OK) {
+            return fault ? ngx_http_sleep_fault(r, fault) : NGX_DECLINED;
+        }
+    }
+
+    /* Skip the delay or reject the request once too many requests sleep */
+    rc = ngx_http_sleep_acquire(r, slcf, &counter);
+    if (rc != NGX_OK) {
+        return (rc == NGX_DECLINED && fault) ? ngx_http_sleep_fault(r, fault) : rc;
+    }
+
+    /* Only delay as many requests as the budget allows */
+    if (slcf->budget != NULL
+        && ngx_http_sleep_budget_take(r, slcf->budget) != NGX_OK)
+    {
+        if (counter) {
+            (void) ngx_atomic_fetch_add(counter, -1);
+        }
+        return fault ? ngx_http_sleep_fault(r, fault) : NGX_DECLINED;
+    }
+
+    /* Get a request context for this sleep operation, with cleanup registered */
+    ctx = ngx_http_sleep_ctx_alloc(r); // Allocate context
+    if (ctx == NULL) {
+        if (counter) {
+            (void) ngx_atomic_fetch_add(counter, -1);
+        }
+        return NGX_ERROR; // Error if allocation fails
+    }
+    ngx_http_set_ctx(r, ctx, ngx_steadybit_sleep_module); // Set context for request
+
+    ctx->concurrent = counter; // Released when the sleep ends
+    ctx->conn = conn;
+    ctx->fault = fault; // Injected when the request wakes up
+
+    ngx_http_sleep_start(r, slcf, ctx, delay);
+
+    /*
+     * Watch the client while sleeping, as limit_req does for its delays: a
+     * closed connection finalizes the request at once and the pool cleanup
+     * cancels the timer. Write events must not run the phases early.
+     */
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    /* Increment request reference count to prevent cleanup during sleep */
+    r->main->count++; // Prevent premature cleanup
+
+    /* Return NGX_DONE to pause request processing until timer expires */
+    return NGX_DONE; // Pause processing
+ }
+
+ /**
+  * Header Filter
+  *
+  * Decides whether a request with a filter sleep point is delayed and, for
+  * "sb_sleep_at header", starts the sleep as soon as the response header
+  * is known. While a filter sleep is pending, c->write->delayed keeps the
+  * output queued in nginx's write filter, so nothing is buffered here.
+  * HTTP/2 sends its HEADERS frame without the write filter, so there a
+  * header sleep holds back only the body.
+  */
+ static ngx_int_t
+ ngx_http_sleep_header_filter(ngx_http_request_t *r)
+ {
+     ngx_http_sleep_loc_conf_t  *slcf;
+     ngx_http_sleep_main_conf_t *smcf;
+     ngx_http_sleep_ctx_t       *ctx;
+     uint64_t                    delay;
+     ngx_int_t                   rc;
+
+     slcf = ngx_http_get_module_loc_conf(r, ngx_steadybit_sleep_module);
+
+     if (slcf->at == NGX_HTTP_SLEEP_AT_ACCESS || r != r->main) {
+         /* Access sleeps are over by now */
+         if ((slcf->annotate & NGX_HTTP_SLEEP_ANNOTATE_RESPONSE) && r == r->main
+             && ngx_http_sleep_annotate_response(r) != NGX_OK)
+         {
+             return NGX_ERROR;
+         }
+
+         return ngx_http_next_header_filter(r);
+     }
+
+     smcf = ngx_http_get_module_main_conf(r, ngx_steadybit_sleep_module);
+
+     if (slcf->sleep_ms == NULL && slcf->dist == NULL && slcf->ramp == NULL
+         && slcf->matchers == NULL && smcf->shm_zone == NULL)
+     {
+         return ngx_http_next_header_filter(r);
+     }
+
+     /* A request that slept before an internal redirect sleeps no more */
+     if (slcf->once == NGX_HTTP_SLEEP_ONCE_MAIN) {
+         ctx = ngx_http_sleep_get_ctx(r);
+         if (ctx != NULL && ctx->slept) {
+             return ngx_http_next_header_filter(r);
+         }
+     }
+
+     rc = ngx_http_sleep_delay(r, slcf, 1, &delay);
+     if (rc == NGX_ERROR) {
+         return NGX_ERROR;
+     }
+
+     if (rc == NGX_DECLINED) {
+         return ngx_http_next_header_filter(r); // Not selected
+     }
+
+     ctx = ngx_http_get_module_ctx(r, ngx_steadybit_sleep_module);
+
+     if (ctx == NULL) {
+         ctx = ngx_http_sleep_ctx_alloc(r);
+         if (ctx == NULL) {
+             return NGX_ERROR;
+         }
+         ngx_http_set_ctx(r, ctx, ngx_steadybit_sleep_module);
+
+     } else if (ctx->request == NULL
+                && ngx_http_sleep_ctx_attach(r, ctx) != NGX_OK)
+     {
+         return NGX_ERROR; // Keep the request body pause of the existing context
+     }
+
+     ctx->at = slcf->at; // The body filter sleeps for the other points
+
+     if (slcf->at == NGX_HTTP_SLEEP_AT_HEADER
+         && ngx_http_sleep_filter_acquire(r, slcf, ctx) == NGX_OK)
+     {
+         ngx_http_sleep_start(r, slcf, ctx, delay);
+         r->connection->write->delayed = 1; // Hold the header back
+
+         if ((slcf->annotate & NGX_HTTP_SLEEP_ANNOTATE_RESPONSE)
+             && ngx_http_sleep_annotate_response(r) != NGX_OK)
+         {
+             return NGX_ERROR;
+         }
+     }
+
+     return ngx_http_next_header_filter(r);
+ }
+
+ /**
+  * Filter Sleep
+  *
+  * Called by the body filter for each output chain of a selected request:
+  * sleeps before every chain with data for "body_chunk", or before the
+  * chain ending the response for "last_buf". A chain arriving while a
+  * sleep is pending joins it.
+  */
+ static ngx_int_t
+ ngx_http_sleep_body_sleep(ngx_http_request_t *r, ngx_http_sleep_ctx_t *ctx,
+     ngx_chain_t *in)
+ {
+     ngx_http_sleep_loc_conf_t  *slcf;
+     ngx_chain_t                *cl;
+     uint64_t                    delay;
+     ngx_int_t                   rc;
+
+     if (ctx->waiting) {
+         return NGX_OK;
+     }
+
+     for (cl = in; cl; cl = cl->next) {
+         if (ctx->at == NGX_HTTP_SLEEP_AT_BODY_CHUNK
+             ? ngx_buf_size(cl->buf) != 0
+             : cl->buf->last_buf)
+         {
+             break;
+         }
+     }
+
+     if (cl == NULL) {
+         return NGX_OK; // Nothing to sleep before in this chain
+     }
+
+     slcf = ngx_http_get_module_loc_conf(r, ngx_steadybit_sleep_module);
+
+     rc = ngx_http_sleep_delay(r, slcf, 0, &delay);
+     if (rc != NGX_OK) {
+         return (rc == NGX_ERROR) ? NGX_ERROR : NGX_OK;
+     }
+
+     if (ngx_http_sleep_filter_acquire(r, slcf, ctx) != NGX_OK) {
+         return NGX_OK; // Too many sleeping requests or no budget, send the chain now
+     }
+
+     ngx_http_sleep_start(r, slcf, ctx, delay);
+     r->connection->write->delayed = 1; // Hold the chain back in the write filter
+
+     return NGX_OK;
+ }
+
+ /**
+  * Timer Wake-up Handler
+  *
+  * This function is called when the sleep timer expires. It resumes
+  * request processing right away, or queues the request for the batch
+  * handler if the location limits wake-ups per event loop iteration.
+  */
+ static void ngx_http_sleep_wake_handler(ngx_event_t *ev)
+ {
+     ngx_http_sleep_ctx_t *ctx = ev->data;      /* Get context from event data */
+
+     /* Add null checks for safety */
+     if (ctx == NULL || ctx->request == NULL) {
+         return;
+     }
+
+     if (ctx->conn != NULL) {
+         ngx_http_sleep_conn_wake(ctx); // Wake the connection's other streams too
+         return;
+     }
+
+     ngx_http_sleep_wake(ctx);
+ }
+
+ /**
+  * Wake Connection
+  *
+  * Wakes the leader of a connection sleep and every stream that waits for
+  * it. The followers are moved to a local list first: resuming one request
+  * may free others, whose cleanup then unlinks them from that list.
+  */
+ static void
+ ngx_http_sleep_conn_wake(ngx_http_sleep_ctx_t *leader)
+ {
+     ngx_http_sleep_ctx_t  *ctx;
+     ngx_queue_t           *q, woken;
+
+     ngx_queue_init(&woken);
+
+     if (!ngx_queue_empty(&leader->conn->followers)) {
+         ngx_queue_add(&woken, &leader->conn->followers);
+         ngx_queue_init(&leader->conn->followers);
+     }
+
+     leader->conn->leader = NULL; // Later requests start a new sleep
+
+     ngx_http_sleep_wake(leader);
+
+     while (!ngx_queue_empty(&woken)) {
+         q = ngx_queue_head(&woken);
+         ngx_queue_remove(q);
+
+         ctx = ngx_queue_data(q, ngx_http_sleep_ctx_t, queue);
+         ctx->following = 0;
+
+         ngx_http_sleep_wake(ctx);
+     }
+ }
+
+ /**
+  * Promote Follower
+  *
+  * Called when the leader of a connection sleep goes away early: the first
+  * follower takes over the timer for what is left of the sleep.
+  */
+ static void
+ ngx_http_sleep_conn_promote(ngx_http_sleep_conn_t *conn)
+ {
+     ngx_http_sleep_ctx_t  *ctx;
+     ngx_queue_t           *q;
+     ngx_msec_t             start;
+     ngx_msec_int_t         left;
+     uint64_t               delay, now;
+
+     conn->leader = NULL;
+
+     if (ngx_queue_empty(&conn->followers)) {
+         return;
+     }
+
+     q = ngx_queue_head(&conn->followers);
+     ngx_queue_remove(q);
+
+     ctx = ngx_queue_data(q, ngx_http_sleep_ctx_t, queue);
+     ctx->following = 0;
+
+     left = (ngx_msec_int_t) (ctx->wake_time - ngx_current_msec);
+     delay = left > 0 ? (uint64_t) left * 1000 : 0;
+
+     if (ctx->scheduler == NGX_HTTP_SLEEP_SCHED_PRECISE && ctx->wake_us) {
+         now = ngx_http_sleep_precise_now();
+         delay = ctx->wake_us > now ? ctx->wake_us - now : 0;
+     }
+
+     start = ctx->start_time;
+
+     ngx_http_sleep_schedule(ctx, delay);
+     ctx->start_time = start; // Keep the time it has slept already
+
+     conn->leader = ctx;
+ }
+
+ /**
+  * Wake Context
+  *
+  * Resumes a woken request right away, or queues it for the batch handler
+  * if the location limits wake-ups per event loop iteration.
+  */
+ static void
+ ngx_http_sleep_wake(ngx_http_sleep_ctx_t *ctx)
+ {
+     if (ctx->batch_max == 0) {
+         ngx_http_sleep_resume(ctx); // No batch limit, resume now
+         return;
+     }
+
+     ngx_queue_insert_tail(&ngx_http_sleep_ready, &ctx->queue);
+     ctx->ready = 1;
+
+     /* Resume queued requests once the current timers have been handled */
+     if (!ngx_http_sleep_batch_event.posted) {
+         ngx_post_event(&ngx_http_sleep_batch_event, &ngx_posted_events);
+     }
+ }
+
+ /**
+  * Batch Handler
+  *
+  * Resumes queued wake-ups in order, at most the batch limit of the queue
+  * head per event loop iteration. The remainder is left for the next
+  * iteration, so I/O of other connections is handled in between.
+  */
+ static void ngx_http_sleep_batch_handler(ngx_event_t *ev)
+ {
+     ngx_http_sleep_ctx_t  *ctx;
+     ngx_queue_t           *q;
+     ngx_uint_t             n;
+
+     for (n = 0; !ngx_queue_empty(&ngx_http_sleep_ready); n++) {
+         q = ngx_queue_head(&ngx_http_sleep_ready);
+         ctx = ngx_queue_data(q, ngx_http_sleep_ctx_t, queue);
+
+         if (n >= ctx->batch_max) {
+             ngx_post_event(ev, &ngx_posted_next_events); // Continue next iteration
+             return;
+         }
+
+         ngx_queue_remove(q);
+         ctx->ready = 0;
+
+         ngx_http_sleep_resume(ctx);
+     }
+ }
+
+ /**
+  * Resume Request
+  *
+  * Continues request processing after the sleep; the context stays attached
+  * to the request until the request pool is destroyed.
+  */
+ static void ngx_http_sleep_resume(ngx_http_sleep_ctx_t *ctx)
+ {
+     ngx_http_request_t *r = ctx->request;
+     ngx_connection_t   *c;
+     ngx_http_sleep_loc_conf_t *slcf;
+
+     if (ctx->log_mode == NGX_HTTP_SLEEP_LOG_NOTICE) {
+         ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                       "finished sleeping (async)"); // Log wake-up
+
+     } else if (ctx->log_mode == NGX_HTTP_SLEEP_LOG_DEBUG) {
+         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                        "finished sleeping (async)");
+     }
+
+     /* Timer has already fired, so no need to delete it */
+     ctx->waiting = 0; // No longer sleeping
+     ctx->end_time = ngx_current_msec;
+     c = r->connection; // Request may be freed by the phases below
+
+     if (ngx_http_sleep_stats) {
+         ngx_http_sleep_stats_done(ctx, 0);
      }
 
-     return NGX_CONF_OK; // Success
+     ngx_http_sleep_release(ctx);
+
+     if (ctx->at != NGX_HTTP_SLEEP_AT_ACCESS) {
+         /* Release the output of a filter sleep, unless the throttle holds it */
+         if (ctx->throttle == NULL || !ctx->throttle->event.timer_set) {
+             c->write->delayed = 0;
+         }
+
+         if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+             c->error = 1; // Let the write handler finalize the request
+         }
+
+         /* Let the request's write handler continue, whichever module installed it */
+         ngx_post_event(c->write, &ngx_posted_events);
+         return;
+     }
+
+     /*
+      * Decrement reference count (matches increment in sleep_handler) before
+      * resuming, so a request finalized by the remaining phases is freed.
+      */
+     r->main->count--; // Allow cleanup if needed
+
+     r->read_event_handler = ngx_http_block_reading;
+     r->write_event_handler = ngx_http_core_run_phases;
+
+     if (ctx->fault) {
+         /* Slow, then fail: finalize as the phase handler would have */
+         ngx_http_finalize_request(r, ngx_http_sleep_fault(r, ctx->fault));
+         ngx_http_run_posted_requests(c);
+         return;
+     }
+
+     /* Tell the upstream how much of the latency was injected; subrequests share the headers */
+     slcf = ngx_http_get_module_loc_conf(r, ngx_steadybit_sleep_module);
+
+     if ((slcf->annotate & (NGX_HTTP_SLEEP_ANNOTATE_UPSTREAM|NGX_HTTP_SLEEP_ANNOTATE_TRACESTATE))
+         && r == r->main
+         && ngx_http_sleep_annotate_request(r, ctx, slcf->annotate) != NGX_OK)
+     {
+         ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+         ngx_http_run_posted_requests(c);
+         return;
+     }
+
+     /* Resume normal HTTP request processing from where we left off */
+     ngx_http_core_run_phases(r); // Continue processing
+
+     /* Run subrequests posted while resuming, as nginx's own event handlers do */
+     ngx_http_run_posted_requests(c);
  }
 
  /**
-  * Module Initialization
+  * Cleanup Handler
   *
-  * Called during nginx configuration phase to register the module's handler
-  * in the HTTP request processing pipeline.
+  * This function is called when the request pool is destroyed. If the request
+  * is terminated before the sleep duration expires, the pending timer is
+  * cancelled. Pooled contexts are returned to the per-worker free list.
+  */
+ static void ngx_http_sleep_cleanup_handler(void *data)
+ {
+     ngx_http_sleep_ctx_t *ctx = data; // Cast data to context
+
+     /* Prevent race conditions with double cleanup */
+     if (ctx->cleaned_up) {
+         return; // Already cleaned up, avoid double cleanup
+     }
+     ctx->cleaned_up = 1; // Mark as cleaned up
+
+     if (ctx->waiting) {
+         if (ctx->log_mode == NGX_HTTP_SLEEP_LOG_NOTICE) {
+             ngx_log_error(NGX_LOG_NOTICE, ctx->request->connection->log, 0,
+                           "request terminated, cleaning up sleep context"); // Log cleanup
+
+         } else if (ctx->log_mode == NGX_HTTP_SLEEP_LOG_DEBUG) {
+             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+                            "request terminated, cleaning up sleep context");
+         }
+
+         /*
+          * The request is being freed, so its reference count no longer
+          * matters; only the pending timer must not fire.
+          */
+         ctx->waiting = 0;
+
+         if (ngx_http_sleep_stats) {
+             ngx_http_sleep_stats_done(ctx, 1);
+         }
+
+         ngx_http_sleep_release(ctx);
+     }
+
+     /* If the timer or wheel entry is still pending, cancel it */
+     ngx_http_sleep_cancel(ctx);
+
+     /* A leaving leader hands the connection's timer to the next stream */
+     if (ctx->conn != NULL && ctx->conn->leader == ctx) {
+         ngx_http_sleep_conn_promote(ctx->conn);
+     }
+
+     ctx->request = NULL; // Drop the reference to the freed request
+
+     /* Pooled contexts go back to the free list, others die with the request pool */
+     if (ctx->pooled) {
+         ngx_queue_insert_head(&ngx_http_sleep_free_ctxs, &ctx->queue);
+     }
+ }
+
+ #if (NGX_STREAM)
+
+ /*
+  * Stream Module
+  *
+  * Delays TCP and UDP sessions of stream {} servers in the access phase and,
+  * optionally, every chunk of data proxied between client and upstream.
+  * It uses nginx timers like the HTTP module and reads the same shared rule
+  * zone, with rules keyed by the listen address of the session.
+  */
+
+ /**
+  * Stream Main Configuration Structure
+  */
+ typedef struct {
+     ngx_shm_zone_t  *shm_zone;  /* Shared rule zone, NULL if not used */
+ } ngx_stream_sleep_main_conf_t;
+
+ /**
+  * Stream Server Configuration Structure
+  */
+ typedef struct {
+     ngx_msec_t  delay;         /* Delay of the session before it is proxied */
+     ngx_msec_t  packet_delay;  /* Delay of every chunk of proxied data */
+ } ngx_stream_sleep_srv_conf_t;
+
+ /**
+  * Stream Session Context Structure
+  *
+  * Index 0 of held/packet is the client to upstream direction, index 1 the
+  * upstream to client direction, matching the filters' from_upstream.
+  */
+
+ /*
+  * Connection buffered flag set on the destination while its data is held,
+  * so the proxy does not finalize the session on EOF of the other side and
+  * drop the data. SSL uses 0x01 and the stream write filter 0x10.
+  */
+ #define NGX_STREAM_SLEEP_BUFFERED  0x20
+
+ typedef struct {
+     ngx_stream_session_t  *session;    /* The delayed session */
+     ngx_event_t            event;      /* Session delay timer */
+     ngx_chain_t           *held[2];    /* Data held back while a packet delay runs */
+     ngx_event_t            packet[2];  /* Packet delay timers */
+ } ngx_stream_sleep_ctx_t;
+
+ static void *ngx_stream_sleep_create_main_conf(ngx_conf_t *cf); // Create stream main config
+ static void *ngx_stream_sleep_create_srv_conf(ngx_conf_t *cf); // Create stream server config
+ static char *ngx_stream_sleep_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child); // Merge stream server configs
+ static char *ngx_stream_sleep_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); // Parse stream sb_sleep_zone directive
+ static ngx_int_t ngx_stream_sleep_init(ngx_conf_t *cf); // Install the access handler and filter
+ static ngx_stream_sleep_ctx_t *ngx_stream_sleep_get_ctx(ngx_stream_session_t *s); // Get or create the session context
+ static ngx_int_t ngx_stream_sleep_handler(ngx_stream_session_t *s); // Access phase handler
+ static void ngx_stream_sleep_wake(ngx_event_t *ev); // Session delay timer handler
+ static ngx_int_t ngx_stream_sleep_filter(ngx_stream_session_t *s, ngx_chain_t *in, ngx_uint_t from_upstream); // Packet delay filter
+ static void ngx_stream_sleep_packet_wake(ngx_event_t *ev); // Packet delay timer handler
+ static ngx_connection_t *ngx_stream_sleep_destination(ngx_stream_session_t *s, ngx_uint_t from_upstream); // Connection data of a direction goes to
+ static void ngx_stream_sleep_cleanup(void *data); // Stop the session's timers
+
+ /**
+  * Stream Module Directives
+  *
+  * The "sb_sleep_ms" directive delays a session before it is proxied.
+  * The "sb_sleep_packet_ms" directive delays every chunk of proxied data.
+  * The "sb_sleep_zone" directive uses the shared rule zone of the http block.
+  */
+ static ngx_command_t ngx_stream_sleep_commands[] = {
+     { ngx_string("sb_sleep_ms"),
+       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+       ngx_conf_set_msec_slot,
+       NGX_STREAM_SRV_CONF_OFFSET,
+       offsetof(ngx_stream_sleep_srv_conf_t, delay),
+       NULL },
+     { ngx_string("sb_sleep_packet_ms"),
+       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+       ngx_conf_set_msec_slot,
+       NGX_STREAM_SRV_CONF_OFFSET,
+       offsetof(ngx_stream_sleep_srv_conf_t, packet_delay),
+       NULL },
+     { ngx_string("sb_sleep_zone"),
+       NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE12,
+       ngx_stream_sleep_zone,
+       NGX_STREAM_MAIN_CONF_OFFSET,
+       0,
+       NULL },
+     ngx_null_command
+ };
+
+ /**
+  * Stream Module Context
+  */
+ static ngx_stream_module_t ngx_stream_steadybit_sleep_module_ctx = {
+     NULL,                                /* preconfiguration */
+     ngx_stream_sleep_init,               /* postconfiguration */
+     ngx_stream_sleep_create_main_conf,   /* create main configuration */
+     NULL,                                /* init main configuration */
+     ngx_stream_sleep_create_srv_conf,    /* create server configuration */
+     ngx_stream_sleep_merge_srv_conf      /* merge server configuration */
+ };
+
+ /* Next filter in the stream filter chain */
+ static ngx_stream_filter_pt  ngx_stream_next_filter;
+
+ ngx_module_t ngx_stream_steadybit_sleep_module = {
+     NGX_MODULE_V1,
+     &ngx_stream_steadybit_sleep_module_ctx, /* module context */
+     ngx_stream_sleep_commands,           /* module directives */
+     NGX_STREAM_MODULE,                   /* module type */
+     NULL,                                /* init master */
+     NULL,                                /* init module */
+     NULL,                                /* init process */
+     NULL,                                /* init thread */
+     NULL,                                /* exit thread */
+     NULL,                                /* exit process */
+     NULL,                                /* exit master */
+     NGX_MODULE_V1_PADDING
+ };
+
+ /**
+  * Create Stream Main Configuration
+  */
+ static void *
+ ngx_stream_sleep_create_main_conf(ngx_conf_t *cf)
+ {
+     ngx_stream_sleep_main_conf_t  *conf;
+
+     conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_sleep_main_conf_t));
+     if (conf == NULL) {
+         return NULL;
+     }
+
+     /*
+      * set by ngx_pcalloc():
+      *
+      *     conf->shm_zone = NULL;
+      */
+
+     return conf;
+ }
+
+ /**
+  * Create Stream Server Configuration
+  */
+ static void *
+ ngx_stream_sleep_create_srv_conf(ngx_conf_t *cf)
+ {
+     ngx_stream_sleep_srv_conf_t  *conf;
+
+     conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_sleep_srv_conf_t));
+     if (conf == NULL) {
+         return NULL;
+     }
+
+     conf->delay = NGX_CONF_UNSET_MSEC;
+     conf->packet_delay = NGX_CONF_UNSET_MSEC;
+
+     return conf;
+ }
+
+ /**
+  * Merge Stream Server Configurations
+  */
+ static char *
+ ngx_stream_sleep_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+ {
+     ngx_stream_sleep_srv_conf_t  *prev = parent;
+     ngx_stream_sleep_srv_conf_t  *conf = child;
+
+     ngx_conf_merge_msec_value(conf->delay, prev->delay, 0);
+     ngx_conf_merge_msec_value(conf->packet_delay, prev->packet_delay, 0);
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Parse Stream sb_sleep_zone Directive
+  *
+  * Syntax: sb_sleep_zone name [size];
+  * Without a size, uses the zone of that name defined by sb_sleep_zone in
+  * the http block, so one control API drives HTTP and stream delays. With a
+  * size, defines the zone, for configurations without an http block.
+  */
+ static char *
+ ngx_stream_sleep_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ {
+     ngx_stream_sleep_main_conf_t  *smcf = conf;
+     ngx_str_t                     *value;
+     ssize_t                        size;
+     ngx_http_sleep_zone_ctx_t     *zctx;
+
+     if (smcf->shm_zone != NULL) {
+         return "is duplicate";
+     }
+
+     value = cf->args->elts;
+     size = 0;
+
+     if (cf->args->nelts == 3) {
+         size = ngx_parse_size(&value[2]);
+         if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "invalid zone size \"%V\"", &value[2]);
+             return NGX_CONF_ERROR;
+         }
+     }
+
+     /* The HTTP module's tag lets both blocks refer to the same zone */
+     smcf->shm_zone = ngx_shared_memory_add(cf, &value[1], size,
+                                            &ngx_steadybit_sleep_module);
+     if (smcf->shm_zone == NULL) {
+         return NGX_CONF_ERROR;
+     }
+
+     if (size == 0) {
+         return NGX_CONF_OK; // Set up by the defining directive
+     }
+
+     if (smcf->shm_zone->data) {
+         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "duplicate zone \"%V\"", &value[1]);
+         return NGX_CONF_ERROR;
+     }
+
+     zctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_sleep_zone_ctx_t));
+     if (zctx == NULL) {
+         return NGX_CONF_ERROR;
+     }
+
+     smcf->shm_zone->init = ngx_http_sleep_init_zone;
+     smcf->shm_zone->data = zctx;
+
+     return NGX_CONF_OK;
+ }
+
+ /**
+  * Stream Module Initialization
+  *
+  * Registers the access phase handler and inserts the packet delay filter
+  * at the top of the stream filter chain.
   */
  static ngx_int_t
- ngx_http_sleep_init(ngx_conf_t *cf)
+ ngx_stream_sleep_init(ngx_conf_t *cf)
  {
-     ngx_http_handler_pt        *h; // Pointer to handler array element
-     ngx_http_core_main_conf_t  *cmcf; // Pointer to main HTTP config
+     ngx_stream_handler_pt        *h;
+     ngx_stream_core_main_conf_t  *cmcf;
 
-     /* Get the main HTTP configuration */
-     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module); // Get main conf
+     cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
 
-     /* Register our handler in the ACCESS phase (before content generation) */
-     h = ngx_array_push(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers); // Add handler to phase
+     h = ngx_array_push(&cmcf->phases[NGX_STREAM_ACCESS_PHASE].handlers);
      if (h == NULL) {
-         return NGX_ERROR; // Error if push fails
+         return NGX_ERROR;
      }
 
-     *h = ngx_http_sleep_handler; // Set our handler function
+     *h = ngx_stream_sleep_handler;
 
-     return NGX_OK; // Success
+     ngx_stream_next_filter = ngx_stream_top_filter;
+     ngx_stream_top_filter = ngx_stream_sleep_filter;
+
+     return NGX_OK;
  }
 
  /**
-  * Main Request Handler
+  * Get Stream Context
   *
-  * This function is called for each HTTP request during the ACCESS phase.
-  * It checks if sleep is configured, evaluates the sleep duration, and
-  * initiates asynchronous sleeping if needed.
+  * Returns the session's context, creating it with a cleanup handler that
+  * stops its timers when the session is closed.
   */
- static ngx_int_t
- ngx_http_sleep_handler(ngx_http_request_t *r)
+ static ngx_stream_sleep_ctx_t *
+ ngx_stream_sleep_get_ctx(ngx_stream_session_t *s)
  {
-     ngx_http_sleep_loc_conf_t  *slcf; // Pointer to location config
-     ngx_str_t                   val; // Holds evaluated sleep_ms value
-     ngx_int_t                   sleep_time; // Sleep duration in ms
-     ngx_http_sleep_ctx_t       *ctx; // Pointer to request context
+     ngx_stream_sleep_ctx_t  *ctx;
+     ngx_pool_cleanup_t      *cln;
+     ngx_uint_t               i;
 
-     /* Get the location configuration for this request */
-     slcf = ngx_http_get_module_loc_conf(r, ngx_steadybit_sleep_module); // Get config
+     ctx = ngx_stream_get_module_ctx(s, ngx_stream_steadybit_sleep_module);
+     if (ctx) {
+         return ctx;
+     }
 
-     /* If no sleep is configured for this location, continue normally */
-     if (slcf->sleep_ms == NULL) {
-         return NGX_DECLINED; // No sleep, continue
+     ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_stream_sleep_ctx_t));
+     if (ctx == NULL) {
+         return NULL;
      }
 
-    /* Check if we already have a context (prevent re-processing) */
-    ctx = ngx_http_get_module_ctx(r, ngx_steadybit_sleep_module); // Get context
-    if (ctx != NULL) {
-        return NGX_DECLINED; // Already processed, continue
-    }
+     cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+     if (cln == NULL) {
+         return NULL;
+     }
 
-    /* Evaluate the complex value to get the actual sleep duration */
-    if (ngx_http_complex_value(r, slcf->sleep_ms, &val) != NGX_OK) {
-        return NGX_ERROR; // Error if evaluation fails
-    }
+     cln->handler = ngx_stream_sleep_cleanup;
+     cln->data = ctx;
 
-    /* If the evaluated value is empty, no sleep needed */
-    if (val.len == 0) {
-        return NGX_DECLINED; // No value, continue
-    }
+     ctx->session = s;
 
-    /* Convert the string value to integer (milliseconds) */
-    sleep_time = ngx_atoi(val.data, val.len); // Convert to int
-    if (sleep_time == NGX_ERROR || sleep_time < 0) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "invalid sb_sleep_ms value \"%V\"", &val); // Log error
-        return NGX_DECLINED; // Invalid value, continue
-    }
+     ctx->event.handler = ngx_stream_sleep_wake;
+     ctx->event.data = ctx;
+     ctx->event.log = s->connection->log;
 
-    /* If sleep time is 0, no need to sleep */
-    if (sleep_time == 0) {
-        return NGX_DECLINED; // No sleep, continue
-    }
+     for (i = 0; i < 2; i++) {
+         ctx->packet[i].handler = ngx_stream_sleep_packet_wake;
+         ctx->packet[i].data = ctx;
+         ctx->packet[i].log = s->connection->log;
+     }
 
-    /* Create and initialize request context for this sleep operation */
-    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_sleep_ctx_t)); // Allocate context
-    if (ctx == NULL) {
-        return NGX_ERROR; // Error if allocation fails
-    }
-    ctx->request = r; // Store request pointer
-    ctx->cleaned_up = 0; // Initialize cleanup flag
-    ngx_http_set_ctx(r, ctx, ngx_steadybit_sleep_module); // Set context for request
+     ngx_stream_set_ctx(s, ctx, ngx_stream_steadybit_sleep_module);
 
-    /* Register cleanup handler to prevent memory leaks if request terminates early */
-    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0); // Add cleanup handler
-    if (cln == NULL) {
-        return NGX_ERROR; // Error if allocation fails
-    }
-    cln->handler = ngx_http_sleep_cleanup_handler; // Set cleanup function
-    cln->data = ctx; // Pass context to cleanup
+     return ctx;
+ }
+
+ /**
+  * Stream Access Phase Handler
+  *
+  * Picks the session delay, a rule for the listen address from the shared
+  * zone taking precedence over sb_sleep_ms, and waits for it before the
+  * session goes on to be proxied. Client events during the wait run the
+  * phases again, which keep waiting until the timer has fired.
+  */
+ static ngx_int_t
+ ngx_stream_sleep_handler(ngx_stream_session_t *s)
+ {
+     ngx_stream_sleep_main_conf_t  *smcf;
+     ngx_stream_sleep_srv_conf_t   *sscf;
+     ngx_stream_sleep_ctx_t        *ctx;
+     ngx_http_sleep_zone_ctx_t     *zctx;
+     ngx_http_sleep_rule_t          rule;
+     ngx_str_t                     *addr;
+     ngx_msec_t                     delay;
 
-    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
-                  "sleeping (async) for %i ms", sleep_time); // Log sleep
+     ctx = ngx_stream_get_module_ctx(s, ngx_stream_steadybit_sleep_module);
+     if (ctx) {
+         return ctx->event.timer_set ? NGX_AGAIN : NGX_DECLINED;
+     }
 
-    /* Initialize the timer event for asynchronous sleeping */
-    ngx_memzero(&ctx->sleep_event, sizeof(ngx_event_t)); // Zero event struct
-    ctx->sleep_event.handler = ngx_http_sleep_wake_handler; /* Callback when timer expires */
-    ctx->sleep_event.data = ctx;                            /* Pass context to callback */
-    ctx->sleep_event.log = r->connection->log;              /* Use request's log context */
+     smcf = ngx_stream_get_module_main_conf(s, ngx_stream_steadybit_sleep_module);
+     sscf = ngx_stream_get_module_srv_conf(s, ngx_stream_steadybit_sleep_module);
 
-    /* Start the timer - this is non-blocking */
-    ngx_add_timer(&ctx->sleep_event, (ngx_msec_t)sleep_time); // Set timer
+     delay = sscf->delay;
 
-    /* Increment request reference count to prevent cleanup during sleep */
-    r->main->count++; // Prevent premature cleanup
+     if (smcf->shm_zone != NULL) {
+         zctx = smcf->shm_zone->data;
+         addr = &s->connection->listening->addr_text;
 
-    /* Return NGX_DONE to pause request processing until timer expires */
-    return NGX_DONE; // Pause processing
+         if (zctx->sh->nrules
+             && ngx_http_sleep_zone_read(zctx->sh, NGX_HTTP_SLEEP_KEY_STREAM,
+                                         addr->data, addr->len,
+                                         ngx_http_sleep_rule_hash(NGX_HTTP_SLEEP_KEY_STREAM,
+                                                                  addr->data, addr->len),
+                                         &rule)
+                == NGX_OK)
+         {
+             if (rule.percent < 10000
+                 && (uint32_t) (ngx_http_sleep_rand() >> 32)
+                    >= (uint32_t) (((uint64_t) rule.percent << 32) / 10000))
+             {
+                 return NGX_DECLINED; // Not selected, continue
+             }
+
+             delay = rule.delay;
+         }
+     }
+
+     if (delay == 0) {
+         return NGX_DECLINED;
+     }
+
+     ctx = ngx_stream_sleep_get_ctx(s);
+     if (ctx == NULL) {
+         return NGX_ERROR;
+     }
+
+     ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                    "sleeping (async) for %M ms", delay);
+
+     ngx_add_timer(&ctx->event, delay);
+
+     return NGX_AGAIN; // Park the session until the timer fires
  }
 
  /**
-  * Timer Wake-up Handler
+  * Stream Session Delay Timer Handler
   *
-  * This function is called when the sleep timer expires. It resumes
-  * request processing and cleans up the sleep context.
+  * Resumes the session's phases after the delay.
   */
- static void ngx_http_sleep_wake_handler(ngx_event_t *ev)
+ static void
+ ngx_stream_sleep_wake(ngx_event_t *ev)
  {
-     ngx_http_sleep_ctx_t *ctx = ev->data;      /* Get context from event data */
-     ngx_http_request_t *r;
+     ngx_stream_sleep_ctx_t  *ctx = ev->data;
 
-     /* Add null checks for safety */
+     ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0, "sleep finished, resuming session");
+
+     ngx_stream_core_run_phases(ctx->session);
+ }
+
+ /**
+  * Stream Packet Delay Filter
+  *
+  * Holds back newly proxied data of a direction for sb_sleep_packet_ms
+  * by reference; data arriving meanwhile joins the held chain. The proxy
+  * treats held buffers as busy, so it stops reading once its buffer is
+  * full instead of queueing data without bound. The destination is marked
+  * buffered while data is held, as the write filter does for unsent data.
+  */
+ static ngx_int_t
+ ngx_stream_sleep_filter(ngx_stream_session_t *s, ngx_chain_t *in, ngx_uint_t from_upstream)
+ {
+     ngx_stream_sleep_srv_conf_t  *sscf;
+     ngx_stream_sleep_ctx_t       *ctx;
+     ngx_connection_t             *dst;
+
+     sscf = ngx_stream_get_module_srv_conf(s, ngx_stream_steadybit_sleep_module);
+
+     if (sscf->packet_delay == 0) {
+         return ngx_stream_next_filter(s, in, from_upstream);
+     }
+
+     ctx = ngx_stream_sleep_get_ctx(s);
      if (ctx == NULL) {
-         return;
+         return NGX_ERROR;
      }
 
-     r = ctx->request;
-     if (r == NULL) {
-         return;
+     if (in) {
+         if (ctx->held[from_upstream] == NULL && !ctx->packet[from_upstream].timer_set) {
+             ngx_add_timer(&ctx->packet[from_upstream], sscf->packet_delay);
+         }
+
+         if (ngx_chain_add_copy(s->connection->pool, &ctx->held[from_upstream], in) != NGX_OK) {
+             return NGX_ERROR;
+         }
      }
 
-     ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
-                   "finished sleeping (async)"); // Log wake-up
+     dst = ngx_stream_sleep_destination(s, from_upstream);
 
-     /* Timer has already fired, so no need to delete it */
-     
-     /* Resume normal HTTP request processing from where we left off */
-     ngx_http_core_run_phases(r); // Continue processing
+     if (ctx->packet[from_upstream].timer_set) {
+         if (dst && ctx->held[from_upstream]) {
+             dst->buffered |= NGX_STREAM_SLEEP_BUFFERED; // Not done until the data is sent
+         }
 
-     /* Decrement reference count (matches increment in sleep_handler) */
-     r->main->count--; // Allow cleanup if needed
+         return NGX_OK; // Still sleeping, the data stays busy
+     }
+
+     if (dst) {
+         dst->buffered &= ~NGX_STREAM_SLEEP_BUFFERED;
+     }
+
+     in = ctx->held[from_upstream];
+     ctx->held[from_upstream] = NULL;
+
+     return ngx_stream_next_filter(s, in, from_upstream);
  }
 
  /**
-  * Cleanup Handler
+  * Stream Packet Delay Timer Handler
   *
-  * This function is called to clean up the sleep context if the request is
-  * terminated before the sleep duration expires. It prevents memory leaks
-  * by ensuring that timers are cancelled and reference counts are balanced.
+  * Posts the write event of the direction's destination, so the proxy runs
+  * the filter chain again and the held data is sent. The buffered flag is
+  * cleared by the filter once it has passed the data on: clearing it here
+  * would let an EOF handled before the posted event finalize the session.
   */
- static void ngx_http_sleep_cleanup_handler(void *data)
+ static void
+ ngx_stream_sleep_packet_wake(ngx_event_t *ev)
  {
-     ngx_http_sleep_ctx_t *ctx = data; // Cast data to context
+     ngx_stream_sleep_ctx_t  *ctx = ev->data;
+     ngx_connection_t        *dst;
 
-     /* Prevent race conditions with double cleanup */
-     if (ctx->cleaned_up) {
-         return; // Already cleaned up, avoid double cleanup
-     }
-     ctx->cleaned_up = 1; // Mark as cleaned up
+     dst = ngx_stream_sleep_destination(ctx->session, ev == &ctx->packet[1]);
 
-     ngx_log_error(NGX_LOG_NOTICE, ctx->request->connection->log, 0,
-                   "request terminated, cleaning up sleep context"); // Log cleanup
+     if (dst) {
+         ngx_post_event(dst->write, &ngx_posted_events);
+     }
+ }
 
-     /* If the timer is still set, cancel it */
-     if (ctx->sleep_event.timer_set) {
-         ngx_del_timer(&ctx->sleep_event); // Remove timer
+ /**
+  * Stream Destination
+  *
+  * Returns the connection data of the given direction is sent to: the
+  * client for data from the upstream, the upstream peer otherwise, or NULL
+  * if it is not connected.
+  */
+ static ngx_connection_t *
+ ngx_stream_sleep_destination(ngx_stream_session_t *s, ngx_uint_t from_upstream)
+ {
+     if (from_upstream) {
+         return s->connection;
      }
 
-     /* Decrement the request's reference count */
-     ctx->request->main->count--; // Balance reference count
+     return s->upstream ? s->upstream->peer.connection : NULL;
+ }
+
+ /**
+  * Stream Cleanup
+  *
+  * Stops pending timers when the session's pool is destroyed.
+  */
+ static void
+ ngx_stream_sleep_cleanup(void *data)
+ {
+     ngx_stream_sleep_ctx_t  *ctx = data;
+     ngx_uint_t               i;
 
-     /* Note: Context memory is automatically freed when request pool is destroyed */
+     if (ctx->event.timer_set) {
+         ngx_del_timer(&ctx->event);
+     }
+
+     for (i = 0; i < 2; i++) {
+         if (ctx->packet[i].timer_set) {
+             ngx_del_timer(&ctx->packet[i]);
+         }
+     }
  }
+
+ #endif
@@ -0,0 +1,384 @@
+#!/bin/bash
+#
+# Copyright 2025 steadybit GmbH. All rights reserved.
+#
+
+#
+# Soak test script for ngx_steadybit_sleep_module.c
+# This script builds nginx with the sleep module and keeps it under churn:
+# sleeping requests on every scheduler and sleep point, subrequests, proxied
+# requests with upstream and request body sleeps, keepalive reuse, random
+# client aborts and resets, and graceful reloads. After every round the load
+# stops, and once all sleeps have drained worker RSS, open descriptors and
+# active connections are sampled. The test fails if connections or
+# descriptors are left over, if RSS of a worker generation grows, or if old
+# workers do not exit after a reload. Settings can be overridden through the
+# environment. Linux only, needs python3.
+#
+
+set -e  # Exit on error
+
+# Configuration
+NGINX_VERSION="${NGINX_VERSION:-1.27.4}"
+SOAK_PORT="${SOAK_PORT:-8999}"  # Port of the soaked server; the backend and status use the next two
+SOAK_DIR="${SOAK_DIR:-/tmp/nginx-delay-soak}"
+SOAK_ROUNDS="${SOAK_ROUNDS:-30}"  # Rounds of load, each followed by a quiet sample
+SOAK_ROUND_SECONDS="${SOAK_ROUND_SECONDS:-60}"  # Load duration of a round
+SOAK_RELOAD_EVERY="${SOAK_RELOAD_EVERY:-10}"  # Reload in the middle of every n-th round, 0 for never
+SOAK_CONCURRENCY="${SOAK_CONCURRENCY:-500}"  # Concurrent client connections
+SOAK_ABORT_PERCENT="${SOAK_ABORT_PERCENT:-30}"  # Share of requests the client gives up on
+SOAK_KEEPALIVE="${SOAK_KEEPALIVE:-20}"  # Most requests sent over one connection
+SOAK_SLEEP_MAX="${SOAK_SLEEP_MAX:-40}"  # Largest delay in milliseconds
+SOAK_WORKERS="${SOAK_WORKERS:-2}"  # worker_processes
+SOAK_SETTLE="${SOAK_SETTLE:-30}"  # Seconds to wait for sleeps and connections to drain
+SOAK_RSS_SLACK_KB="${SOAK_RSS_SLACK_KB:-8192}"  # RSS growth per worker generation still accepted
+SOAK_CC_OPT="${SOAK_CC_OPT:-}"  # Extra compiler options, e.g. -fsanitize=address
+SOAK_LD_OPT="${SOAK_LD_OPT:-}"  # Extra linker options, e.g. -fsanitize=address
+
+BACKEND_PORT=$((SOAK_PORT + 1))
+STATUS_PORT=$((SOAK_PORT + 2))
+
+echo "=== Soak testing ngx_steadybit_sleep_module ==="
+echo "Using NGINX version: $NGINX_VERSION"
+echo "Using ports: $SOAK_PORT, $BACKEND_PORT, $STATUS_PORT"
+
+if ! command -v python3 > /dev/null; then
+    echo "❌ python3 not found, it runs the client."
+    exit 1
+fi
+
+ulimit -n 65536 2> /dev/null || ulimit -n "$(ulimit -Hn)"
+
+ORIGINAL_DIR=$(pwd)
+mkdir -p $SOAK_DIR
+cd $SOAK_DIR
+
+# Download and extract Nginx
+if [ ! -f "nginx-$NGINX_VERSION.tar.gz" ]; then
+  echo "Downloading Nginx $NGINX_VERSION..."
+  curl -s -O "https://nginx.org/download/nginx-$NGINX_VERSION.tar.gz"
+fi
+
+if [ ! -d "nginx-$NGINX_VERSION" ]; then
+  echo "Extracting Nginx..."
+  tar -xzf "nginx-$NGINX_VERSION.tar.gz"
+fi
+
+# Copy the module source and config
+echo "Copying sleep module source..."
+mkdir -p $SOAK_DIR/sleep
+cp $ORIGINAL_DIR/ngx_steadybit_sleep_module.c $ORIGINAL_DIR/config $SOAK_DIR/sleep/
+
+cd $SOAK_DIR/nginx-$NGINX_VERSION
+
+echo "Building Nginx with sleep module..."
+./configure --prefix=$SOAK_DIR/module --with-compat --with-http_stub_status_module \
+    --with-cc-opt="$SOAK_CC_OPT" --with-ld-opt="$SOAK_LD_OPT" \
+    --add-dynamic-module=../sleep > /dev/null
+make -j"$(nproc)" > /dev/null
+make install > /dev/null
+
+PREFIX=$SOAK_DIR/module
+cd $SOAK_DIR
+
+# Pages: a small one for sleeps, a larger one for body chunks, one with subrequests
+echo "Soak page" > $PREFIX/html/sleep.html
+head -c 262144 /dev/zero | tr '\0' 'x' > $PREFIX/html/large.html
+cat > $PREFIX/html/ssi.html << 'EOF'
+<!--# include virtual="/timer" -->
+<!--# include virtual="/wheel" -->
+<!--# include virtual="/precise" -->
+EOF
+
+DIST="sb_sleep_dist uniform min=0 max=$SOAK_SLEEP_MAX;"
+
+# The locations included by ssi.html sleep in subrequests, too; the access
+# phase skips subrequests, so they sleep in the precontent phase
+SUB="sb_sleep_phase precontent; sb_sleep_once each;"
+
+cat > $PREFIX/conf/nginx.conf << EOF
+load_module $PREFIX/modules/ngx_steadybit_sleep_module.so;
+
+worker_processes $SOAK_WORKERS;
+worker_rlimit_nofile 65536;
+error_log $PREFIX/logs/error.log warn;
+pid $PREFIX/logs/nginx.pid;
+
+events {
+    worker_connections 16384;
+}
+
+http {
+    access_log off;
+    sb_sleep_ctx_pool 256;
+    keepalive_requests 1000;  # Servers close connections now and then, too
+
+    upstream soak_backend {
+        server 127.0.0.1:$BACKEND_PORT;
+        sb_upstream_sleep_ms 5;
+        keepalive 16;
+    }
+
+    server {
+        listen $SOAK_PORT backlog=4096;
+        root $PREFIX/html;
+
+        location = /timer { sb_sleep_scheduler timer; $DIST $SUB alias $PREFIX/html/sleep.html; }
+        location = /wheel { sb_sleep_scheduler wheel; $DIST $SUB alias $PREFIX/html/sleep.html; }
+        location = /precise { sb_sleep_scheduler precise; $DIST $SUB alias $PREFIX/html/sleep.html; }
+        location = /header { sb_sleep_at header; $DIST alias $PREFIX/html/sleep.html; }
+        location = /chunk { sb_sleep_at body_chunk; $DIST sb_throttle_rate 4m; alias $PREFIX/html/large.html; }
+        location = /ssi.html { ssi on; $DIST }
+        location = /fault { $DIST sb_fault reset percent=20; alias $PREFIX/html/sleep.html; }
+
+        location = /proxy {
+            $DIST
+            proxy_http_version 1.1;
+            proxy_set_header Connection "";
+            proxy_pass http://soak_backend/backend;
+        }
+
+        location = /body {
+            sb_sleep_request_body ${SOAK_SLEEP_MAX}ms every=16k;
+            client_body_buffer_size 16k;
+            proxy_http_version 1.1;
+            proxy_set_header Connection "";
+            proxy_request_buffering off;
+            proxy_pass http://soak_backend/upload;
+        }
+    }
+
+    server {
+        listen $BACKEND_PORT;
+        keepalive_timeout 2s;  # Lets the upstream keepalive cache drain between rounds
+
+        location = /backend { sb_sleep_at header; $DIST alias $PREFIX/html/sleep.html; }
+        location = /upload { return 204; }
+    }
+
+    server {
+        listen $STATUS_PORT;
+        keepalive_timeout 0;
+
+        location = /status { sb_sleep_status; }
+        location = /nginx_status { stub_status; }
+    }
+}
+EOF
+
+# Client: keeps SOAK_CONCURRENCY connections busy with random requests, gives
+# up on some of them at a random point, half of those with a reset, and
+# prints what it did
+cat > $SOAK_DIR/churn.py << 'EOF'
+import asyncio, random, socket, struct, sys, time
+
+host, port, seconds, concurrency, abort, keepalive, sleep_max = sys.argv[1:8]
+port, seconds, concurrency = int(port), float(seconds), int(concurrency)
+abort, keepalive, sleep_max = int(abort) / 100, int(keepalive), int(sleep_max) / 1000
+
+PATHS = ["/timer", "/wheel", "/precise", "/header", "/chunk", "/ssi.html", "/fault", "/proxy", "/body"]
+stats = {"requests": 0, "aborted": 0, "closed": 0, "status_5xx": 0, "timeouts": 0}
+
+async def response(reader):
+    head = (await reader.readuntil(b"\r\n\r\n")).decode("latin-1").lower().split("\r\n")
+    length, chunked, close = 0, False, False
+    for line in head[1:]:
+        name, _, value = line.partition(":")
+        if name == "content-length":
+            length = int(value)
+        elif name == "transfer-encoding" and "chunked" in value:
+            chunked = True
+        elif name == "connection" and "close" in value:
+            close = True
+    if chunked:
+        while True:
+            size = int((await reader.readuntil(b"\r\n")).split(b";")[0], 16)
+            await reader.readexactly(size + 2)
+            if size == 0:
+                break
+    else:
+        await reader.readexactly(length)
+    if int(head[0].split()[1]) >= 500:
+        stats["status_5xx"] += 1
+    return close
+
+async def connection(deadline):
+    reader, writer = await asyncio.open_connection(host, port)
+    try:
+        for _ in range(random.randint(1, keepalive)):
+            path = random.choice(PATHS)
+            body = b"x" * random.randint(1, 65536) if path == "/body" else b""
+            writer.write(b"%s %s HTTP/1.1\r\nHost: soak\r\nContent-Length: %d\r\n\r\n"
+                         % (b"POST" if body else b"GET", path.encode(), len(body)))
+            aborting = random.random() < abort
+            if aborting:
+                writer.write(body[:random.randint(0, len(body))])
+                await asyncio.sleep(random.uniform(0, sleep_max * 1.5))
+                if random.random() < 0.5:
+                    sock = writer.get_extra_info("socket")
+                    sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+                    writer.transport.abort()
+                stats["aborted"] += 1
+                return
+            writer.write(body)
+            close = await asyncio.wait_for(response(reader), 30)
+            stats["requests"] += 1
+            if close or time.monotonic() > deadline:
+                return
+    except asyncio.TimeoutError:
+        stats["timeouts"] += 1
+    except (ConnectionError, asyncio.IncompleteReadError):
+        stats["closed"] += 1  # Resets by sb_fault, idle connections closed on reload
+    finally:
+        writer.close()
+
+async def worker(deadline):
+    while time.monotonic() < deadline:
+        try:
+            await connection(deadline)
+        except OSError:
+            stats["closed"] += 1
+
+async def main():
+    deadline = time.monotonic() + seconds
+    await asyncio.gather(*(worker(deadline) for _ in range(concurrency)))
+
+asyncio.run(main())
+for key, value in stats.items():
+    print(key, value)
+EOF
+
+workers() {
+    pgrep -P "$(cat $PREFIX/logs/nginx.pid)" | sort
+}
+
+# RSS in kB and open descriptors summed over the current workers
+rss_kb() {
+    local pid sum=0
+    for pid in $(workers); do
+        sum=$(( sum + $(awk '/^VmRSS/ { print $2 }' /proc/$pid/status) ))
+    done
+    echo $sum
+}
+
+open_fds() {
+    local pid sum=0
+    for pid in $(workers); do
+        sum=$(( sum + $(ls /proc/$pid/fd | wc -l) ))
+    done
+    echo $sum
+}
+
+# Active connections, including the one asking
+active_connections() {
+    curl -s "http://127.0.0.1:$STATUS_PORT/nginx_status" | awk '/^Active connections/ { print $3 }'
+}
+
+# Sleep statistics summed over all worker slots
+sleep_metric() {
+    curl -s "http://127.0.0.1:$STATUS_PORT/status" | awk -v m="$1" 'index($1, m "{") == 1 { s += $2 } END { print s + 0 }'
+}
+
+# Wait until nothing sleeps, only the status connection is open and all old
+# workers have exited
+settle() {
+    local i pid alive
+
+    for i in $(seq 1 $(( SOAK_SETTLE * 2 ))); do
+        alive=""
+        for pid in $OLD_WORKERS; do
+            kill -0 $pid 2> /dev/null && alive="$alive $pid"
+        done
+
+        if [ -z "$alive" ] && [ "$(sleep_metric sb_sleep_active)" = 0 ] \
+            && [ "$(active_connections)" = 1 ]
+        then
+            OLD_WORKERS=""
+            return 0
+        fi
+
+        sleep 0.5
+    done
+
+    echo "❌ Did not settle within ${SOAK_SETTLE}s: $(sleep_metric sb_sleep_active) sleeping," \
+         "$(active_connections) active connections, old workers still running:${alive:- none}"
+    return 1
+}
+
+fail() {
+    echo "❌ $1"
+    $PREFIX/sbin/nginx -p $PREFIX -c $PREFIX/conf/nginx.conf -s stop
+    exit 1
+}
+
+rm -f $PREFIX/logs/*.log
+$PREFIX/sbin/nginx -p $PREFIX -c $PREFIX/conf/nginx.conf
+sleep 1
+
+SAMPLES=$SOAK_DIR/samples.txt
+OLD_WORKERS=""
+GENERATION=""
+BASE_FDS=""
+TIMEOUTS=0
+
+echo ""
+echo "=== ${SOAK_ROUNDS} rounds of ${SOAK_ROUND_SECONDS}s with $SOAK_CONCURRENCY connections ==="
+printf "%-6s %10s %10s %8s %8s %10s %8s %10s %10s\n" \
+    round requests aborted closed 5xx delayed rss_kB fds active | tee $SAMPLES
+
+for round in $(seq 1 $SOAK_ROUNDS); do
+    python3 $SOAK_DIR/churn.py 127.0.0.1 $SOAK_PORT $SOAK_ROUND_SECONDS $SOAK_CONCURRENCY \
+        $SOAK_ABORT_PERCENT $SOAK_KEEPALIVE $SOAK_SLEEP_MAX > $SOAK_DIR/churn.out &
+    churn_pid=$!
+
+    # Reload while requests are sleeping
+    if [ "$SOAK_RELOAD_EVERY" -gt 0 ] && [ $(( round % SOAK_RELOAD_EVERY )) = 0 ]; then
+        sleep $(( SOAK_ROUND_SECONDS / 2 ))
+        OLD_WORKERS=$(workers)
+        $PREFIX/sbin/nginx -p $PREFIX -c $PREFIX/conf/nginx.conf -s reload
+    fi
+
+    wait $churn_pid
+    settle || fail "Requests, connections or workers leaked in round $round"
+
+    read -r req aborted closed s5xx timeouts < <(awk '{ v[$1] = $2 } END {
+        print v["requests"], v["aborted"], v["closed"], v["status_5xx"], v["timeouts"] }' $SOAK_DIR/churn.out)
+    TIMEOUTS=$(( TIMEOUTS + timeouts ))
+
+    rss=$(rss_kb)
+    fds=$(open_fds)
+    active=$(active_connections)
+
+    printf "%-6s %10d %10d %8d %8d %10d %8d %10d %10d\n" \
+        $round $req $aborted $closed $s5xx "$(sleep_metric sb_sleep_delayed_total)" $rss $fds $active \
+        | tee -a $SAMPLES
+
+    [ "$timeouts" = 0 ] || fail "$timeouts requests did not complete within 30s in round $round"
+
+    # The first round warms up pools and lazily opened descriptors
+    if [ -z "$BASE_FDS" ]; then
+        BASE_FDS=$fds
+    elif [ "$fds" -gt "$BASE_FDS" ]; then
+        fail "Open descriptors grew from $BASE_FDS to $fds"
+    fi
+
+    # RSS is compared within a generation of workers, a reload starts afresh
+    if [ "$(workers | tr '\n' ' ')" != "$GENERATION" ]; then
+        GENERATION=$(workers | tr '\n' ' ')
+        BASE_RSS=$rss
+    elif [ $(( rss - BASE_RSS )) -gt "$SOAK_RSS_SLACK_KB" ]; then
+        fail "Worker RSS grew from ${BASE_RSS}kB to ${rss}kB"
+    fi
+done
+
+$PREFIX/sbin/nginx -p $PREFIX -c $PREFIX/conf/nginx.conf -s quit
+
+if grep -q -E '\[(alert|emerg)\]|exited on signal' $PREFIX/logs/error.log; then
+    grep -E '\[(alert|emerg)\]|exited on signal' $PREFIX/logs/error.log | head -n 20
+    echo "❌ Alerts or crashed workers in $PREFIX/logs/error.log"
+    exit 1
+fi
+
+echo ""
+echo "=== Soak test passed ==="
+echo "Samples: $SAMPLES"
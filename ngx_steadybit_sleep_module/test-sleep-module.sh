@@ -13,6 +13,8 @@ set -e  # Exit on error
 # Configuration
 NGINX_VERSION="1.27.4"
 TEST_PORT=8888  # Default port for testing, can be overridden if already in use
+STREAM_PORT=9888  # Port of the stream proxy in front of the test server
+PACKET_PORT=9889  # Port of the stream proxy delaying every chunk of data
 TEST_DIR="/tmp/nginx-delay-test"
 
 echo "=== Testing ngx_steadybit_sleep_module locally ==="
@@ -71,14 +73,34 @@ cp $TEST_DIR/ngx_steadybit_sleep_module.c $TEST_DIR/sleep/
 cat > $TEST_DIR/sleep/config << 'EOF'
 ngx_addon_name=ngx_steadybit_sleep_module
 if test -n "$dynamic_modules" || test -n "$ngx_module_link"; then
-    ngx_module_type=HTTP
+    ngx_module_type=HTTP_AUX_FILTER
     ngx_module_name=ngx_steadybit_sleep_module
     ngx_module_srcs="$ngx_addon_dir/ngx_steadybit_sleep_module.c"
-    ngx_module_libs=
+    ngx_module_libs=-lm
+
+    if [ "$STREAM" != NO ] && [ "$ngx_module_link" = DYNAMIC ]; then
+        # One shared object; the stream module is loaded last, after the stream write filter
+        ngx_module_name="$ngx_module_name ngx_stream_steadybit_sleep_module"
+        ngx_module_order="ngx_steadybit_sleep_module ngx_http_copy_filter_module"
+    fi
+
     . auto/module
+
+    if [ "$STREAM" != NO ] && [ "$ngx_module_link" != DYNAMIC ]; then
+        ngx_module_type=STREAM
+        ngx_module_name=ngx_stream_steadybit_sleep_module
+        ngx_module_srcs=
+        ngx_module_libs=
+        ngx_module_order=
+        . auto/module
+    fi
 else
-    HTTP_MODULES="$HTTP_MODULES ngx_steadybit_sleep_module"
+    HTTP_AUX_FILTER_MODULES="$HTTP_AUX_FILTER_MODULES ngx_steadybit_sleep_module"
+    if [ "$STREAM" != NO ]; then
+        STREAM_MODULES="$STREAM_MODULES ngx_stream_steadybit_sleep_module"
+    fi
     NGX_ADDON_SRCS="$NGX_ADDON_SRCS $ngx_addon_dir/ngx_steadybit_sleep_module.c"
+    CORE_LIBS="$CORE_LIBS -lm"
 fi
 EOF
 
@@ -89,6 +111,7 @@ echo "Configuring Nginx with sleep module..."
   --prefix=$TEST_DIR/nginx \
   --with-compat \
   --with-debug \
+  --with-stream \
   --add-dynamic-module=../sleep
 
 echo "Building Nginx and modules..."
@@ -108,6 +131,12 @@ mkdir -p $TEST_DIR/nginx/html
 # Create a simple index.html
 echo "Creating test HTML files..."
 echo "No sleep test page" > $TEST_DIR/nginx/html/index.html
+# 64 KiB of static content for the throttling test
+head -c 65536 /dev/zero | tr '\0' 'x' > $TEST_DIR/nginx/html/throttle.txt
+# Pages including a sleeping location through an SSI subrequest
+echo "Included" > $TEST_DIR/nginx/html/included.txt
+echo '<!--# include virtual="/ssi-sleep-main" -->' > $TEST_DIR/nginx/html/ssi-main.html
+echo '<!--# include virtual="/ssi-sleep-each" -->' > $TEST_DIR/nginx/html/ssi-each.html
 
 # Copy the compiled module
 cp $TEST_DIR/nginx-$NGINX_VERSION/objs/ngx_steadybit_sleep_module.so $TEST_DIR/nginx/modules/
@@ -152,10 +181,34 @@ http {
     log_format main '\$remote_addr - \$remote_user [\$time_local] "\$request" '
                     '\$status \$body_bytes_sent "\$http_referer" '
                     '"\$http_user_agent" "\$http_x_forwarded_for" '
-                    'rt=\$request_time';
+                    'rt=\$request_time sleep=\$sb_sleep_actual_ms';
+
+    # Bytes of the request, body included, that reached the body sink
+    log_format rbody '\$request_uri len=\$request_length';
+
+    # Requests the upstream sink has seen on its client connection
+    log_format upstream '\$request_uri conn=\$connection requests=\$connection_requests';
 
     access_log $TEST_DIR/nginx/logs/access.log main;
 
+    sb_sleep_zone test 1m;
+
+    # Every request to the test server waits 300ms, on new and cached
+    # connections; keepalive comes first here and last in the next block
+    upstream sleep_backend {
+        server 127.0.0.1:$TEST_PORT;
+        keepalive 4;
+        sb_upstream_sleep_ms 300;
+    }
+
+    # The peer's own 400ms delay takes precedence over the 100ms of all peers
+    upstream sleep_peer_backend {
+        sb_upstream_sleep_ms 100;
+        server 127.0.0.1:$TEST_PORT;
+        sb_upstream_sleep_ms 400 127.0.0.1:$TEST_PORT;
+        keepalive 4;
+    }
+
     server {
         listen $TEST_PORT;
         server_name localhost;
@@ -191,9 +244,234 @@ http {
             proxy_pass http://localhost:9000/;
         }
 
+        # Test with 500ms sleep scheduled on the timing wheel
+        location = /sleep-wheel-500ms {
+            sb_sleep_scheduler wheel;
+            sb_sleep_ms 500;
+            proxy_pass http://localhost:9000/;
+        }
+
+        # Test with a uniformly distributed sleep between 200ms and 300ms
+        location = /sleep-dist-uniform {
+            sb_sleep_dist uniform min=200 max=300;
+            proxy_pass http://localhost:9000/;
+        }
+
         location = /server-delay-test {
             proxy_pass http://localhost:9000/;
         }
+
+        # Test with a 300ms sleep before the response header
+        location = /sleep-at-header {
+            sb_sleep_at header;
+            sb_sleep_ms 300;
+            return 200 "Delayed header\n";
+        }
+
+        # Test with a 300ms sleep before the end of a static response
+        location = /index.html {
+            sb_sleep_at last_buf;
+            sb_sleep_ms 300;
+            root $TEST_DIR/nginx/html;
+        }
+
+        # Test with the response body throttled to 32 KiB/s
+        location = /throttle.txt {
+            sb_throttle_rate 32k;
+            root $TEST_DIR/nginx/html;
+        }
+
+        # A 2s sleep the client gives up on
+        location = /sleep-abort {
+            sb_sleep_ms 2000;
+            proxy_pass http://localhost:9000/;
+        }
+
+        # One 500ms sleeper at a time, further requests are not delayed
+        location = /sleep-limited {
+            sb_sleep_max_concurrent 1;
+            sb_sleep_ms 500;
+            proxy_pass http://localhost:$TEST_PORT/;
+        }
+
+        # One 500ms sleeper at a time, further requests are rejected
+        location = /sleep-limited-503 {
+            sb_sleep_max_concurrent 1 status=503;
+            sb_sleep_ms 500;
+            proxy_pass http://localhost:$TEST_PORT/;
+        }
+
+        # The first two requests sleep 300ms, later ones are not delayed
+        location = /sleep-budget {
+            sb_sleep_budget 2 chunk=1;
+            sb_sleep_ms 300;
+            proxy_pass http://localhost:$TEST_PORT/;
+        }
+
+        # Two 500ms header sleeps, requests skipped by the limit keep the budget
+        location = /sleep-budget-limited {
+            sb_sleep_at header;
+            sb_sleep_max_concurrent 1;
+            sb_sleep_budget 2 chunk=1;
+            sb_sleep_ms 500;
+            proxy_pass http://localhost:$TEST_PORT/;
+        }
+
+        # 300ms for one tenant, by header or by cookie
+        location = /sleep-rule {
+            sb_sleep_rule header=X-Tenant value=acme ms=300;
+            sb_sleep_rule cookie=tenant value=beta ms=300;
+            proxy_pass http://localhost:$TEST_PORT/;
+        }
+
+        # A 300ms sleep during a window that is still open
+        location = /window-open {
+            sb_sleep_ms 300;
+            sb_sleep_window duration=1h;
+            proxy_pass http://localhost:$TEST_PORT/;
+        }
+
+        # A 300ms sleep during a window that closed long ago
+        location = /window-expired {
+            sb_sleep_ms 300;
+            sb_sleep_window start=1000000000 duration=60s;
+            proxy_pass http://localhost:$TEST_PORT/;
+        }
+
+        # A 300ms sleep, then a 503
+        location = /fault-status {
+            sb_sleep_ms 300;
+            sb_fault status=503;
+            proxy_pass http://localhost:$TEST_PORT/;
+        }
+
+        # A connection reset without a response
+        location = /fault-reset {
+            sb_fault reset;
+            proxy_pass http://localhost:$TEST_PORT/;
+        }
+
+        # A 250ms sleep given in microseconds, woken by the precise scheduler
+        location = /sleep-us-precise {
+            sb_sleep_scheduler precise;
+            sb_sleep_us 250000;
+            proxy_pass http://localhost:$TEST_PORT/;
+        }
+
+        # A 200ms sleep marked in the response, the upstream request and tracestate
+        location = /annotate {
+            sb_sleep_ms 200;
+            sb_sleep_annotate response upstream tracestate;
+            proxy_pass http://localhost:$TEST_PORT/echo-annotations;
+        }
+
+        # Echoes the annotations the upstream request arrived with
+        location = /echo-annotations {
+            return 200 "\$http_x_sb_injected_delay \$http_tracestate\n";
+        }
+
+        # Reading the request body pauses 300ms, with the buffered reader
+        location = /rbody {
+            sb_sleep_request_body 300ms;
+            proxy_pass http://localhost:$TEST_PORT/rbody-sink?buffered;
+        }
+
+        # Reading the request body pauses 300ms, passed on unbuffered
+        location = /rbody-unbuffered {
+            sb_sleep_request_body 300ms;
+            proxy_request_buffering off;
+            proxy_pass http://localhost:$TEST_PORT/rbody-sink?unbuffered;
+        }
+
+        # Reads the whole request body and logs how much arrived
+        location = /rbody-sink {
+            access_log $TEST_DIR/nginx/logs/rbody.log rbody;
+            proxy_pass http://localhost:$TEST_PORT/;
+        }
+
+        # Proxied through upstreams with sb_upstream_sleep_ms and keepalive
+        location = /upstream-sleep {
+            proxy_http_version 1.1;
+            proxy_set_header Connection "";
+            proxy_pass http://sleep_backend/upstream-sink;
+        }
+
+        location = /upstream-peer-sleep {
+            proxy_http_version 1.1;
+            proxy_set_header Connection "";
+            proxy_pass http://sleep_peer_backend/upstream-sink?peer;
+        }
+
+        # Logs the connection upstream requests arrive on
+        location = /upstream-sink {
+            access_log $TEST_DIR/nginx/logs/upstream.log upstream;
+            return 200 "upstream\n";
+        }
+
+        # A 300ms sleep, then try_files falls back to a sleeping location: sleeps once
+        location = /once-try-files {
+            sb_sleep_ms 300;
+            try_files /missing @once-fallback;
+        }
+
+        # A 300ms sleep, then a 404 redirected by error_page: sleeps once
+        location = /once-error-page {
+            sb_sleep_ms 300;
+            root $TEST_DIR/nginx/html/missing;
+            error_page 404 = @once-fallback;
+        }
+
+        location @once-fallback {
+            sb_sleep_ms 300;
+            proxy_pass http://localhost:$TEST_PORT/;
+        }
+
+        # SSI pages including a location with a 300ms sleep
+        location ~ ^/ssi-(main|each)\.html$ {
+            ssi on;
+            root $TEST_DIR/nginx/html;
+        }
+
+        # Subrequests do not sleep with sb_sleep_once main
+        location = /ssi-sleep-main {
+            sb_sleep_ms 300;
+            sb_sleep_phase precontent;
+            alias $TEST_DIR/nginx/html/included.txt;
+        }
+
+        # Subrequests sleep with sb_sleep_once each in the precontent phase
+        location = /ssi-sleep-each {
+            sb_sleep_ms 300;
+            sb_sleep_phase precontent;
+            sb_sleep_once each;
+            alias $TEST_DIR/nginx/html/included.txt;
+        }
+
+        # Sleep statistics in Prometheus format
+        location = /sb-status {
+            sb_sleep_status;
+        }
+
+        # Control endpoint for the rules in sb_sleep_zone
+        location = /sb-api {
+            sb_sleep_api;
+        }
+    }
+}
+
+stream {
+    # TCP proxy to the test server, sessions delayed by 400ms
+    server {
+        listen $STREAM_PORT;
+        sb_sleep_ms 400ms;
+        proxy_pass 127.0.0.1:$TEST_PORT;
+    }
+
+    # TCP proxy to the test server, every chunk of data delayed by 300ms
+    server {
+        listen $PACKET_PORT;
+        sb_sleep_packet_ms 300ms;
+        proxy_pass 127.0.0.1:$TEST_PORT;
     }
 }
 EOF
@@ -230,13 +508,14 @@ curl -s "http://localhost:$TEST_PORT/" || echo "Failed to connect to Nginx serve
 test_endpoint() {
     endpoint=$1
     expected_time=$2
+    port=${3:-$TEST_PORT}
 
     echo ""
     echo "Testing $endpoint (expected ~$expected_time ms)..."
-    echo "Command: curl -v http://localhost:$TEST_PORT$endpoint"
+    echo "Command: curl -v http://localhost:$port$endpoint"
 
     # First get verbose output to debug connectivity
-    curl -v "http://localhost:$TEST_PORT$endpoint" 2>&1 | head -n 20
+    curl -v "http://localhost:$port$endpoint" 2>&1 | head -n 20
 
     # Then measure timing with multiple requests to get a better average
     total_duration=0
@@ -244,7 +523,7 @@ test_endpoint() {
 
     for i in $(seq 1 $num_requests); do
         start_time=$(date +%s.%N)
-        response=$(curl -s "http://localhost:$TEST_PORT$endpoint")
+        response=$(curl -s "http://localhost:$port$endpoint")
         end_time=$(date +%s.%N)
 
         duration=$(echo "($end_time - $start_time) * 1000" | bc)
@@ -265,6 +544,42 @@ test_endpoint() {
     fi
 }
 
+# Function to check the status code of a request; further arguments go to curl
+test_status() {
+    description=$1
+    expected=$2
+    shift 2
+
+    status=$(curl -s -o /dev/null -w '%{http_code}' "$@") || true  # 000 without a response
+    if [ "$status" = "$expected" ]; then
+        echo "✅ Test passed! $description: $status"
+    else
+        echo "❌ Test failed! $description: got $status, expected $expected"
+        FAILED=1
+    fi
+}
+
+# Function to check that a single request takes between min and max ms;
+# further arguments go to curl
+test_range() {
+    endpoint=$1
+    min=$2
+    max=$3
+    shift 3
+
+    start_time=$(date +%s.%N)
+    response=$(curl -s "$@" "http://localhost:$TEST_PORT$endpoint")
+    end_time=$(date +%s.%N)
+    duration=$(echo "($end_time - $start_time) * 1000" | bc)
+
+    if [ $(echo "$duration >= $min * 0.8 && $duration <= $max" | bc) -eq 1 ]; then
+        echo "✅ Test passed! $endpoint took $duration ms, expected $min to $max ms"
+    else
+        echo "❌ Test failed! $endpoint took $duration ms, expected $min to $max ms"
+        FAILED=1
+    fi
+}
+
 # Track overall test status
 FAILED=0
 
@@ -275,7 +590,242 @@ test_endpoint "/" 0
 test_endpoint "/sleep-100ms" 100
 test_endpoint "/sleep-500ms" 500
 test_endpoint "/sleep-1s" 1000
+test_endpoint "/sleep-wheel-500ms" 500
+test_endpoint "/sleep-dist-uniform" 200
 test_endpoint "/server-delay-test" 300
+test_endpoint "/sleep-at-header" 300
+test_endpoint "/index.html" 300
+test_endpoint "/throttle.txt" 1800
+test_endpoint "/" 400 $STREAM_PORT
+
+# The statistics must have counted the delayed requests above
+echo ""
+echo "=== Testing /sb-status ==="
+status=$(curl -s "http://localhost:$TEST_PORT/sb-status")
+echo "$status" | grep '^sb_sleep_delayed_total'
+if echo "$status" | grep -q '^sb_sleep_delayed_total{worker="[0-9]*"} [1-9]'; then
+    echo "✅ Test passed! /sb-status reports delayed requests"
+else
+    echo "❌ Test failed! /sb-status reports no delayed requests"
+    FAILED=1
+fi
+
+# The upstream closes right after its response, which is still held then
+echo ""
+echo "=== Testing stream data held across upstream EOF ==="
+start_time=$(date +%s.%N)
+response=$(curl -s --http1.0 "http://localhost:$PACKET_PORT/")
+end_time=$(date +%s.%N)
+duration=$(echo "($end_time - $start_time) * 1000" | bc)
+if [ "$response" = "No sleep" ] && [ $(echo "$duration >= 300 * 0.8" | bc) -eq 1 ]; then
+    echo "✅ Test passed! Delayed response arrived complete after $duration ms"
+else
+    echo "❌ Test failed! Got \"$response\" after $duration ms, expected \"No sleep\" after ~300 ms"
+    FAILED=1
+fi
+
+# A client leaving during the sleep finalizes the request at once, with 499
+echo ""
+echo "=== Testing client abort during a sleep ==="
+curl -s --max-time 0.3 "http://localhost:$TEST_PORT/sleep-abort" > /dev/null || true
+sleep 0.5
+line=$(grep '"GET /sleep-abort ' $TEST_DIR/nginx/logs/access.log | tail -n 1)
+echo "$line"
+if echo "$line" | grep -q '" 499 .*rt=0\.'; then
+    echo "✅ Test passed! Aborted sleep was logged with 499 before the delay was over"
+else
+    echo "❌ Test failed! Aborted sleep was not finalized early with 499"
+    FAILED=1
+fi
+
+# With one request sleeping, the next one is skipped or rejected
+echo ""
+echo "=== Testing sb_sleep_max_concurrent ==="
+curl -s "http://localhost:$TEST_PORT/sleep-limited" > /dev/null &
+sleep 0.1
+test_range "/sleep-limited" 0 250
+wait
+curl -s "http://localhost:$TEST_PORT/sleep-limited-503" > /dev/null &
+sleep 0.1
+test_status "Request over the limit" 503 "http://localhost:$TEST_PORT/sleep-limited-503"
+wait
+
+# A budget delays exactly its number of requests
+echo ""
+echo "=== Testing sb_sleep_budget ==="
+test_range "/sleep-budget" 300 550
+test_range "/sleep-budget" 300 550
+test_range "/sleep-budget" 0 200
+test_range "/sleep-budget" 0 200
+curl -s "http://localhost:$TEST_PORT/sleep-budget-limited" > /dev/null &
+sleep 0.1
+test_range "/sleep-budget-limited" 0 250
+wait
+test_range "/sleep-budget-limited" 500 750
+test_range "/sleep-budget-limited" 0 250
+
+# Only requests matching a rule are delayed
+echo ""
+echo "=== Testing sb_sleep_rule ==="
+test_range "/sleep-rule" 300 550 -H "X-Tenant: ACME"
+test_range "/sleep-rule" 300 550 -b "lang=de; tenant=beta"
+test_range "/sleep-rule" 0 200 -H "X-Tenant: other" -b "tenant=other"
+
+# Delays stop once their window has passed
+echo ""
+echo "=== Testing sb_sleep_window ==="
+test_range "/window-open" 300 550
+test_range "/window-expired" 0 200
+
+# Faults fail requests after their sleep, or reset the connection
+echo ""
+echo "=== Testing sb_fault ==="
+test_status "Status fault" 503 "http://localhost:$TEST_PORT/fault-status"
+test_range "/fault-status" 300 550
+test_status "Reset fault" 000 "http://localhost:$TEST_PORT/fault-reset"
+if curl -s "http://localhost:$TEST_PORT/fault-reset" > /dev/null 2>&1; then
+    echo "❌ Test failed! /fault-reset returned a response"
+    FAILED=1
+else
+    echo "✅ Test passed! /fault-reset closed the connection without a response (curl exit $?)"
+fi
+
+# Microsecond delays on the precise scheduler
+echo ""
+echo "=== Testing sb_sleep_us with the precise scheduler ==="
+test_range "/sleep-us-precise" 250 450
+if grep -q 'timerfd.*failed' $TEST_DIR/nginx/logs/error.log; then
+    echo "❌ Test failed! The precise scheduler logged timerfd alerts"
+    FAILED=1
+fi
+
+# Configuration errors: a non-numeric delay is rejected at nginx -t
+echo ""
+echo "=== Testing that an invalid sb_sleep_ms fails nginx -t ==="
+cat > $TEST_DIR/nginx/conf/invalid.conf << EOF
+load_module $TEST_DIR/nginx/modules/ngx_steadybit_sleep_module.so;
+
+error_log $TEST_DIR/nginx/logs/invalid.log;
+pid $TEST_DIR/nginx/logs/invalid.pid;
+
+events {
+    worker_connections 16;
+}
+
+http {
+    server {
+        listen $TEST_PORT;
+
+        location / {
+            sb_sleep_ms abc;
+        }
+    }
+}
+EOF
+if $NGINX_BIN -t -c $TEST_DIR/nginx/conf/invalid.conf > $TEST_DIR/invalid.out 2>&1; then
+    echo "❌ Test failed! nginx -t accepted sb_sleep_ms abc"
+    FAILED=1
+elif grep -q 'invalid value "abc"' $TEST_DIR/invalid.out; then
+    echo "✅ Test passed! nginx -t rejected sb_sleep_ms abc"
+else
+    echo "❌ Test failed! nginx -t failed without the invalid value error:"
+    cat $TEST_DIR/invalid.out
+    FAILED=1
+fi
+
+# Delay annotations in the response and the upstream request
+echo ""
+echo "=== Testing sb_sleep_annotate ==="
+body=$(curl -s -D $TEST_DIR/annotate.headers \
+    -H "traceparent: 00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01" \
+    -H "tracestate: sb=delay:5,vendor=1" \
+    "http://localhost:$TEST_PORT/annotate" || true)
+delay=$(grep -i '^X-Sb-Injected-Delay:' $TEST_DIR/annotate.headers | tr -dc '0-9')
+if [ -n "$delay" ] && [ "$delay" -ge 200 ]; then
+    echo "✅ Test passed! X-Sb-Injected-Delay response header is ${delay}ms"
+else
+    echo "❌ Test failed! Expected X-Sb-Injected-Delay >= 200, got '$delay'"
+    FAILED=1
+fi
+if echo "$body" | grep -Eq '^[0-9]+ sb=delay:[0-9]+,vendor=1$' \
+    && ! echo "$body" | grep -q 'sb=delay:5,'; then
+    echo "✅ Test passed! Upstream got the delay header and tracestate: $body"
+else
+    echo "❌ Test failed! Expected '<ms> sb=delay:<ms>,vendor=1' upstream, got '$body'"
+    FAILED=1
+fi
+
+# Request body pauses, with the body passed on in full
+echo ""
+echo "=== Testing sb_sleep_request_body ==="
+head -c 262144 /dev/zero > $TEST_DIR/body.bin
+for endpoint in rbody rbody-unbuffered; do
+    test_range "/$endpoint" 300 550 --data-binary @$TEST_DIR/body.bin
+    test_status "POST to /$endpoint" 200 --data-binary @$TEST_DIR/body.bin \
+        "http://localhost:$TEST_PORT/$endpoint"
+done
+sleep 0.1
+for mode in buffered unbuffered; do
+    len=$(grep "?$mode " $TEST_DIR/nginx/logs/rbody.log | tail -n 1 | sed 's/.*len=//')
+    if [ -n "$len" ] && [ "$len" -ge 262144 ]; then
+        echo "✅ Test passed! The $mode body reached the upstream in full ($len bytes)"
+    else
+        echo "❌ Test failed! The $mode body reached the upstream with '$len' bytes, expected 262144 and more"
+        FAILED=1
+    fi
+done
+
+# Upstream sleeps, per peer and on reused keepalive connections
+echo ""
+echo "=== Testing sb_upstream_sleep_ms ==="
+test_range "/upstream-sleep" 300 550
+test_range "/upstream-sleep" 300 550
+sleep 0.1
+requests=$(grep -v '?peer ' $TEST_DIR/nginx/logs/upstream.log | tail -n 1 | sed 's/.*requests=//')
+if [ -n "$requests" ] && [ "$requests" -ge 2 ]; then
+    echo "✅ Test passed! The second delayed request reused a keepalive connection (request $requests on it)"
+else
+    echo "❌ Test failed! Expected the second request on a reused upstream connection, got '$requests'"
+    FAILED=1
+fi
+test_range "/upstream-peer-sleep" 400 650
+test_range "/upstream-peer-sleep" 400 650
+
+# sb_sleep_once main: one sleep per client request, none in subrequests
+echo ""
+echo "=== Testing sb_sleep_once ==="
+test_range "/once-try-files" 300 550
+test_range "/once-error-page" 300 550
+test_range "/ssi-main.html" 0 200
+test_range "/ssi-each.html" 300 550
+if curl -s "http://localhost:$TEST_PORT/ssi-each.html" | grep -q "Included"; then
+    echo "✅ Test passed! The sleeping subrequest's output was included"
+else
+    echo "❌ Test failed! The sleeping subrequest's output is missing"
+    FAILED=1
+fi
+
+# A DELETE naming only part of a rule must not remove all rules
+echo ""
+echo "=== Testing /sb-api ==="
+API="http://localhost:$TEST_PORT/sb-api"
+test_status "Set rule" 200 -X PUT "$API?type=location&key=/api-test&ms=300"
+test_status "DELETE with type only" 400 -X DELETE "$API?type=host"
+test_status "DELETE with key only" 400 -X DELETE "$API?key=/api-test"
+test_status "DELETE with empty key" 400 -X DELETE "$API?type=host&key="
+if curl -s "$API" | grep -q '"key":"/api-test"'; then
+    echo "✅ Test passed! Rejected DELETEs kept the rule"
+else
+    echo "❌ Test failed! Rejected DELETEs removed the rule"
+    FAILED=1
+fi
+test_status "DELETE one rule" 200 -X DELETE "$API?type=location&key=/api-test"
+if curl -s "$API" | grep -q '"key":"/api-test"'; then
+    echo "❌ Test failed! DELETE did not remove the rule"
+    FAILED=1
+else
+    echo "✅ Test passed! DELETE removed the rule"
+fi
 
 # Check Nginx logs
 echo ""